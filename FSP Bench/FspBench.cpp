@@ -0,0 +1,143 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Measures the turnaround of CC_GET_FILE requests the way Swiss issues them: one request in flight,
+// the next one is sent as soon as the response has arrived.
+
+const uint8_t CC_GET_FILE = 0x42;
+const size_t HEADER_LENGTH = 12;
+
+char getChecksum(const std::vector<char>& message)
+{
+	uint32_t actual = static_cast<uint32_t>(message.size());
+	for (size_t i = 0; i < message.size(); ++i) {
+		actual += (i == 1) ? 0 : static_cast<uint8_t>(message[i]);
+	}
+
+	actual += actual >> 8;
+	return static_cast<char>(actual & 0xFF);
+}
+
+std::vector<char> createRequest(const std::string& path, uint16_t sequence, uint32_t position, uint16_t blockSize)
+{
+	// Header, null terminated path and the preferred block size as extra data
+	std::vector<char> message(HEADER_LENGTH + path.size() + 3);
+	message[0] = CC_GET_FILE;
+
+	uint16_t value = htons(sequence);
+	std::memcpy(message.data() + 4, &value, sizeof(value));
+	value = htons(static_cast<uint16_t>(path.size() + 1));
+	std::memcpy(message.data() + 6, &value, sizeof(value));
+	uint32_t filePosition = htonl(position);
+	std::memcpy(message.data() + 8, &filePosition, sizeof(filePosition));
+
+	std::memcpy(message.data() + HEADER_LENGTH, path.data(), path.size());
+	message[HEADER_LENGTH + path.size()] = '\0';
+	message[HEADER_LENGTH + path.size() + 1] = static_cast<char>(blockSize >> 8);
+	message[HEADER_LENGTH + path.size() + 2] = static_cast<char>(blockSize & 0xFF);
+	message[1] = getChecksum(message);
+
+	return message;
+}
+
+double percentile(const std::vector<double>& sorted, double fraction)
+{
+	size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+	return sorted[std::min(index, sorted.size() - 1)];
+}
+
+int main(int argumentCount, char* arguments[])
+{
+	if (argumentCount < 3) {
+		std::cout << "Usage: fsp_bench [ip:port] [file] [requests, default 10000] [block size, default 1024]" << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	std::string address = arguments[1];
+	std::string path = arguments[2];
+	unsigned long requests = argumentCount < 4 ? 10000 : std::stoul(arguments[3]);
+	uint16_t blockSize = static_cast<uint16_t>(argumentCount < 5 ? 1024 : std::stoul(arguments[4]));
+
+	sockaddr_in server = {};
+	server.sin_family = AF_INET;
+	size_t colon = address.find(':');
+	server.sin_port = htons(colon == std::string::npos ? 21 : static_cast<uint16_t>(std::stoul(address.substr(colon + 1))));
+	if (inet_pton(AF_INET, address.substr(0, colon).c_str(), &server.sin_addr) != 1) {
+		std::cout << "Could not parse ipv4 address" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	int wSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (wSocket < 0 || connect(wSocket, (sockaddr*)&server, sizeof(server)) != 0) {
+		std::cout << "Could not connect socket. Error: " << std::strerror(errno) << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	timeval timeout = { 1, 0 };
+	setsockopt(wSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	std::vector<double> turnarounds;
+	turnarounds.reserve(requests);
+	std::vector<char> response(HEADER_LENGTH + 65536);
+	uint32_t position = 0;
+	unsigned long lost = 0;
+
+	for (unsigned long i = 0; i < requests; i++) {
+		uint16_t sequence = static_cast<uint16_t>(i);
+		std::vector<char> request = createRequest(path, sequence, position, blockSize);
+
+		auto start = std::chrono::steady_clock::now();
+		send(wSocket, request.data(), request.size(), 0);
+
+		// Stale responses of timed out requests are skipped by their sequence number
+		ssize_t received;
+		uint16_t responseSequence;
+		do {
+			received = recv(wSocket, response.data(), response.size(), 0);
+			std::memcpy(&responseSequence, response.data() + 4, sizeof(responseSequence));
+		} while (static_cast<ssize_t>(HEADER_LENGTH) <= received && ntohs(responseSequence) != sequence);
+
+		auto end = std::chrono::steady_clock::now();
+		if (received < static_cast<ssize_t>(HEADER_LENGTH)) {
+			lost++;
+			continue;
+		}
+
+		turnarounds.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+
+		uint16_t dataLength;
+		std::memcpy(&dataLength, response.data() + 6, sizeof(dataLength));
+		position = ntohs(dataLength) < blockSize ? 0 : position + blockSize;
+	}
+
+	close(wSocket);
+
+	if (turnarounds.empty()) {
+		std::cout << "No responses received" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::sort(turnarounds.begin(), turnarounds.end());
+	double sum = 0;
+	for (double turnaround : turnarounds) {
+		sum += turnaround;
+	}
+
+	std::cout << "Requests: " << requests << ", lost: " << lost << ", block size: " << blockSize << std::endl;
+	std::cout << "Turnaround in us: avg " << sum / turnarounds.size()
+		<< ", p50 " << percentile(turnarounds, 0.5)
+		<< ", p90 " << percentile(turnarounds, 0.9)
+		<< ", p99 " << percentile(turnarounds, 0.99)
+		<< ", max " << turnarounds.back() << std::endl;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "DirectoryScanner.h"
+#include "FspDirEnt.h"
+
+// Compares the ways a directory can be read for CC_GET_DIR: std::filesystem::directory_iterator as
+// used before, DirectoryScanner with one statx system call per entry and with the statx calls batched
+// through io_uring. Every entry is encoded the same way the server sends it.
+
+size_t iterateDirectory(const std::filesystem::path& directory)
+{
+	size_t bytes = 0;
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+		try
+		{
+			bytes += FspDirEnt(entry).getRawBytes().size();
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+
+	return bytes;
+}
+
+size_t scanDirectory(const std::filesystem::path& directory, bool batched)
+{
+	DirectoryScanner scanner(directory, batched);
+	std::vector<std::vector<uint8_t>> entries;
+	while (scanner.read(entries, 256)) {
+	}
+
+	size_t bytes = 0;
+	for (const auto& entry : entries) {
+		bytes += entry.size();
+	}
+
+	return bytes;
+}
+
+// Best of all rounds in milliseconds, the page cache is warm after the first one
+double measure(const std::function<size_t()>& read, unsigned long rounds, size_t& bytes)
+{
+	double best = 0;
+	for (unsigned long i = 0; i < rounds; i++) {
+		auto start = std::chrono::steady_clock::now();
+		bytes = read();
+		double duration = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		best = i == 0 ? duration : std::min(best, duration);
+	}
+
+	return best;
+}
+
+int main(int argumentCount, char* arguments[])
+{
+	if (argumentCount < 2) {
+		std::cout << "Usage: fsp_listing_bench [directory] [rounds, default 5]" << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	std::filesystem::path base = arguments[1];
+	unsigned long rounds = argumentCount < 3 ? 5 : std::max(1UL, std::stoul(arguments[2]));
+
+	for (size_t count : { 10000, 100000 }) {
+		// Created once and reused by later runs
+		std::filesystem::path directory = base / ("fsp_listing_bench_" + std::to_string(count));
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		for (size_t i = 0; i < count; i++) {
+			std::filesystem::path file = directory / ("image_" + std::to_string(i) + ".iso");
+			if (!std::filesystem::exists(file, error)) {
+				std::ofstream(file).put('\0');
+			}
+		}
+
+		size_t iteratedBytes;
+		size_t statxBytes;
+		size_t batchedBytes;
+		double iterated = measure([&directory]() { return iterateDirectory(directory); }, rounds, iteratedBytes);
+		double statx = measure([&directory]() { return scanDirectory(directory, false); }, rounds, statxBytes);
+		double batched = measure([&directory]() { return scanDirectory(directory, true); }, rounds, batchedBytes);
+
+		std::cout << count << " entries in ms: directory_iterator " << iterated << ", statx " << statx << ", io_uring statx " << batched << std::endl;
+		if (iteratedBytes != statxBytes || iteratedBytes != batchedBytes) {
+			std::cout << "Error: listings differ in size" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#pragma once
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <utility>
+
+// Runs the I/O of asynchronous request handlers. Completion callbacks are
+// always invoked on the thread that drives the socket, so a resumed handler
+// can keep using its session without locking.
+class AsyncExecutor
+{
+public:
+	virtual ~AsyncExecutor() = default;
+
+	// Callbacks receive the number of transferred bytes or a negative errno
+	virtual void read(int fd, void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback) = 0;
+	virtual void write(int fd, const void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback) = 0;
+
+	// Runs blocking work (directory scans, renames, ...) off the socket thread
+	virtual void run(std::function<void()> work, std::function<void()> callback) = 0;
+
+	auto readAsync(int fd, void* buffer, uint32_t length, uint64_t offset)
+	{
+		return IoAwaiter(*this, false, fd, buffer, length, offset);
+	}
+
+	auto writeAsync(int fd, const void* buffer, uint32_t length, uint64_t offset)
+	{
+		return IoAwaiter(*this, true, fd, const_cast<void*>(buffer), length, offset);
+	}
+
+	template<typename Function>
+	auto runAsync(Function function)
+	{
+		return RunAwaiter<Function>(*this, std::move(function));
+	}
+
+private:
+	struct IoAwaiter
+	{
+		AsyncExecutor& executor;
+		bool isWrite;
+		int fd;
+		void* buffer;
+		uint32_t length;
+		uint64_t offset;
+		int result = 0;
+
+		IoAwaiter(AsyncExecutor& setExecutor, bool setIsWrite, int setFd, void* setBuffer, uint32_t setLength, uint64_t setOffset)
+			: executor(setExecutor), isWrite(setIsWrite), fd(setFd), buffer(setBuffer), length(setLength), offset(setOffset)
+		{
+		}
+
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			auto callback = [this, handle](int value) {
+				result = value;
+				handle.resume();
+			};
+
+			if (isWrite) {
+				executor.write(fd, buffer, length, offset, callback);
+			}
+			else
+			{
+				executor.read(fd, buffer, length, offset, callback);
+			}
+		}
+
+		int await_resume() noexcept
+		{
+			return result;
+		}
+	};
+
+	template<typename Function>
+	struct RunAwaiter
+	{
+		using Result = decltype(std::declval<Function&>()());
+
+		AsyncExecutor& executor;
+		Function function;
+		std::optional<Result> result;
+		std::exception_ptr error;
+
+		RunAwaiter(AsyncExecutor& setExecutor, Function setFunction) : executor(setExecutor), function(std::move(setFunction))
+		{
+		}
+
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			auto work = [this]() {
+				try
+				{
+					result.emplace(function());
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+			};
+
+			executor.run(work, [handle]() { handle.resume(); });
+		}
+
+		Result await_resume()
+		{
+			if (error) {
+				std::rethrow_exception(error);
+			}
+
+			return std::move(*result);
+		}
+	};
+};
@@ -0,0 +1,347 @@
+#include "BlockCache.h"
+#include "FspStats.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+char* BlockCache::memory = nullptr;
+size_t BlockCache::slotsPerShard = 0;
+size_t BlockCache::blocksPerShard = 0;
+BlockCache::Shard BlockCache::shards[BlockCache::SHARD_COUNT];
+bool BlockCache::deduplicate = false;
+BlockCache::ContentShard BlockCache::contentShards[BlockCache::SHARD_COUNT];
+std::vector<uint32_t> BlockCache::slotReferences;
+std::vector<uint32_t> BlockCache::slotLengths;
+std::vector<uint64_t> BlockCache::slotHashes;
+std::mutex BlockCache::freeMutex;
+std::vector<uint32_t> BlockCache::freeSlots;
+
+size_t BlockCache::KeyHash::operator()(const Key& key) const
+{
+	return std::hash<uint64_t>()(key.file * 0x9E3779B97F4A7C15ULL ^ key.block);
+}
+
+void BlockCache::configure(uint64_t budget, bool hugePages, bool deduplicate)
+{
+	slotsPerShard = static_cast<size_t>(budget / BLOCK_SIZE / SHARD_COUNT);
+	if (slotsPerShard == 0) {
+		return;
+	}
+
+	size_t size = slotsPerShard * SHARD_COUNT * BLOCK_SIZE;
+#ifdef _WIN32
+	if (hugePages) {
+		std::cout << "Huge pages are not supported on this platform" << std::endl;
+	}
+
+	memory = static_cast<char*>(VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+	void* area = MAP_FAILED;
+	if (hugePages) {
+		// Reserved huge pages first, transparent huge pages otherwise. Without MAP_NORESERVE the
+		// mapping fails up front instead of faulting later when too few huge pages are reserved.
+		area = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (area == MAP_FAILED) {
+			area = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (area != MAP_FAILED && madvise(area, size, MADV_HUGEPAGE) != 0) {
+				std::cout << "Could not enable huge pages for the block cache" << std::endl;
+			}
+		}
+	}
+	else
+	{
+		area = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+
+	memory = area == MAP_FAILED ? nullptr : static_cast<char*>(area);
+#endif
+
+	if (memory == nullptr) {
+		std::cout << "Error: Could not allocate " << size / (1024 * 1024) << " MiB for the block cache" << std::endl;
+		slotsPerShard = 0;
+		return;
+	}
+
+	BlockCache::deduplicate = deduplicate;
+	blocksPerShard = deduplicate ? slotsPerShard * 2 : slotsPerShard;
+	if (deduplicate) {
+		size_t slotCount = slotsPerShard * SHARD_COUNT;
+		slotReferences.resize(slotCount, 0);
+		slotLengths.resize(slotCount, 0);
+		slotHashes.resize(slotCount, 0);
+		freeSlots.reserve(slotCount);
+		for (size_t slot = slotCount; 0 < slot; slot--) {
+			freeSlots.push_back(static_cast<uint32_t>(slot - 1));
+		}
+	}
+
+	for (size_t i = 0; i < SHARD_COUNT; i++) {
+		if (!deduplicate) {
+			shards[i].freeSlots.reserve(slotsPerShard);
+			for (size_t slot = 0; slot < slotsPerShard; slot++) {
+				shards[i].freeSlots.push_back(static_cast<uint32_t>(i * slotsPerShard + slot));
+			}
+		}
+
+		shards[i].index.reserve(blocksPerShard);
+	}
+}
+
+bool BlockCache::isEnabled()
+{
+	return memory != nullptr;
+}
+
+BlockCache::Shard& BlockCache::getShard(const Key& key)
+{
+	return shards[KeyHash()(key) % SHARD_COUNT];
+}
+
+bool BlockCache::copyBlock(const Key& key, char* buffer, size_t offset, size_t length)
+{
+	Shard& shard = getShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto iterator = shard.index.find(key);
+	if (iterator == shard.index.end() || iterator->second->length < offset + length) {
+		FspStats::blockCacheMisses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	auto block = iterator->second;
+	std::memcpy(buffer, memory + static_cast<size_t>(block->slot) * BLOCK_SIZE + offset, length);
+	FspStats::blockCacheHits.fetch_add(1, std::memory_order_relaxed);
+
+	if (block->isProtected) {
+		shard.protectedBlocks.splice(shard.protectedBlocks.begin(), shard.protectedBlocks, block);
+	}
+	else if (PROMOTION_AGE <= std::chrono::steady_clock::now() - block->inserted) {
+		block->isProtected = true;
+		shard.protectedBlocks.splice(shard.protectedBlocks.begin(), shard.probation, block);
+
+		// An overfull protected segment hands its oldest block back to probation
+		if (blocksPerShard * PROTECTED_SHARE / 100 < shard.protectedBlocks.size()) {
+			auto demoted = std::prev(shard.protectedBlocks.end());
+			demoted->isProtected = false;
+			shard.probation.splice(shard.probation.begin(), shard.protectedBlocks, demoted);
+		}
+	}
+	else
+	{
+		shard.probation.splice(shard.probation.begin(), shard.probation, block);
+	}
+
+	return true;
+}
+
+bool BlockCache::lookup(const FileHandle& file, char* buffer, size_t length, uint64_t position)
+{
+	while (0 < length) {
+		size_t offset = static_cast<size_t>(position % BLOCK_SIZE);
+		size_t chunk = std::min<size_t>(length, BLOCK_SIZE - offset);
+		if (!copyBlock({ file.id, position / BLOCK_SIZE }, buffer, offset, chunk)) {
+			return false;
+		}
+
+		buffer += chunk;
+		position += chunk;
+		length -= chunk;
+	}
+
+	return true;
+}
+
+void BlockCache::insert(const FileHandle& file, uint64_t position, const char* data, size_t length)
+{
+	Key key = { file.id, position / BLOCK_SIZE };
+	Shard& shard = getShard(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	if (shard.index.contains(key)) {
+		// Another thread read the same block in the meantime
+		return;
+	}
+
+	if (blocksPerShard <= shard.index.size()) {
+		evict(shard);
+	}
+
+	uint32_t slot = NO_SLOT;
+	if (!deduplicate) {
+		slot = shard.freeSlots.back();
+		shard.freeSlots.pop_back();
+		std::memcpy(memory + static_cast<size_t>(slot) * BLOCK_SIZE, data, length);
+	}
+	else
+	{
+		uint64_t hash = hashContent(data, length);
+		slot = findSharedSlot(hash, data, length);
+		if (slot == NO_SLOT) {
+			// Slots are shared with the other shards, blocks of this one are dropped until one is free
+			while ((slot = takeFreeSlot()) == NO_SLOT) {
+				if (!evict(shard)) {
+					return;
+				}
+			}
+
+			std::memcpy(memory + static_cast<size_t>(slot) * BLOCK_SIZE, data, length);
+			publishSlot(slot, hash, length);
+		}
+
+		FspStats::blockCacheLogicalBytes.fetch_add(length, std::memory_order_relaxed);
+	}
+
+	shard.probation.push_front({ key, slot, static_cast<uint32_t>(length), false, std::chrono::steady_clock::now() });
+	shard.index[key] = shard.probation.begin();
+}
+
+bool BlockCache::evict(Shard& shard)
+{
+	// Probation blocks go first, the protected segment is only reclaimed once probation is empty
+	std::list<Block>& victims = shard.probation.empty() ? shard.protectedBlocks : shard.probation;
+	if (victims.empty()) {
+		return false;
+	}
+
+	Block& victim = victims.back();
+	if (deduplicate) {
+		FspStats::blockCacheLogicalBytes.fetch_sub(victim.length, std::memory_order_relaxed);
+		releaseSlot(victim.slot);
+	}
+	else
+	{
+		shard.freeSlots.push_back(victim.slot);
+	}
+
+	shard.index.erase(victim.key);
+	victims.pop_back();
+	FspStats::blockCacheEvictions.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+uint64_t BlockCache::hashContent(const char* data, size_t length)
+{
+	// Word-wise multiplicative hash, collisions are caught by comparing the content
+	uint64_t hash = length;
+	size_t offset = 0;
+	for (; offset + sizeof(uint64_t) <= length; offset += sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, data + offset, sizeof(word));
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 29;
+	}
+
+	for (; offset < length; offset++) {
+		hash = (hash ^ static_cast<uint8_t>(data[offset])) * 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+uint32_t BlockCache::findSharedSlot(uint64_t hash, const char* data, size_t length)
+{
+	ContentShard& contentShard = contentShards[hash % SHARD_COUNT];
+	std::lock_guard<std::mutex> lock(contentShard.mutex);
+
+	auto range = contentShard.slots.equal_range(hash);
+	for (auto iterator = range.first; iterator != range.second; ++iterator) {
+		uint32_t slot = iterator->second;
+		if (slotLengths[slot] == length && std::memcmp(memory + static_cast<size_t>(slot) * BLOCK_SIZE, data, length) == 0) {
+			slotReferences[slot]++;
+			return slot;
+		}
+	}
+
+	return NO_SLOT;
+}
+
+uint32_t BlockCache::takeFreeSlot()
+{
+	std::lock_guard<std::mutex> lock(freeMutex);
+	if (freeSlots.empty()) {
+		return NO_SLOT;
+	}
+
+	uint32_t slot = freeSlots.back();
+	freeSlots.pop_back();
+	return slot;
+}
+
+void BlockCache::publishSlot(uint32_t slot, uint64_t hash, size_t length)
+{
+	ContentShard& contentShard = contentShards[hash % SHARD_COUNT];
+	std::lock_guard<std::mutex> lock(contentShard.mutex);
+
+	slotReferences[slot] = 1;
+	slotLengths[slot] = static_cast<uint32_t>(length);
+	slotHashes[slot] = hash;
+	contentShard.slots.emplace(hash, slot);
+	FspStats::blockCachePhysicalBytes.fetch_add(length, std::memory_order_relaxed);
+}
+
+void BlockCache::releaseSlot(uint32_t slot)
+{
+	ContentShard& contentShard = contentShards[slotHashes[slot] % SHARD_COUNT];
+	{
+		std::lock_guard<std::mutex> lock(contentShard.mutex);
+		if (0 < --slotReferences[slot]) {
+			return;
+		}
+
+		auto range = contentShard.slots.equal_range(slotHashes[slot]);
+		for (auto iterator = range.first; iterator != range.second; ++iterator) {
+			if (iterator->second == slot) {
+				contentShard.slots.erase(iterator);
+				break;
+			}
+		}
+
+		FspStats::blockCachePhysicalBytes.fetch_sub(slotLengths[slot], std::memory_order_relaxed);
+	}
+
+	std::lock_guard<std::mutex> lock(freeMutex);
+	freeSlots.push_back(slot);
+}
+
+int64_t BlockCache::read(const FileHandle& file, char* buffer, size_t length, uint64_t position)
+{
+	thread_local std::vector<char> blockBuffer(BLOCK_SIZE);
+
+	size_t total = 0;
+	while (0 < length) {
+		size_t offset = static_cast<size_t>(position % BLOCK_SIZE);
+		size_t chunk = std::min<size_t>(length, BLOCK_SIZE - offset);
+		Key key = { file.id, position / BLOCK_SIZE };
+
+		if (!copyBlock(key, buffer, offset, chunk)) {
+			// Whole blocks are read, the rest of them is likely requested next
+			uint64_t blockPosition = position - offset;
+			size_t blockLength = static_cast<size_t>(std::min<uint64_t>(BLOCK_SIZE, file.size - std::min(file.size, blockPosition)));
+			int64_t result = file.read(blockBuffer.data(), blockLength, blockPosition);
+			if (result < 0) {
+				return total == 0 ? -1 : static_cast<int64_t>(total);
+			}
+
+			if (static_cast<size_t>(result) <= offset) {
+				break;
+			}
+
+			insert(file, blockPosition, blockBuffer.data(), static_cast<size_t>(result));
+
+			chunk = std::min(chunk, static_cast<size_t>(result) - offset);
+			std::memcpy(buffer, blockBuffer.data() + offset, chunk);
+		}
+
+		buffer += chunk;
+		position += chunk;
+		length -= chunk;
+		total += chunk;
+	}
+
+	return static_cast<int64_t>(total);
+}
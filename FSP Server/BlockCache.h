@@ -0,0 +1,113 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "FileHandleCache.h"
+
+// Size-bounded cache of file blocks shared by all sessions. Blocks are BLOCK_SIZE aligned ranges
+// of a file handle, requests of any block size are sliced out of them. Every shard evicts with a
+// segmented LRU: new blocks enter the probation segment and are only promoted to the protected
+// segment when they are read again later on, so a single pass over a large file does not flush
+// the blocks several clients keep reading.
+//
+// With deduplication, blocks are additionally stored by their content: identical blocks of different
+// files (regional variants and revisions of a game) share one slot of block memory, and a shard may
+// index twice as many blocks as it has slots.
+class BlockCache
+{
+public:
+	static const uint32_t BLOCK_SIZE = 32 * 1024;
+	static const size_t SHARD_COUNT = 16;
+
+	// Allocates budget bytes of block memory, optionally backed by huge pages (Linux)
+	static void configure(uint64_t budget, bool hugePages, bool deduplicate);
+	static bool isEnabled();
+
+	// Copies the range if all of its blocks are cached
+	static bool lookup(const FileHandle& file, char* buffer, size_t length, uint64_t position);
+
+	// Stores a block read from the file, position has to be BLOCK_SIZE aligned
+	static void insert(const FileHandle& file, uint64_t position, const char* data, size_t length);
+
+	// Copies the range and reads missing blocks from the file, returns the bytes read or -1 on error
+	static int64_t read(const FileHandle& file, char* buffer, size_t length, uint64_t position);
+
+private:
+	struct Key
+	{
+		uint64_t file;
+		uint64_t block;
+
+		bool operator==(const Key& other) const = default;
+	};
+
+	struct KeyHash
+	{
+		size_t operator()(const Key& key) const;
+	};
+
+	struct Block
+	{
+		Key key;
+		uint32_t slot;
+		uint32_t length;
+		bool isProtected;
+		std::chrono::steady_clock::time_point inserted;
+	};
+
+	// Identical blocks are found by a hash of their content and compared before they are shared
+	struct ContentShard
+	{
+		std::mutex mutex;
+		std::unordered_multimap<uint64_t, uint32_t> slots;
+	};
+
+	struct Shard
+	{
+		std::mutex mutex;
+
+		// Most recently used first
+		std::list<Block> probation;
+		std::list<Block> protectedBlocks;
+		std::unordered_map<Key, std::list<Block>::iterator, KeyHash> index;
+		std::vector<uint32_t> freeSlots;
+	};
+
+	// Hits on blocks younger than this belong to the read that inserted them
+	static constexpr std::chrono::steady_clock::duration PROMOTION_AGE = std::chrono::seconds(1);
+
+	// Share of a shard that can be taken by protected blocks, in percent
+	static const size_t PROTECTED_SHARE = 80;
+
+	static const uint32_t NO_SLOT = UINT32_MAX;
+
+	static char* memory;
+	static size_t slotsPerShard;
+	static size_t blocksPerShard;
+	static Shard shards[SHARD_COUNT];
+
+	// Deduplication state, slots are shared by all shards and reference counted
+	static bool deduplicate;
+	static ContentShard contentShards[SHARD_COUNT];
+	static std::vector<uint32_t> slotReferences;
+	static std::vector<uint32_t> slotLengths;
+	static std::vector<uint64_t> slotHashes;
+	static std::mutex freeMutex;
+	static std::vector<uint32_t> freeSlots;
+
+	static Shard& getShard(const Key& key);
+	static bool copyBlock(const Key& key, char* buffer, size_t offset, size_t length);
+
+	// Drops the least valuable block of the shard, false if it is empty
+	static bool evict(Shard& shard);
+
+	static uint64_t hashContent(const char* data, size_t length);
+	static uint32_t findSharedSlot(uint64_t hash, const char* data, size_t length);
+	static uint32_t takeFreeSlot();
+	static void publishSlot(uint32_t slot, uint64_t hash, size_t length);
+	static void releaseSlot(uint32_t slot);
+};
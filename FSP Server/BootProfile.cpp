@@ -0,0 +1,230 @@
+#include "BootProfile.h"
+#include "FspHelper.h"
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+uint16_t BootProfile::seconds = 0;
+std::mutex BootProfile::saveMutex;
+std::condition_variable BootProfile::saveCondition;
+std::deque<std::shared_ptr<BootProfile::Recording>> BootProfile::pendingLoads;
+std::deque<std::shared_ptr<BootProfile::Recording>> BootProfile::pendingSaves;
+std::atomic<uint64_t> BootProfile::nextSave = 0;
+std::mutex BootProfile::replayMutex;
+std::unordered_set<std::string> BootProfile::replaying;
+
+void BootProfile::access(const std::string& subPath, const FileHandle& file, uint64_t position, size_t length)
+{
+	if (seconds == 0) {
+		return;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (recording != nullptr && now < deadline) {
+		std::lock_guard<std::mutex> lock(recording->mutex);
+		if (recording->finished) {
+			return;
+		}
+
+		// Consecutive blocks are merged, retransmissions are skipped
+		std::vector<Entry>& entries = recording->entries;
+		if (!entries.empty() && entries.back().subPath == subPath && entries.back().position <= position && position <= entries.back().position + entries.back().length) {
+			entries.back().length = std::max(entries.back().length, position + length - entries.back().position);
+		}
+		else if (entries.size() < MAX_ENTRIES) {
+			entries.push_back({ subPath, position, length });
+		}
+
+		return;
+	}
+
+	// Saved by the worker thread, which keeps the recording alive
+	recording.reset();
+
+	// A boot starts with the first block of an image, rereading it while the profile of the same image runs is no new boot
+	if (position == 0 && (imageId != file.id || deadline <= now)) {
+		start(file);
+		std::lock_guard<std::mutex> lock(recording->mutex);
+		if (!recording->finished) {
+			recording->entries.push_back({ subPath, position, length });
+		}
+	}
+}
+
+void BootProfile::start(const FileHandle& file)
+{
+	imageId = file.id;
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+
+	// The profile is read by the worker thread, until then the boot is recorded
+	recording = std::make_shared<Recording>();
+	recording->imagePath = file.path;
+	recording->imageSize = file.size;
+	recording->imageModified = file.modified;
+	recording->deadline = deadline;
+
+	static std::once_flag started;
+	std::call_once(started, []() { std::thread(run).detach(); });
+
+	std::lock_guard<std::mutex> lock(saveMutex);
+	pendingLoads.push_back(recording);
+	saveCondition.notify_one();
+}
+
+bool BootProfile::load(Recording& recording)
+{
+	std::ifstream stream(FspHelper::getSidecarPath(recording.imagePath, ".fspprofile"));
+	std::string magic;
+	uint64_t size = 0;
+	std::time_t modified = 0;
+	if (!std::getline(stream, magic) || magic != "FSP boot profile 1" || !(stream >> size >> modified) || size != recording.imageSize || modified != recording.imageModified) {
+		return false;
+	}
+
+	std::vector<Entry> profile;
+	Entry entry;
+	while (stream >> entry.position >> entry.length && stream.get() == ' ' && std::getline(stream, entry.subPath)) {
+		profile.push_back(entry);
+	}
+
+	if (profile.size() < MIN_ENTRIES) {
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(recording.mutex);
+		recording.finished = true;
+		recording.entries.clear();
+	}
+
+	std::string imageKey = recording.imagePath.generic_string();
+	{
+		std::lock_guard<std::mutex> lock(replayMutex);
+		if (!replaying.insert(imageKey).second) {
+			return true;
+		}
+	}
+
+	// Hints can block once the device queue is full, they are issued off the worker thread
+	std::thread(replay, std::move(imageKey), std::move(profile)).detach();
+	return true;
+}
+
+void BootProfile::run()
+{
+	std::unique_lock<std::mutex> lock(saveMutex);
+	while (true) {
+		if (!pendingLoads.empty()) {
+			std::shared_ptr<Recording> started = std::move(pendingLoads.front());
+			pendingLoads.pop_front();
+			lock.unlock();
+			bool profiled = load(*started);
+			lock.lock();
+
+			// Loaded in the order they started, so the saves stay ordered by deadline
+			if (!profiled) {
+				pendingSaves.push_back(std::move(started));
+			}
+
+			continue;
+		}
+
+		if (pendingSaves.empty()) {
+			saveCondition.wait(lock);
+			continue;
+		}
+
+		auto saveAt = pendingSaves.front()->deadline;
+		if (std::chrono::steady_clock::now() < saveAt) {
+			saveCondition.wait_until(lock, saveAt);
+			continue;
+		}
+
+		std::shared_ptr<Recording> finished = std::move(pendingSaves.front());
+		pendingSaves.pop_front();
+		lock.unlock();
+		save(*finished);
+		lock.lock();
+	}
+}
+
+void BootProfile::saveAll()
+{
+	std::deque<std::shared_ptr<Recording>> recordings;
+	{
+		std::lock_guard<std::mutex> lock(saveMutex);
+		recordings.swap(pendingSaves);
+	}
+
+	for (const auto& recording : recordings) {
+		save(*recording);
+	}
+}
+
+void BootProfile::save(Recording& recording)
+{
+	std::vector<Entry> entries;
+	{
+		std::lock_guard<std::mutex> lock(recording.mutex);
+		recording.finished = true;
+		entries = std::move(recording.entries);
+	}
+
+	if (entries.size() < MIN_ENTRIES) {
+		return;
+	}
+
+	// Unique per save, profiles of the same image may be written by several sessions at once
+	std::filesystem::path path = FspHelper::getSidecarPath(recording.imagePath, ".fspprofile");
+	std::filesystem::path temporaryPath = path;
+	temporaryPath += "." + std::to_string(nextSave++) + ".tmp";
+
+	try
+	{
+		std::filesystem::create_directories(path.parent_path());
+		std::ofstream stream(temporaryPath, std::ios::trunc);
+		stream << "FSP boot profile 1\n" << recording.imageSize << " " << recording.imageModified << "\n";
+		for (const Entry& entry : entries) {
+			stream << entry.position << " " << entry.length << " " << entry.subPath << "\n";
+		}
+
+		stream.close();
+		if (stream.fail()) {
+			throw std::runtime_error("Could not write boot profile");
+		}
+
+		// Replaced atomically, a concurrent boot of the same image never reads a partial profile
+		std::filesystem::rename(temporaryPath, path);
+	}
+	catch (const std::exception&)
+	{
+		std::error_code error;
+		std::filesystem::remove(temporaryPath, error);
+	}
+}
+
+void BootProfile::replay(std::string imageKey, std::vector<Entry> profile)
+{
+	std::string subPath;
+	std::shared_ptr<FileHandle> file;
+	for (const Entry& entry : profile) {
+		if (entry.subPath != subPath) {
+			subPath = entry.subPath;
+			try
+			{
+				file = FileHandleCache::open(FspHelper::getCompletePath(subPath, { std::filesystem::file_type::regular }));
+			}
+			catch (const std::exception&)
+			{
+				file = nullptr;
+			}
+		}
+
+		if (file != nullptr && entry.position < file->size) {
+			file->prefetch(entry.position, std::min(entry.length, file->size - entry.position));
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(replayMutex);
+	replaying.erase(imageKey);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "FileHandleCache.h"
+
+// Records the CC_GET_FILE ranges a client requests during the first seconds after it starts reading
+// an image and stores them as the boot profile of that image. Booting the same game again replays
+// the profile as prefetch hints, so the scattered reads of the boot sequence hit the page cache.
+class BootProfile
+{
+public:
+	// Recorded time span in seconds after the first block of an image, 0 disables profiles
+	static uint16_t seconds;
+
+	static const size_t MAX_ENTRIES = 16384;
+
+	// Fewer entries are no boot, e.g. a browser reading the header of an image. Such recordings are
+	// not saved and such profiles are recorded again.
+	static const size_t MIN_ENTRIES = 16;
+
+	// Called for every block served, subPath is the path the client requested
+	void access(const std::string& subPath, const FileHandle& file, uint64_t position, size_t length);
+
+	// Saves the recordings whose deadline has not passed yet, called when the server shuts down
+	static void saveAll();
+
+private:
+	struct Entry
+	{
+		std::string subPath;
+		uint64_t position;
+		uint64_t length;
+	};
+
+	// Ranges of one boot, filled by the client. The worker thread loads the profile of the image and
+	// either replays it or saves the recording once the deadline passed.
+	struct Recording
+	{
+		std::filesystem::path imagePath;
+		uint64_t imageSize = 0;
+		std::time_t imageModified = 0;
+		std::chrono::steady_clock::time_point deadline;
+
+		std::mutex mutex;
+		bool finished = false;
+		std::vector<Entry> entries;
+	};
+
+	// FileHandle::id of the image, a freed handle's address may be reused by another file
+	std::optional<uint64_t> imageId;
+	std::chrono::steady_clock::time_point deadline;
+	std::shared_ptr<Recording> recording;
+
+	void start(const FileHandle& file);
+
+	static std::mutex saveMutex;
+	static std::condition_variable saveCondition;
+
+	// Recordings whose image has not been looked at yet
+	static std::deque<std::shared_ptr<Recording>> pendingLoads;
+
+	// Ordered by deadline, every recording runs for the same number of seconds
+	static std::deque<std::shared_ptr<Recording>> pendingSaves;
+	static std::atomic<uint64_t> nextSave;
+
+	// Images whose profile is being replayed, a second boot of the same image does not replay it again
+	static std::mutex replayMutex;
+	static std::unordered_set<std::string> replaying;
+
+	// False if the image has no profile that covers a boot, the recording is saved then
+	static bool load(Recording& recording);
+	static void save(Recording& recording);
+	static void run();
+	static void replay(std::string imageKey, std::vector<Entry> profile);
+};
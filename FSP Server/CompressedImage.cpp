@@ -0,0 +1,421 @@
+#include "CompressedImage.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#ifdef FSP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+std::mutex CompressedImage::decodeMutex;
+std::condition_variable CompressedImage::decodeCondition;
+std::deque<std::function<void()>> CompressedImage::decodes;
+std::vector<std::thread> CompressedImage::decoders;
+
+static uint32_t readLittleEndian32(const uint8_t* bytes)
+{
+	return static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8) | (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+static uint64_t readLittleEndian64(const uint8_t* bytes)
+{
+	return static_cast<uint64_t>(readLittleEndian32(bytes)) | (static_cast<uint64_t>(readLittleEndian32(bytes + 4)) << 32);
+}
+
+static std::string getLowerExtension(const std::filesystem::path& path)
+{
+	std::string extension = path.extension().string();
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char character) { return static_cast<char>(std::tolower(character)); });
+	return extension;
+}
+
+bool CompressedImage::isCompressedName(const std::filesystem::path& path)
+{
+	std::string extension = getLowerExtension(path);
+#ifdef FSP_HAVE_ZLIB
+	return extension == ".ciso" || extension == ".gcz";
+#else
+	return extension == ".ciso";
+#endif
+}
+
+std::filesystem::path CompressedImage::getImageName(const std::filesystem::path& path)
+{
+	std::filesystem::path imagePath = path;
+	imagePath.replace_extension(".iso");
+	return imagePath;
+}
+
+std::filesystem::path CompressedImage::findCompressed(const std::filesystem::path& isoPath)
+{
+	if (getLowerExtension(isoPath) != ".iso") {
+		return {};
+	}
+
+	for (const char* extension : { ".ciso", ".CISO", ".gcz", ".GCZ" }) {
+		std::filesystem::path candidate = isoPath;
+		candidate.replace_extension(extension);
+
+		std::error_code error;
+		if (isCompressedName(candidate) && std::filesystem::is_regular_file(candidate, error)) {
+			return candidate;
+		}
+	}
+
+	return {};
+}
+
+std::unique_ptr<CompressedImage> CompressedImage::open(const std::filesystem::path& path, uint64_t storedSize, StoredReader reader, StoredPrefetcher prefetcher)
+{
+	return create(path, storedSize, std::move(reader), std::move(prefetcher), false);
+}
+
+std::unique_ptr<CompressedImage> CompressedImage::create(const std::filesystem::path& path, uint64_t storedSize, StoredReader reader, StoredPrefetcher prefetcher, bool headerOnly)
+{
+	std::string extension = getLowerExtension(path);
+	std::unique_ptr<CompressedImage> image;
+	if (extension == ".ciso") {
+		auto ciso = std::make_unique<CisoImage>();
+		ciso->readStored = std::move(reader);
+		ciso->prefetchStored = std::move(prefetcher);
+		if (ciso->parse(storedSize)) {
+			image = std::move(ciso);
+		}
+	}
+#ifdef FSP_HAVE_ZLIB
+	else if (extension == ".gcz") {
+		auto gcz = std::make_unique<GczImage>();
+		gcz->readStored = std::move(reader);
+		gcz->prefetchStored = std::move(prefetcher);
+		if (gcz->parse(storedSize, headerOnly)) {
+			image = std::move(gcz);
+		}
+	}
+#endif
+
+	return image;
+}
+
+uint64_t CompressedImage::readSize(const std::filesystem::path& path)
+{
+	std::error_code error;
+	uint64_t storedSize = std::filesystem::file_size(path, error);
+	if (error) {
+		return 0;
+	}
+
+	std::ifstream stream(path, std::ios::binary);
+	auto reader = [&stream](void* buffer, size_t length, uint64_t position) -> int64_t {
+		stream.clear();
+		stream.seekg(static_cast<std::streamoff>(position));
+		stream.read(static_cast<char*>(buffer), static_cast<std::streamsize>(length));
+		return stream.gcount();
+	};
+
+	// Called for every listed image, the block offsets of a GCZ image are not needed for its size
+	std::unique_ptr<CompressedImage> image = create(path, storedSize, reader, [](uint64_t, uint64_t) {}, true);
+	return image == nullptr ? 0 : image->getSize();
+}
+
+uint64_t CompressedImage::getSize() const
+{
+	return size;
+}
+
+void CompressedImage::addZeros(ZeroMap&) const
+{
+}
+
+bool CompressedImage::isValidBlockSize(uint32_t blockSize)
+{
+	return MIN_BLOCK_SIZE <= blockSize && blockSize <= MAX_BLOCK_SIZE && (blockSize & (blockSize - 1)) == 0;
+}
+
+bool CompressedImage::enqueueDecode(std::function<void()> decode)
+{
+	std::lock_guard<std::mutex> lock(decodeMutex);
+	if (MAX_QUEUED_DECODES <= decodes.size()) {
+		return false;
+	}
+
+	if (decoders.empty()) {
+		for (size_t i = 0; i < DECODER_COUNT; i++) {
+			decoders.emplace_back(decodeLoop);
+			decoders.back().detach();
+		}
+	}
+
+	decodes.push_back(std::move(decode));
+	decodeCondition.notify_one();
+	return true;
+}
+
+void CompressedImage::decodeLoop()
+{
+	while (true) {
+		std::function<void()> decode;
+		{
+			std::unique_lock<std::mutex> lock(decodeMutex);
+			decodeCondition.wait(lock, []() { return !decodes.empty(); });
+			decode = std::move(decodes.front());
+			decodes.pop_front();
+		}
+
+		decode();
+	}
+}
+
+bool CisoImage::parse(uint64_t storedSize)
+{
+	std::vector<uint8_t> header(HEADER_SIZE);
+	if (readStored(header.data(), HEADER_SIZE, 0) != static_cast<int64_t>(HEADER_SIZE) || std::memcmp(header.data(), "CISO", 4) != 0) {
+		return false;
+	}
+
+	blockSize = readLittleEndian32(header.data() + 4);
+	if (!isValidBlockSize(blockSize) || storedSize < HEADER_SIZE) {
+		return false;
+	}
+
+	// The image ends with its last stored block
+	size_t blockCount = 0;
+	for (size_t i = 8; i < HEADER_SIZE; i++) {
+		if (header[i] == 1) {
+			blockCount = i - 8 + 1;
+		}
+	}
+
+	uint32_t stored = 0;
+	storedIndex.resize(blockCount);
+	for (size_t i = 0; i < blockCount; i++) {
+		storedIndex[i] = header[8 + i] == 1 ? stored++ : MISSING_BLOCK;
+	}
+
+	size = static_cast<uint64_t>(blockCount) * blockSize;
+	return true;
+}
+
+int64_t CisoImage::read(void* buffer, size_t length, uint64_t position)
+{
+	char* target = static_cast<char*>(buffer);
+	size_t total = 0;
+	while (0 < length && position < size) {
+		uint64_t block = position / blockSize;
+		size_t offset = static_cast<size_t>(position % blockSize);
+		size_t chunk = std::min<size_t>(length, blockSize - offset);
+
+		if (storedIndex[block] == MISSING_BLOCK) {
+			std::memset(target, 0, chunk);
+		}
+		else
+		{
+			int64_t result = readStored(target, chunk, HEADER_SIZE + static_cast<uint64_t>(storedIndex[block]) * blockSize + offset);
+			if (result < 0) {
+				return total == 0 ? -1 : static_cast<int64_t>(total);
+			}
+
+			if (static_cast<size_t>(result) < chunk) {
+				// Truncated image
+				return static_cast<int64_t>(total) + result;
+			}
+		}
+
+		target += chunk;
+		position += chunk;
+		length -= chunk;
+		total += chunk;
+	}
+
+	return static_cast<int64_t>(total);
+}
+
+void CisoImage::prefetch(std::shared_ptr<const void>, uint64_t position, uint64_t length)
+{
+	// Stored blocks are plain data, the kernel reads them ahead
+	uint64_t end = std::min(size, position + length);
+	while (position < end) {
+		uint64_t block = position / blockSize;
+		uint64_t offset = position % blockSize;
+		uint64_t chunk = std::min<uint64_t>(end - position, blockSize - offset);
+		if (storedIndex[block] != MISSING_BLOCK) {
+			prefetchStored(HEADER_SIZE + static_cast<uint64_t>(storedIndex[block]) * blockSize + offset, chunk);
+		}
+
+		position += chunk;
+	}
+}
+
+void CisoImage::addZeros(ZeroMap& zeros) const
+{
+	for (size_t i = 0; i < storedIndex.size(); i++) {
+		if (storedIndex[i] == MISSING_BLOCK) {
+			zeros.add(static_cast<uint64_t>(i) * blockSize, static_cast<uint64_t>(i + 1) * blockSize);
+		}
+	}
+}
+
+#ifdef FSP_HAVE_ZLIB
+bool GczImage::parse(uint64_t storedSize, bool headerOnly)
+{
+	uint8_t header[HEADER_SIZE];
+	if (readStored(header, HEADER_SIZE, 0) != static_cast<int64_t>(HEADER_SIZE) || readLittleEndian32(header) != MAGIC) {
+		return false;
+	}
+
+	compressedSize = readLittleEndian64(header + 8);
+	size = readLittleEndian64(header + 16);
+	blockSize = readLittleEndian32(header + 24);
+	uint32_t blockCount = readLittleEndian32(header + 28);
+	if (!isValidBlockSize(blockSize) || blockCount != (size + blockSize - 1) / blockSize) {
+		return false;
+	}
+
+	// The offsets and checksums of all blocks have to fit into the file before their table is allocated
+	dataOffset = HEADER_SIZE + static_cast<uint64_t>(blockCount) * 12;
+	if (storedSize < dataOffset) {
+		return false;
+	}
+
+	if (headerOnly) {
+		return true;
+	}
+
+	std::vector<uint8_t> offsets(static_cast<size_t>(blockCount) * 8);
+	if (readStored(offsets.data(), offsets.size(), HEADER_SIZE) != static_cast<int64_t>(offsets.size())) {
+		return false;
+	}
+
+	blockOffsets.resize(blockCount);
+	for (uint32_t i = 0; i < blockCount; i++) {
+		blockOffsets[i] = readLittleEndian64(offsets.data() + static_cast<size_t>(i) * 8);
+	}
+
+	// Offsets are relative to the data behind the offsets and the Adler-32 checksums
+	maxCached = std::max<size_t>(4, CACHE_SIZE / blockSize);
+	return true;
+}
+
+std::shared_ptr<const std::vector<char>> GczImage::decode(uint32_t block)
+{
+	uint64_t start = blockOffsets[block] & ~UNCOMPRESSED_FLAG;
+	uint64_t end = block + 1 < blockOffsets.size() ? blockOffsets[block + 1] & ~UNCOMPRESSED_FLAG : compressedSize;
+	if (end < start || blockSize + 1024 < end - start) {
+		return nullptr;
+	}
+
+	std::vector<char> stored(static_cast<size_t>(end - start));
+	if (readStored(stored.data(), stored.size(), dataOffset + start) != static_cast<int64_t>(stored.size())) {
+		return nullptr;
+	}
+
+	if ((blockOffsets[block] & UNCOMPRESSED_FLAG) != 0) {
+		return std::make_shared<const std::vector<char>>(std::move(stored));
+	}
+
+	auto data = std::make_shared<std::vector<char>>(blockSize);
+	uLongf length = blockSize;
+	if (uncompress(reinterpret_cast<Bytef*>(data->data()), &length, reinterpret_cast<const Bytef*>(stored.data()), static_cast<uLong>(stored.size())) != Z_OK) {
+		return nullptr;
+	}
+
+	data->resize(length);
+	return data;
+}
+
+void GczImage::insert(uint32_t block, std::shared_ptr<const std::vector<char>> data)
+{
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	if (cacheIndex.contains(block)) {
+		return;
+	}
+
+	cached.emplace_front(block, std::move(data));
+	cacheIndex[block] = cached.begin();
+	if (maxCached < cached.size()) {
+		cacheIndex.erase(cached.back().first);
+		cached.pop_back();
+	}
+}
+
+std::shared_ptr<const std::vector<char>> GczImage::getBlock(uint32_t block)
+{
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		auto iterator = cacheIndex.find(block);
+		if (iterator != cacheIndex.end()) {
+			cached.splice(cached.begin(), cached, iterator->second);
+			return iterator->second->second;
+		}
+	}
+
+	// Decoded without holding the lock, a prefetch of the same block may finish first
+	std::shared_ptr<const std::vector<char>> data = decode(block);
+	if (data != nullptr) {
+		insert(block, data);
+	}
+
+	return data;
+}
+
+int64_t GczImage::read(void* buffer, size_t length, uint64_t position)
+{
+	char* target = static_cast<char*>(buffer);
+	size_t total = 0;
+	while (0 < length && position < size) {
+		uint32_t block = static_cast<uint32_t>(position / blockSize);
+		size_t offset = static_cast<size_t>(position % blockSize);
+
+		std::shared_ptr<const std::vector<char>> data = getBlock(block);
+		if (data == nullptr || data->size() <= offset) {
+			return total == 0 ? -1 : static_cast<int64_t>(total);
+		}
+
+		size_t chunk = std::min(length, data->size() - offset);
+		std::memcpy(target, data->data() + offset, chunk);
+
+		target += chunk;
+		position += chunk;
+		length -= chunk;
+		total += chunk;
+	}
+
+	return static_cast<int64_t>(total);
+}
+
+void GczImage::prefetch(std::shared_ptr<const void> owner, uint64_t position, uint64_t length)
+{
+	if (size <= position || length == 0) {
+		return;
+	}
+
+	// At most half of the cache is filled ahead, the rest keeps the blocks being read
+	uint32_t first = static_cast<uint32_t>(position / blockSize);
+	uint32_t last = static_cast<uint32_t>((std::min(size, position + length) - 1) / blockSize);
+	last = std::min<uint32_t>(last, first + static_cast<uint32_t>(maxCached / 2));
+
+	for (uint32_t block = first; block <= last; block++) {
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			if (cacheIndex.contains(block) || !queued.insert(block).second) {
+				continue;
+			}
+		}
+
+		bool accepted = enqueueDecode([this, owner, block]() {
+			std::shared_ptr<const std::vector<char>> data = decode(block);
+			if (data != nullptr) {
+				insert(block, data);
+			}
+
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			queued.erase(block);
+		});
+
+		if (!accepted) {
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			queued.erase(block);
+			break;
+		}
+	}
+}
+#endif
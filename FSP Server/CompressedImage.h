@@ -0,0 +1,143 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ZeroMap.h"
+
+// Random access to a compressed disc image that is served to clients as a plain .iso. Supported are
+// CISO (blocks that only contain zeros are left out) and Dolphin's GCZ (zlib compressed blocks with an
+// index of their offsets, only if the server is built with zlib). Only the blocks a request touches
+// are read and decoded.
+class CompressedImage
+{
+public:
+	// Reads or prefetches a range of the stored, compressed file
+	using StoredReader = std::function<int64_t(void*, size_t, uint64_t)>;
+	using StoredPrefetcher = std::function<void(uint64_t, uint64_t)>;
+
+	virtual ~CompressedImage() = default;
+
+	static bool isCompressedName(const std::filesystem::path& path);
+
+	// Name the image is listed as, game.gcz becomes game.iso
+	static std::filesystem::path getImageName(const std::filesystem::path& path);
+
+	// Compressed image a request for an .iso that does not exist is served from, empty if there is none
+	static std::filesystem::path findCompressed(const std::filesystem::path& isoPath);
+
+	// Returns nullptr if the file is no supported image, storedSize is the size of the file on disk
+	static std::unique_ptr<CompressedImage> open(const std::filesystem::path& path, uint64_t storedSize, StoredReader reader, StoredPrefetcher prefetcher);
+
+	// Uncompressed size of the image at path, 0 if it is no supported image. Only the header is read.
+	static uint64_t readSize(const std::filesystem::path& path);
+
+	uint64_t getSize() const;
+
+	// Returns the number of bytes read or -1 on error
+	virtual int64_t read(void* buffer, size_t length, uint64_t position) = 0;
+
+	// Prepares the range in the background, owner is kept alive until the work is done
+	virtual void prefetch(std::shared_ptr<const void> owner, uint64_t position, uint64_t length) = 0;
+
+	// Adds the ranges the image leaves out
+	virtual void addZeros(ZeroMap& zeros) const;
+
+protected:
+	uint64_t size = 0;
+	StoredReader readStored;
+	StoredPrefetcher prefetchStored;
+
+	// Decoder threads shared by all images
+	static const size_t DECODER_COUNT = 2;
+	static const size_t MAX_QUEUED_DECODES = 256;
+
+	// Blocks are powers of two, larger ones than this are rejected before anything is allocated for them
+	static const uint32_t MIN_BLOCK_SIZE = 512;
+	static const uint32_t MAX_BLOCK_SIZE = 16 * 1024 * 1024;
+
+	// False if too many decodes are waiting already
+	static bool enqueueDecode(std::function<void()> decode);
+
+	static bool isValidBlockSize(uint32_t blockSize);
+
+private:
+	static std::mutex decodeMutex;
+	static std::condition_variable decodeCondition;
+	static std::deque<std::function<void()>> decodes;
+	static std::vector<std::thread> decoders;
+
+	static void decodeLoop();
+
+	// Parses the image behind reader, with headerOnly only as far as needed to know its size
+	static std::unique_ptr<CompressedImage> create(const std::filesystem::path& path, uint64_t storedSize, StoredReader reader, StoredPrefetcher prefetcher, bool headerOnly);
+};
+
+// CISO as written by Swiss and Dolphin: a 32 KiB header with the block size and a map of the blocks
+// that are stored, followed by the stored blocks in order
+class CisoImage : public CompressedImage
+{
+public:
+	static const size_t HEADER_SIZE = 0x8000;
+
+	bool parse(uint64_t storedSize);
+	int64_t read(void* buffer, size_t length, uint64_t position) override;
+	void prefetch(std::shared_ptr<const void> owner, uint64_t position, uint64_t length) override;
+	void addZeros(ZeroMap& zeros) const override;
+
+private:
+	static const uint32_t MISSING_BLOCK = UINT32_MAX;
+
+	uint32_t blockSize = 0;
+
+	// Index of every block among the stored blocks, MISSING_BLOCK if it only contains zeros
+	std::vector<uint32_t> storedIndex;
+};
+
+#ifdef FSP_HAVE_ZLIB
+// GCZ as written by Dolphin: a header, the offsets of all blocks and their Adler-32 checksums,
+// followed by the blocks. Blocks that did not compress are stored as they are.
+class GczImage : public CompressedImage
+{
+public:
+	static const uint32_t MAGIC = 0xB10BC001;
+	static const size_t HEADER_SIZE = 32;
+
+	// Decoded blocks kept per image
+	static const size_t CACHE_SIZE = 8 * 1024 * 1024;
+
+	// The offsets of the blocks are skipped with headerOnly
+	bool parse(uint64_t storedSize, bool headerOnly);
+	int64_t read(void* buffer, size_t length, uint64_t position) override;
+	void prefetch(std::shared_ptr<const void> owner, uint64_t position, uint64_t length) override;
+
+private:
+	static const uint64_t UNCOMPRESSED_FLAG = 1ULL << 63;
+
+	uint32_t blockSize = 0;
+	uint64_t dataOffset = 0;
+	uint64_t compressedSize = 0;
+	std::vector<uint64_t> blockOffsets;
+
+	std::mutex cacheMutex;
+
+	// Most recently used first
+	std::list<std::pair<uint32_t, std::shared_ptr<const std::vector<char>>>> cached;
+	std::unordered_map<uint32_t, decltype(cached)::iterator> cacheIndex;
+	std::set<uint32_t> queued;
+	size_t maxCached = 0;
+
+	std::shared_ptr<const std::vector<char>> getBlock(uint32_t block);
+	std::shared_ptr<const std::vector<char>> decode(uint32_t block);
+	void insert(uint32_t block, std::shared_ptr<const std::vector<char>> data);
+};
+#endif
@@ -0,0 +1,169 @@
+#include "DirectoryScanner.h"
+#include "FspDirEnt.h"
+#include "FspHelper.h"
+#include "IoUring.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Layout of the records returned by getdents64, glibc does not declare it
+struct LinuxDirent64
+{
+	uint64_t inode;
+	int64_t offset;
+	unsigned short length;
+	unsigned char type;
+	char name[1];
+};
+
+DirectoryScanner::DirectoryScanner(const std::filesystem::path& setDirectory, bool batched) : directory(setDirectory)
+{
+	descriptor = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (descriptor < 0) {
+		return;
+	}
+
+	buffer.resize(BUFFER_SIZE);
+	if (!batched) {
+		return;
+	}
+
+	try
+	{
+		ring = std::make_unique<IoUring>(RING_ENTRIES);
+	}
+	catch (const std::exception&)
+	{
+		// Kernels without io_uring stat one entry after the other
+	}
+}
+
+DirectoryScanner::~DirectoryScanner()
+{
+	close();
+}
+
+void DirectoryScanner::close()
+{
+	if (0 <= descriptor) {
+		::close(descriptor);
+		descriptor = -1;
+	}
+
+	ring.reset();
+	buffer = std::vector<char>();
+}
+
+bool DirectoryScanner::read(std::vector<std::vector<uint8_t>>& entries, size_t count)
+{
+	if (descriptor < 0) {
+		return false;
+	}
+
+	std::vector<std::string> names;
+	std::vector<bool> links;
+	bool more = nextNames(names, links, count);
+	statBatch(names, links, entries);
+
+	if (!more) {
+		close();
+	}
+
+	return more;
+}
+
+bool DirectoryScanner::nextNames(std::vector<std::string>& names, std::vector<bool>& links, size_t count)
+{
+	while (names.size() < count) {
+		if (bufferLength <= bufferPosition) {
+			long length = syscall(SYS_getdents64, descriptor, buffer.data(), buffer.size());
+			if (length <= 0) {
+				return false;
+			}
+
+			bufferPosition = 0;
+			bufferLength = static_cast<size_t>(length);
+		}
+
+		const LinuxDirent64* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + bufferPosition);
+		bufferPosition += entry->length;
+
+		// Symbolic links and file systems without d_type are resolved by statx
+		bool candidate = entry->type == DT_REG || entry->type == DT_DIR || entry->type == DT_LNK || entry->type == DT_UNKNOWN;
+		if (candidate && std::strcmp(entry->name, ".") != 0 && std::strcmp(entry->name, "..") != 0 && !FspHelper::isSidecarName(entry->name)) {
+			names.emplace_back(entry->name);
+			links.push_back(entry->type == DT_LNK || entry->type == DT_UNKNOWN);
+		}
+	}
+
+	return true;
+}
+
+void DirectoryScanner::statBatch(const std::vector<std::string>& names, const std::vector<bool>& links, std::vector<std::vector<uint8_t>>& entries)
+{
+	const unsigned int mask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+	std::vector<struct statx> stats(names.size());
+	std::vector<int> results(names.size(), -EINVAL);
+
+	// Submitted in chunks of the ring size, the kernel stats them in parallel
+	size_t submitted = 0;
+	while (ring != nullptr && submitted < names.size()) {
+		unsigned int pending = 0;
+		io_uring_sqe* submission;
+		while (submitted + pending < names.size() && (submission = ring->getSubmission()) != nullptr) {
+			size_t i = submitted + pending;
+			submission->opcode = IORING_OP_STATX;
+			submission->fd = descriptor;
+			submission->addr = reinterpret_cast<uint64_t>(names[i].c_str());
+			submission->len = mask;
+			submission->off = reinterpret_cast<uint64_t>(&stats[i]);
+			submission->user_data = i;
+			pending++;
+		}
+
+		try
+		{
+			unsigned int completed = 0;
+			ring->submit(pending);
+			while (completed < pending) {
+				completed += static_cast<unsigned int>(ring->forEachCompletion([&results](const io_uring_cqe& completion) {
+					results[completion.user_data] = completion.res;
+				}));
+
+				if (completed < pending) {
+					ring->submit(pending - completed);
+				}
+			}
+		}
+		catch (const std::exception&)
+		{
+			// Entries without a result are stat'ed directly below
+			ring.reset();
+		}
+
+		submitted += pending;
+	}
+
+	for (size_t i = 0; i < names.size(); i++) {
+		// Kernels before 5.6 do not know IORING_OP_STATX
+		if (results[i] == -EINVAL) {
+			ring.reset();
+			results[i] = statx(descriptor, names[i].c_str(), 0, mask, &stats[i]) == 0 ? 0 : -errno;
+		}
+
+		if (results[i] != 0 || !(S_ISREG(stats[i].stx_mode) || S_ISDIR(stats[i].stx_mode))) {
+			continue;
+		}
+
+		FspDirEnt entry(directory / names[i], static_cast<uint32_t>(stats[i].stx_mtime.tv_sec), stats[i].stx_size, S_ISDIR(stats[i].stx_mode));
+		entries.push_back(entry.getRawBytes());
+		if (links[i] || (stats[i].stx_mode & S_IRUSR) == 0) {
+			restricted.push_back(entry.filename);
+		}
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+// linux/io_uring.h defines macros like BLOCK_SIZE, it is only included by the implementation
+class IoUring;
+
+// Reads a directory for CC_GET_DIR with getdents64 into a large buffer and one statx per entry,
+// instead of the several stat calls std::filesystem makes. The statx calls of a batch are submitted
+// together through io_uring where the kernel supports it. Entries come in the same order as from
+// std::filesystem::directory_iterator, entries that are neither files nor directories are skipped.
+class DirectoryScanner
+{
+public:
+	// A directory that can not be opened reads as empty. Without batched every entry is stat'ed by its own system call.
+	DirectoryScanner(const std::filesystem::path& setDirectory, bool batched = true);
+	~DirectoryScanner();
+	DirectoryScanner(const DirectoryScanner&) = delete;
+	DirectoryScanner& operator=(const DirectoryScanner&) = delete;
+
+	// Appends up to count encoded entries, false once the directory has been read completely
+	bool read(std::vector<std::vector<uint8_t>>& entries, size_t count);
+
+	// Listed names of the entries read so far that may be symbolic links or lack the owner's read
+	// permission, FspHelper::checkPath rejects some of those
+	std::vector<std::string> restricted;
+
+private:
+	static const size_t BUFFER_SIZE = 64 * 1024;
+	static const unsigned int RING_ENTRIES = 256;
+
+	std::filesystem::path directory;
+	int descriptor = -1;
+	std::vector<char> buffer;
+	size_t bufferPosition = 0;
+	size_t bufferLength = 0;
+	std::unique_ptr<IoUring> ring;
+
+	// Names of the next batch, taken from the buffer, and whether each may be a symbolic link
+	bool nextNames(std::vector<std::string>& names, std::vector<bool>& links, size_t count);
+	void statBatch(const std::vector<std::string>& names, const std::vector<bool>& links, std::vector<std::vector<uint8_t>>& entries);
+	void close();
+};
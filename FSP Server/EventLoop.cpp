@@ -0,0 +1,102 @@
+#include "EventLoop.h"
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+EventLoop::EventLoop()
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0) {
+		throw std::runtime_error(std::string("epoll_create1() failed: ") + std::strerror(errno));
+	}
+}
+
+EventLoop::~EventLoop()
+{
+	for (int timerFd : timers) {
+		close(timerFd);
+	}
+
+	close(epollFd);
+}
+
+void EventLoop::addReader(int fd, std::function<void()> callback)
+{
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		throw std::runtime_error(std::string("epoll_ctl() failed: ") + std::strerror(errno));
+	}
+
+	readers[fd] = callback;
+}
+
+void EventLoop::removeReader(int fd)
+{
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+	readers.erase(fd);
+}
+
+int EventLoop::addTimer(std::chrono::milliseconds interval, std::function<void()> callback)
+{
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd < 0) {
+		throw std::runtime_error(std::string("timerfd_create() failed: ") + std::strerror(errno));
+	}
+
+	itimerspec spec = {};
+	spec.it_interval.tv_sec = interval.count() / 1000;
+	spec.it_interval.tv_nsec = (interval.count() % 1000) * 1000000;
+	spec.it_value = spec.it_interval;
+	timerfd_settime(timerFd, 0, &spec, nullptr);
+
+	addReader(timerFd, [timerFd, callback]() {
+		uint64_t expirations;
+		if (read(timerFd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			callback();
+		}
+	});
+
+	timers.insert(timerFd);
+	return timerFd;
+}
+
+void EventLoop::removeTimer(int timerId)
+{
+	removeReader(timerId);
+	timers.erase(timerId);
+	close(timerId);
+}
+
+void EventLoop::runOnce(int timeoutMs)
+{
+	epoll_event events[MAX_EVENTS];
+	int count = epoll_wait(epollFd, events, MAX_EVENTS, timeoutMs);
+	if (count < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+
+		throw std::runtime_error(std::string("epoll_wait() failed: ") + std::strerror(errno));
+	}
+
+	for (int i = 0; i < count; i++) {
+		auto iterator = readers.find(events[i].data.fd);
+		if (iterator != readers.end()) {
+			// Copy, the callback may unregister itself
+			auto callback = iterator->second;
+			callback();
+		}
+	}
+}
+
+int EventLoop::getFd()
+{
+	return epollFd;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <map>
+#include <set>
+
+// Single-threaded epoll reactor. File descriptors and timers are registered
+// with a callback that is invoked from runOnce() whenever they become ready.
+class EventLoop
+{
+public:
+	EventLoop();
+	~EventLoop();
+	EventLoop(const EventLoop&) = delete;
+	EventLoop& operator=(const EventLoop&) = delete;
+
+	void addReader(int fd, std::function<void()> callback);
+	void removeReader(int fd);
+	int addTimer(std::chrono::milliseconds interval, std::function<void()> callback);
+	void removeTimer(int timerId);
+	void runOnce(int timeoutMs = -1);
+
+	// The epoll descriptor itself, readable whenever a registered callback is due
+	int getFd();
+
+private:
+	static const int MAX_EVENTS = 64;
+
+	int epollFd;
+	std::map<int, std::function<void()>> readers;
+	std::set<int> timers;
+};
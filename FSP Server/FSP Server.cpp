@@ -1,23 +1,54 @@
 #include "FSP Server.h"
 #include "UdpSocket.h"
-#include "winsock2.h"
 #include <iostream>
 #include <vector>
 #include <string>
 #include <regex>
 #include "FspHelper.h"
+#include "FspStats.h"
+#include "MetadataIndex.h"
+#include "BlockCache.h"
+#include "BootProfile.h"
+#include "Preloader.h"
+#include "Readahead.h"
+#include "Replicas.h"
+#include "StorageTier.h"
+#include "Upstream.h"
+#include "ZeroMap.h"
+#include <cstdlib>
+#include <ctime>
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <csignal>
+#include <pthread.h>
+#endif
 
-int main(int argumentCount, char* arguments[])
+#ifdef _WIN32
+static BOOL WINAPI saveOnExit(DWORD type)
 {
-	// Seed rng
-	std::srand((uint32_t)std::time(nullptr));
+	saveState();
+	return FALSE;
+}
+#endif
 
+int main(int argumentCount, char* arguments[])
+{
 	const std::vector<std::string> args(arguments + 1, arguments + argumentCount);
 	uint16_t port = 21;
 	uint32_t ip = INADDR_ANY;
 
 	std::string password = "";
 	std::filesystem::path path;
+	uint64_t blockCacheBudget = 0;
+	bool hugePages = false;
+	bool deduplicate = false;
+	std::filesystem::path preloadList;
+	uint32_t upstreamIp = 0;
+	uint16_t upstreamPort = 21;
 
 	for (int i = 0; i < args.size(); i++) {
 		if (!VALID_ARGUMENTS.contains(args[i])) {
@@ -52,7 +83,7 @@ int main(int argumentCount, char* arguments[])
 				path = std::filesystem::canonical(path);
 
 				if (!std::filesystem::is_directory(path)) {
-					throw std::exception("Not a directory");
+					throw std::runtime_error("Not a directory");
 				}
 			}
 			catch (const std::exception&)
@@ -81,6 +112,260 @@ int main(int argumentCount, char* arguments[])
 				std::cout << "Could not parse ipv4 address";
 				return EXIT_SUCCESS;
 			}
+			break;
+		case PARAM_BATCH_SIZE:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long batchSize = std::stoul(inputValue);
+				if (batchSize < 1 || 1024 < batchSize) {
+					throw std::out_of_range("Batch size out of range");
+				}
+
+				UdpSocket::batchSize = static_cast<uint16_t>(batchSize);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for batch-size [1 - 1024]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_STATS:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long interval = std::stoul(inputValue);
+				if (65535 < interval) {
+					throw std::out_of_range("Interval out of range");
+				}
+
+				FspStats::interval = static_cast<uint16_t>(interval);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for stats [seconds]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_THREADS:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long threads = std::stoul(inputValue);
+				if (threads == 0) {
+					threads = std::max(1u, std::thread::hardware_concurrency());
+				}
+
+				if (1024 < threads) {
+					throw std::out_of_range("Thread count out of range");
+				}
+
+				UdpSocket::threads = static_cast<uint16_t>(threads);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for threads [0 - 1024]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_IO_URING:
+			UdpSocket::ioUring = true;
+			break;
+		case PARAM_COROUTINES:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long asyncThreads = std::stoul(inputValue);
+				if (asyncThreads < 1 || 1024 < asyncThreads) {
+					throw std::out_of_range("Thread count out of range");
+				}
+
+				UdpSocket::asyncThreads = static_cast<uint16_t>(asyncThreads);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for coroutines [1 - 1024]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_WORKERS:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long workers = std::stoul(inputValue);
+				if (1024 < workers) {
+					throw std::out_of_range("Worker count out of range");
+				}
+
+				UdpSocket::workers = static_cast<uint16_t>(workers);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for workers [0 - 1024]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_LOW_LATENCY:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long core = std::stoul(inputValue);
+				if (1023 < core) {
+					throw std::out_of_range("Core out of range");
+				}
+
+				UdpSocket::lowLatencyCore = static_cast<int>(core);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for low-latency [0 - 1023]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_BUSY_POLL:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long busyPoll = std::stoul(inputValue);
+				if (65535 < busyPoll) {
+					throw std::out_of_range("Busy poll time out of range");
+				}
+
+				UdpSocket::busyPoll = static_cast<uint32_t>(busyPoll);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for busy-poll [0 - 65535]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_XDP:
+			UdpSocket::xdpInterface = (++i < args.size() ? args[i] : "");
+			break;
+		case PARAM_READAHEAD:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long readahead = std::stoul(inputValue);
+				if (65536 < readahead) {
+					throw std::out_of_range("Readahead window out of range");
+				}
+
+				Readahead::maxWindow = static_cast<uint32_t>(readahead * 1024);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for readahead [0 - 65536]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_BOOT_PROFILE:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long seconds = std::stoul(inputValue);
+				if (3600 < seconds) {
+					throw std::out_of_range("Boot profile time out of range");
+				}
+
+				BootProfile::seconds = static_cast<uint16_t>(seconds);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for boot-profile [0 - 3600]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_PROFILE_DIRECTORY:
+			FspHelper::sidecarDirectory = (++i < args.size() ? args[i] : "");
+			break;
+		case PARAM_BLOCK_CACHE:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long megabytes = std::stoul(inputValue);
+				if (1048576 < megabytes) {
+					throw std::out_of_range("Block cache size out of range");
+				}
+
+				blockCacheBudget = static_cast<uint64_t>(megabytes) * 1024 * 1024;
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for block-cache [0 - 1048576]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_HUGE_PAGES:
+			hugePages = true;
+			break;
+		case PARAM_ZERO_SCAN:
+			ZeroMap::scan = true;
+			break;
+		case PARAM_DEDUPLICATE:
+			deduplicate = true;
+			break;
+		case PARAM_PRELOAD:
+			preloadList = (++i < args.size() ? args[i] : "");
+			break;
+		case PARAM_PRELOAD_BUDGET:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long megabytes = std::stoul(inputValue);
+				if (1048576 < megabytes) {
+					throw std::out_of_range("Preload budget out of range");
+				}
+
+				Preloader::budget = static_cast<uint64_t>(megabytes) * 1024 * 1024;
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for preload-budget [0 - 1048576]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_LOCK_PAGES:
+			Preloader::lockPages = true;
+			break;
+		case PARAM_UPSTREAM:
+			try
+			{
+				inputValue = (++i < args.size() ? args[i] : "");
+				upstreamIp = FspHelper::ipStringToUint32(inputValue, upstreamPort);
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Could not parse upstream ipv4 address";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_REPLICA:
+			Replicas::roots.push_back(++i < args.size() ? args[i] : "");
+			break;
+		case PARAM_FAST_TIER:
+			StorageTier::fastDirectory = (++i < args.size() ? args[i] : "");
+			break;
+		case PARAM_FAST_TIER_SIZE:
+			inputValue = (++i < args.size() ? args[i] : "");
+			try
+			{
+				unsigned long megabytes = std::stoul(inputValue);
+				if (16777216 < megabytes) {
+					throw std::out_of_range("Fast tier size out of range");
+				}
+
+				StorageTier::capacity = static_cast<uint64_t>(megabytes) * 1024 * 1024;
+			}
+			catch (const std::exception&)
+			{
+				std::cout << "Invalid value specified for fast-tier-size [0 - 16777216]";
+				return EXIT_SUCCESS;
+			}
+			break;
+		case PARAM_INDEX:
+			MetadataIndex::snapshotPath = (++i < args.size() ? args[i] : "");
+			break;
 		}
 	}
 
@@ -92,6 +377,62 @@ int main(int argumentCount, char* arguments[])
 	std::cout << "Starting server with password \"" << password << "\" in directory \"" << path.string() << "\"" << std::endl;
 
 	UdpSocket::basePath = path;
+
+	// Proxied listings and stats come from the upstream server, the index would only cover the cache
+	if (MetadataIndex::isEnabled() && upstreamIp != 0) {
+		std::cout << "Error: The metadata index can not be used in proxy mode, it is disabled" << std::endl;
+		MetadataIndex::snapshotPath.clear();
+	}
+
+#ifdef _WIN32
+	SetConsoleCtrlHandler(saveOnExit, TRUE);
+#else
+	// Blocked before any other thread is started, so only the waiting thread receives them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	std::thread([signals]() {
+		int received;
+		sigwait(&signals, &received);
+		saveState();
+		std::_Exit(EXIT_SUCCESS);
+	}).detach();
+#endif
+
+	MetadataIndex::start();
+	BlockCache::configure(blockCacheBudget, hugePages, deduplicate);
+	StorageTier::start();
+	Replicas::start();
+
+	if (upstreamIp != 0) {
+		Upstream::configure(upstreamIp, upstreamPort, password);
+	}
+
+	// Further files can be preloaded from the console while the server runs
+	if (preloadList != std::filesystem::path()) {
+		if (!Preloader::loadList(preloadList)) {
+			return EXIT_FAILURE;
+		}
+
+		std::thread(Preloader::readCommands).detach();
+	}
+
+#ifndef _WIN32
+	// Every additional thread binds its own SO_REUSEPORT socket and keeps its own client state
+	std::vector<std::thread> shards;
+	for (uint16_t shard = 1; shard < UdpSocket::threads; shard++) {
+		shards.emplace_back([ip, port, password]() {
+			UdpSocket client = UdpSocket(ip, port, password);
+			while (true) {
+				client.listen();
+			}
+		});
+	}
+#endif
+
 	UdpSocket client = UdpSocket(ip, port, password);
 
 	while (true) {
@@ -99,6 +440,14 @@ int main(int argumentCount, char* arguments[])
 	}
 }
 
+void saveState()
+{
+	// Copies in the fast tier need nothing, unfinished ones are dropped when they are adopted
+	MetadataIndex::save();
+	BootProfile::saveAll();
+	Upstream::saveAll();
+}
+
 void printHelp() {
 	std::cout << "Usage: fsp_server.exe -d [directory] [additional options]" << std::endl;
 	std::cout << std::noskipws << "  options:" << std::endl;
@@ -106,6 +455,30 @@ void printHelp() {
 	std::cout << std::noskipws << "    -p, --password:          Sets a password that clients need to supply to access files. [Default: none]" << std::endl;
 	std::cout << std::noskipws << "    -a, --address:           Determines which address the socket should be bound to. [Default: 0:0.0:0:21]" << std::endl;
 	std::cout << std::noskipws << "    -i  -ignore-keys;        Determines whether or not FSP packet key validation should be skipped. [Default: 1]" << std::endl;
+	std::cout << std::noskipws << "    -b, --batch-size:        Maximum number of datagrams received and sent per system call (Linux). [Default: 32]" << std::endl;
+	std::cout << std::noskipws << "    -t, --threads:           Number of SO_REUSEPORT sockets each served by its own thread (Linux), 0 uses one per core. [Default: 1]" << std::endl;
+	std::cout << std::noskipws << "    -w, --workers:           Number of worker threads per socket, requests of a client are always handled by the same worker (Linux). [Default: 0]" << std::endl;
+	std::cout << std::noskipws << "    -u, --io-uring:          Submit socket and file I/O through io_uring, replaces the worker pool (Linux)." << std::endl;
+	std::cout << std::noskipws << "    -c, --coroutines:        Handle requests as coroutines with n helper threads for blocking file system calls (Linux). [Default: off, 2 with io_uring]" << std::endl;
+	std::cout << std::noskipws << "    -l, --low-latency:       Pin each socket thread to a core starting at n and spin on the socket instead of sleeping (Linux). [Default: off]" << std::endl;
+	std::cout << std::noskipws << "    -y, --busy-poll:         SO_BUSY_POLL time in microseconds for low latency sockets, 0 leaves it unset (Linux). [Default: 0]" << std::endl;
+	std::cout << std::noskipws << "    -x, --xdp:               Answer CC_GET_FILE and CC_STAT through an AF_XDP socket on the given interface (Linux). [Default: off]" << std::endl;
+	std::cout << std::noskipws << "    -r, --readahead:         Largest window in KiB prefetched for sequential reads of a file, 0 disables readahead. [Default: 4096]" << std::endl;
+	std::cout << std::noskipws << "    -g, --boot-profile:      Record the blocks read in the first n seconds of an image and prefetch them on the next boot, 0 disables it. [Default: 0]" << std::endl;
+	std::cout << std::noskipws << "    -G, --profile-directory: Directory for boot profiles and zero maps. [Default: next to the file]" << std::endl;
+	std::cout << std::noskipws << "    -m, --block-cache:       Size in MiB of the block cache shared by all clients, 0 serves blocks straight from the page cache. [Default: 0]" << std::endl;
+	std::cout << std::noskipws << "    -H, --huge-pages:        Back the block cache with huge pages (Linux)." << std::endl;
+	std::cout << std::noskipws << "    -D, --dedup:             Let identical blocks of different files share one block cache entry." << std::endl;
+	std::cout << std::noskipws << "    -P, --preload:           File listing images to read into memory at startup, one per line optionally followed by a prefix in MiB." << std::endl;
+	std::cout << std::noskipws << "    -B, --preload-budget:    Memory in MiB all preloaded images may take up. [Default: 4096]" << std::endl;
+	std::cout << std::noskipws << "    -L, --mlock:             Pin preloaded images in memory so they are never evicted (Linux)." << std::endl;
+	std::cout << std::noskipws << "    -U, --upstream:          Proxy the FSP server at ip:port, the directory becomes a persistent cache of its files. [Default: off]" << std::endl;
+	std::cout << std::noskipws << "    -R, --replica:           Directory mirroring the served directory on another disk, reads go to the least loaded copy. Can be repeated." << std::endl;
+	std::cout << std::noskipws << "    -T, --fast-tier:         Directory on faster storage that the most read images are copied to. [Default: off]" << std::endl;
+	std::cout << std::noskipws << "    -S, --fast-tier-size:    Size in MiB the copies in the fast tier may take up, 0 uses its free space. [Default: 0]" << std::endl;
+	std::cout << std::noskipws << "    -I, --index:             Snapshot file of a metadata index answering CC_GET_DIR and CC_STAT from memory, kept across restarts. [Default: off]" << std::endl;
+	std::cout << std::noskipws << "    -z, --zero-scan:         Scan served images once for blocks of zeros and answer them without reading the disk." << std::endl;
+	std::cout << std::noskipws << "    -s, --stats:             Print server statistics every n seconds, 0 disables them. [Default: 0]" << std::endl;
 	std::cout << std::noskipws << "    -v, --version:           Display version info." << std::endl;
 }
 
@@ -11,6 +11,30 @@ const uint8_t PARAM_ADDRESS = 3;
 const uint8_t PARAM_VERSION = 4;
 const uint8_t PARAM_HELP = 5;
 const uint8_t PARAM_IGNORE_KEYS = 6;
+const uint8_t PARAM_BATCH_SIZE = 7;
+const uint8_t PARAM_STATS = 8;
+const uint8_t PARAM_THREADS = 9;
+const uint8_t PARAM_WORKERS = 10;
+const uint8_t PARAM_IO_URING = 11;
+const uint8_t PARAM_COROUTINES = 12;
+const uint8_t PARAM_LOW_LATENCY = 13;
+const uint8_t PARAM_BUSY_POLL = 14;
+const uint8_t PARAM_XDP = 15;
+const uint8_t PARAM_READAHEAD = 16;
+const uint8_t PARAM_BOOT_PROFILE = 17;
+const uint8_t PARAM_PROFILE_DIRECTORY = 18;
+const uint8_t PARAM_BLOCK_CACHE = 19;
+const uint8_t PARAM_HUGE_PAGES = 20;
+const uint8_t PARAM_ZERO_SCAN = 21;
+const uint8_t PARAM_DEDUPLICATE = 22;
+const uint8_t PARAM_PRELOAD = 23;
+const uint8_t PARAM_PRELOAD_BUDGET = 24;
+const uint8_t PARAM_LOCK_PAGES = 25;
+const uint8_t PARAM_FAST_TIER = 26;
+const uint8_t PARAM_FAST_TIER_SIZE = 27;
+const uint8_t PARAM_REPLICA = 28;
+const uint8_t PARAM_UPSTREAM = 29;
+const uint8_t PARAM_INDEX = 30;
 
 const std::map<std::string, uint8_t> VALID_ARGUMENTS = {
 	{"-d", PARAM_DIRECTORY},
@@ -25,7 +49,58 @@ const std::map<std::string, uint8_t> VALID_ARGUMENTS = {
 	{"--help", PARAM_HELP},
 	{"-i", PARAM_IGNORE_KEYS},
 	{"--ignore-keys", PARAM_IGNORE_KEYS},
+	{"-b", PARAM_BATCH_SIZE},
+	{"--batch-size", PARAM_BATCH_SIZE},
+	{"-s", PARAM_STATS},
+	{"--stats", PARAM_STATS},
+	{"-t", PARAM_THREADS},
+	{"--threads", PARAM_THREADS},
+	{"-w", PARAM_WORKERS},
+	{"--workers", PARAM_WORKERS},
+	{"-u", PARAM_IO_URING},
+	{"--io-uring", PARAM_IO_URING},
+	{"-c", PARAM_COROUTINES},
+	{"--coroutines", PARAM_COROUTINES},
+	{"-l", PARAM_LOW_LATENCY},
+	{"--low-latency", PARAM_LOW_LATENCY},
+	{"-y", PARAM_BUSY_POLL},
+	{"--busy-poll", PARAM_BUSY_POLL},
+	{"-x", PARAM_XDP},
+	{"--xdp", PARAM_XDP},
+	{"-r", PARAM_READAHEAD},
+	{"--readahead", PARAM_READAHEAD},
+	{"-g", PARAM_BOOT_PROFILE},
+	{"--boot-profile", PARAM_BOOT_PROFILE},
+	{"-G", PARAM_PROFILE_DIRECTORY},
+	{"--profile-directory", PARAM_PROFILE_DIRECTORY},
+	{"-m", PARAM_BLOCK_CACHE},
+	{"--block-cache", PARAM_BLOCK_CACHE},
+	{"-H", PARAM_HUGE_PAGES},
+	{"--huge-pages", PARAM_HUGE_PAGES},
+	{"-z", PARAM_ZERO_SCAN},
+	{"--zero-scan", PARAM_ZERO_SCAN},
+	{"-D", PARAM_DEDUPLICATE},
+	{"--dedup", PARAM_DEDUPLICATE},
+	{"-P", PARAM_PRELOAD},
+	{"--preload", PARAM_PRELOAD},
+	{"-B", PARAM_PRELOAD_BUDGET},
+	{"--preload-budget", PARAM_PRELOAD_BUDGET},
+	{"-L", PARAM_LOCK_PAGES},
+	{"--mlock", PARAM_LOCK_PAGES},
+	{"-T", PARAM_FAST_TIER},
+	{"--fast-tier", PARAM_FAST_TIER},
+	{"-S", PARAM_FAST_TIER_SIZE},
+	{"--fast-tier-size", PARAM_FAST_TIER_SIZE},
+	{"-R", PARAM_REPLICA},
+	{"--replica", PARAM_REPLICA},
+	{"-U", PARAM_UPSTREAM},
+	{"--upstream", PARAM_UPSTREAM},
+	{"-I", PARAM_INDEX},
+	{"--index", PARAM_INDEX},
 };
 
 void printVersion();
-void printHelp();
\ No newline at end of file
+void printHelp();
+
+// Saves the state that is otherwise only written periodically, called once when the server is stopped
+void saveState();
\ No newline at end of file
@@ -0,0 +1,425 @@
+#include "FileHandleCache.h"
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <csetjmp>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <unistd.h>
+#endif
+
+std::atomic<uint64_t> FileHandle::nextId = 0;
+std::mutex FileHandleCache::mutex;
+std::list<std::shared_ptr<FileHandle>> FileHandleCache::handles;
+std::unordered_map<std::filesystem::path::string_type, std::list<std::shared_ptr<FileHandle>>::iterator> FileHandleCache::index;
+std::vector<std::weak_ptr<FileHandle>> FileHandleCache::evicted;
+
+#ifndef _WIN32
+namespace
+{
+	// Set while this thread reads from a mapping, a SIGBUS raised in the meantime jumps back to it
+	thread_local sigjmp_buf* mappingFault = nullptr;
+
+	void onBusError(int signal)
+	{
+		if (mappingFault != nullptr) {
+			siglongjmp(*mappingFault, 1);
+		}
+
+		// Not caused by a mapped file, the process terminates as it would have without the handler
+		std::signal(signal, SIG_DFL);
+		std::raise(signal);
+	}
+}
+#endif
+
+#ifdef _WIN32
+FileHandle::FileHandle(const std::filesystem::path& setPath) : path(setPath), id(nextId++)
+{
+	handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Could not open file");
+	}
+
+	LARGE_INTEGER fileSize;
+	FILETIME writeTime;
+	if (!GetFileSizeEx(handle, &fileSize) || !GetFileTime(handle, nullptr, nullptr, &writeTime)) {
+		CloseHandle(handle);
+		throw std::runtime_error("Could not query file");
+	}
+
+	// FILETIME counts 100ns intervals since 1601-01-01
+	uint64_t ticks = (static_cast<uint64_t>(writeTime.dwHighDateTime) << 32) | writeTime.dwLowDateTime;
+	size = static_cast<uint64_t>(fileSize.QuadPart);
+	storedSize = size;
+	modified = static_cast<std::time_t>((ticks - 116444736000000000ULL) / 10000000ULL);
+	this->writeTime = ticks;
+	lastCheck = std::chrono::steady_clock::now().time_since_epoch().count();
+	openImage();
+	findZeros();
+}
+
+FileHandle::~FileHandle()
+{
+	CloseHandle(handle);
+}
+
+int64_t FileHandle::readStored(void* buffer, size_t length, uint64_t position) const
+{
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = static_cast<DWORD>(position & 0xFFFFFFFF);
+	overlapped.OffsetHigh = static_cast<DWORD>(position >> 32);
+
+	DWORD bytesRead = 0;
+	if (!ReadFile(handle, buffer, static_cast<DWORD>(length), &bytesRead, &overlapped) && GetLastError() != ERROR_HANDLE_EOF) {
+		return -1;
+	}
+
+	return bytesRead;
+}
+
+void FileHandle::prefetchStored(uint64_t position, uint64_t length) const
+{
+	// Sequential reads are already detected by the cache manager, there is no asynchronous hint for single ranges
+}
+
+std::string FileHandle::getVersion() const
+{
+	return std::to_string(writeTime);
+}
+
+bool FileHandle::isUnchanged() const
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes)) {
+		return false;
+	}
+
+	uint64_t currentSize = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+	uint64_t currentWriteTime = (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+	return currentSize == storedSize && currentWriteTime == writeTime;
+}
+
+void FileHandle::findHoles()
+{
+	// Everything between the allocated ranges of a sparse file is a hole
+	FILE_ALLOCATED_RANGE_BUFFER query = {};
+	query.Length.QuadPart = static_cast<LONGLONG>(size);
+	FILE_ALLOCATED_RANGE_BUFFER allocated[64];
+	uint64_t position = 0;
+
+	while (true) {
+		DWORD bytesReturned = 0;
+		BOOL complete = DeviceIoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), allocated, sizeof(allocated), &bytesReturned, nullptr);
+		if (!complete && GetLastError() != ERROR_MORE_DATA) {
+			// Not supported by the file system, the whole file is data
+			position = size;
+			break;
+		}
+
+		DWORD count = bytesReturned / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+		for (DWORD i = 0; i < count; i++) {
+			uint64_t start = static_cast<uint64_t>(allocated[i].FileOffset.QuadPart);
+			zeros.add(position, start);
+			position = start + static_cast<uint64_t>(allocated[i].Length.QuadPart);
+		}
+
+		if (complete || count == 0) {
+			break;
+		}
+
+		query.FileOffset.QuadPart = static_cast<LONGLONG>(position);
+		query.Length.QuadPart = static_cast<LONGLONG>(size - position);
+	}
+
+	zeros.add(position, size);
+}
+#else
+FileHandle::FileHandle(const std::filesystem::path& setPath) : path(setPath), id(nextId++)
+{
+	descriptor = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (descriptor < 0) {
+		throw std::runtime_error("Could not open file");
+	}
+
+	struct stat status;
+	if (fstat(descriptor, &status) != 0) {
+		close(descriptor);
+		throw std::runtime_error("Could not query file");
+	}
+
+	size = static_cast<uint64_t>(status.st_size);
+	storedSize = size;
+	modified = status.st_mtime;
+	inode = static_cast<uint64_t>(status.st_ino);
+	modifiedNanoseconds = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+	lastCheck = std::chrono::steady_clock::now().time_since_epoch().count();
+	openImage();
+	findZeros();
+
+	// Blocks are sent straight from the page cache. Reading a part that a truncation removed
+	// raises SIGBUS, sumMapping() catches it and the kernel fails such a send with EFAULT.
+	if (image == nullptr && 0 < size) {
+		void* area = mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0);
+		if (area != MAP_FAILED) {
+			mapping = static_cast<char*>(area);
+		}
+	}
+}
+
+FileHandle::~FileHandle()
+{
+	if (mapping != nullptr) {
+		munmap(mapping, size);
+	}
+
+	close(descriptor);
+}
+
+int64_t FileHandle::readStored(void* buffer, size_t length, uint64_t position) const
+{
+	return pread(descriptor, buffer, length, static_cast<off_t>(position));
+}
+
+void FileHandle::prefetchStored(uint64_t position, uint64_t length) const
+{
+	posix_fadvise(descriptor, static_cast<off_t>(position), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+}
+
+int FileHandle::getDescriptor() const
+{
+	return descriptor;
+}
+
+const char* FileHandle::getMapping() const
+{
+	return mapping;
+}
+
+bool FileHandle::sumMapping(uint64_t position, size_t length, uint32_t(*sum)(const char*, size_t), uint32_t& result)
+{
+	static std::once_flag installed;
+	std::call_once(installed, []() {
+		struct sigaction action = {};
+		action.sa_handler = onBusError;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGBUS, &action, nullptr);
+	});
+
+	sigjmp_buf jump;
+	if (sigsetjmp(jump, 1) != 0) {
+		mappingFault = nullptr;
+		FileHandleCache::invalidate(path);
+		return false;
+	}
+
+	mappingFault = &jump;
+	result = sum(mapping + position, length);
+	mappingFault = nullptr;
+	return true;
+}
+
+std::string FileHandle::getVersion() const
+{
+	return std::to_string(inode) + ":" + std::to_string(modifiedNanoseconds);
+}
+
+bool FileHandle::isUnchanged() const
+{
+	struct stat status;
+	if (stat(path.c_str(), &status) != 0) {
+		return false;
+	}
+
+	int64_t currentModified = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+	return static_cast<uint64_t>(status.st_ino) == inode && static_cast<uint64_t>(status.st_size) == storedSize && currentModified == modifiedNanoseconds;
+}
+
+void FileHandle::findHoles()
+{
+	// File systems without hole support report the whole file as data
+	uint64_t position = 0;
+	while (position < size) {
+		off_t data = lseek(descriptor, static_cast<off_t>(position), SEEK_DATA);
+		if (data < 0) {
+			// Only a hole is left up to the end of the file
+			zeros.add(position, errno == ENXIO ? size : position);
+			break;
+		}
+
+		zeros.add(position, static_cast<uint64_t>(data));
+		off_t hole = lseek(descriptor, data, SEEK_HOLE);
+		if (hole < 0) {
+			break;
+		}
+
+		position = static_cast<uint64_t>(hole);
+	}
+}
+#endif
+
+void FileHandle::openImage()
+{
+	if (!CompressedImage::isCompressedName(path)) {
+		return;
+	}
+
+	// The image outlives neither the handle nor its descriptor
+	image = CompressedImage::open(path, storedSize,
+		[this](void* buffer, size_t length, uint64_t position) { return readStored(buffer, length, position); },
+		[this](uint64_t position, uint64_t length) { prefetchStored(position, length); });
+	if (image != nullptr) {
+		size = image->getSize();
+	}
+}
+
+int64_t FileHandle::read(void* buffer, size_t length, uint64_t position) const
+{
+	if (image != nullptr) {
+		return image->read(buffer, length, position);
+	}
+
+	return readStored(buffer, length, position);
+}
+
+void FileHandle::prefetch(uint64_t position, uint64_t length) const
+{
+	if (image != nullptr) {
+		// Decoding runs on other threads, they keep the handle alive
+		image->prefetch(shared_from_this(), position, length);
+		return;
+	}
+
+	prefetchStored(position, length);
+}
+
+void FileHandle::findZeros()
+{
+	if (image != nullptr) {
+		image->addZeros(zeros);
+	}
+	else
+	{
+		findHoles();
+	}
+
+	zerosScanned = zeros.load(*this);
+	zeros.finish();
+}
+
+bool FileHandle::isCompressed() const
+{
+	return image != nullptr;
+}
+
+bool FileHandle::isValid()
+{
+	if (!valid.load(std::memory_order_acquire)) {
+		return false;
+	}
+
+	auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+	auto last = lastCheck.load(std::memory_order_relaxed);
+	if (now - last < REVALIDATE_INTERVAL.count() || !lastCheck.compare_exchange_strong(last, now)) {
+		return true;
+	}
+
+	if (!isUnchanged()) {
+		FileHandleCache::invalidate(path);
+		return false;
+	}
+
+	return true;
+}
+
+std::shared_ptr<FileHandle> FileHandleCache::open(const std::filesystem::path& path)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iterator = index.find(path.native());
+		if (iterator != index.end()) {
+			handles.splice(handles.begin(), handles, iterator->second);
+			return *iterator->second;
+		}
+	}
+
+	// Opened without holding the lock, a slow disk must not stall the other threads
+	std::shared_ptr<FileHandle> handle;
+	try
+	{
+		handle = std::make_shared<FileHandle>(path);
+	}
+	catch (const std::exception&)
+	{
+		return nullptr;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iterator = index.find(path.native());
+	if (iterator != index.end()) {
+		// Another thread opened it in the meantime
+		handles.splice(handles.begin(), handles, iterator->second);
+		return *iterator->second;
+	}
+
+	handles.push_front(handle);
+	index[path.native()] = handles.begin();
+
+	if (MAX_OPEN_FILES < handles.size()) {
+		std::erase_if(evicted, [](const std::weak_ptr<FileHandle>& file) { return file.expired(); });
+		evicted.push_back(handles.back());
+		index.erase(handles.back()->path.native());
+		handles.pop_back();
+	}
+
+	if (ZeroMap::scan && !handle->zerosScanned && ZeroMap::MIN_SCAN_SIZE <= handle->size) {
+		ZeroMap::scanAsync(handle);
+	}
+
+	return handle;
+}
+
+void FileHandleCache::invalidate(const std::filesystem::path& path)
+{
+	const auto& prefix = path.native();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iterator = handles.begin();
+	while (iterator != handles.end()) {
+		const auto& cached = (*iterator)->path.native();
+		bool below = prefix.size() < cached.size() && cached.compare(0, prefix.size(), prefix) == 0 && cached[prefix.size()] == std::filesystem::path::preferred_separator;
+		if (cached == prefix || below) {
+			(*iterator)->valid.store(false, std::memory_order_release);
+			index.erase(cached);
+			iterator = handles.erase(iterator);
+		}
+		else
+		{
+			++iterator;
+		}
+	}
+
+	auto file = evicted.begin();
+	while (file != evicted.end()) {
+		std::shared_ptr<FileHandle> handle = file->lock();
+		if (handle == nullptr) {
+			file = evicted.erase(file);
+			continue;
+		}
+
+		const auto& cached = handle->path.native();
+		bool below = prefix.size() < cached.size() && cached.compare(0, prefix.size(), prefix) == 0 && cached[prefix.size()] == std::filesystem::path::preferred_separator;
+		if (cached == prefix || below) {
+			handle->valid.store(false, std::memory_order_release);
+			file = evicted.erase(file);
+		}
+		else
+		{
+			++file;
+		}
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "CompressedImage.h"
+#include "ZeroMap.h"
+
+// Read-only file opened once and shared by all clients. Reads are positional,
+// so any number of threads can read through the same handle at once. Compressed
+// images are decoded transparently, size and reads refer to the decoded image.
+class FileHandle : public std::enable_shared_from_this<FileHandle>
+{
+public:
+	std::filesystem::path path;
+
+	// Unique for every opened file, a replaced file gets a new one
+	uint64_t id;
+	uint64_t size = 0;
+	std::time_t modified = 0;
+
+	// Holes of the file and the zero blocks found by an earlier scan
+	ZeroMap zeros;
+
+	// Throws if the file can not be opened
+	FileHandle(const std::filesystem::path& setPath);
+	~FileHandle();
+	FileHandle(const FileHandle&) = delete;
+	FileHandle& operator=(const FileHandle&) = delete;
+
+	// Returns the number of bytes read or -1 on error
+	int64_t read(void* buffer, size_t length, uint64_t position) const;
+
+	// Starts reading the range into the page cache without waiting for it
+	void prefetch(uint64_t position, uint64_t length) const;
+
+	bool isCompressed() const;
+
+	// Inode and modification time in nanoseconds (the write time on Windows) of the stored file. Sidecars
+	// are only trusted for the same version, a file rewritten within a second keeps its size and modified.
+	std::string getVersion() const;
+
+	// False once the file has been renamed, deleted or replaced. Changes made outside of
+	// the server are picked up by comparing size and modification time once per second.
+	bool isValid();
+
+#ifndef _WIN32
+	int getDescriptor() const;
+
+	// Read-only mapping of the whole file, nullptr if it could not be mapped or is compressed
+	const char* getMapping() const;
+
+	// Applies sum to a range of the mapping. Returns false and invalidates the handle if the file was
+	// truncated in place and the mapping faulted, sum must not leave anything to clean up when it faults.
+	bool sumMapping(uint64_t position, size_t length, uint32_t(*sum)(const char*, size_t), uint32_t& result);
+#endif
+
+private:
+	friend class FileHandleCache;
+
+	static constexpr std::chrono::steady_clock::duration REVALIDATE_INTERVAL = std::chrono::seconds(1);
+	static std::atomic<uint64_t> nextId;
+
+	std::atomic<bool> valid = true;
+	bool zerosScanned = false;
+
+	// Size of the file on disk, differs from size for compressed images
+	uint64_t storedSize = 0;
+	std::unique_ptr<CompressedImage> image;
+	std::atomic<std::chrono::steady_clock::rep> lastCheck;
+#ifdef _WIN32
+	void* handle;
+	uint64_t writeTime = 0;
+#else
+	int descriptor;
+	char* mapping = nullptr;
+	uint64_t inode = 0;
+	int64_t modifiedNanoseconds = 0;
+#endif
+
+	bool isUnchanged() const;
+	void findZeros();
+	void findHoles();
+	void openImage();
+	int64_t readStored(void* buffer, size_t length, uint64_t position) const;
+	void prefetchStored(uint64_t position, uint64_t length) const;
+};
+
+// Range of a memory mapped file, keeps the mapping alive while a datagram references it
+struct FileSlice
+{
+	std::shared_ptr<FileHandle> file;
+	const char* data = nullptr;
+	size_t length = 0;
+};
+
+// Bounded LRU of open files keyed by their resolved path, shared by all socket
+// and worker threads. Evicted handles stay open until their last user drops them.
+class FileHandleCache
+{
+public:
+	// Returns the cached handle of path or opens it, nullptr if it can not be opened
+	static std::shared_ptr<FileHandle> open(const std::filesystem::path& path);
+
+	// Drops path and everything below it, handles still in use report !isValid()
+	static void invalidate(const std::filesystem::path& path);
+
+	static const size_t MAX_OPEN_FILES = 64;
+
+private:
+	static std::mutex mutex;
+
+	// Most recently used first
+	static std::list<std::shared_ptr<FileHandle>> handles;
+	static std::unordered_map<std::filesystem::path::string_type, std::list<std::shared_ptr<FileHandle>>::iterator> index;
+
+	// Handles dropped from the LRU that clients may still read from, they are invalidated as well
+	static std::vector<std::weak_ptr<FileHandle>> evicted;
+};
@@ -4,32 +4,79 @@
 #include <filesystem>
 #include <string>
 #include <fstream>
+#include <stdexcept>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-std::map<uint32_t, FspClient> FspClient::clients = {};
-boolean FspClient::checkKeys = false;
+thread_local std::map<uint32_t, FspClient> FspClient::clients = {};
+bool FspClient::checkKeys = false;
+std::atomic<uint64_t> FspClient::nextId = 0;
 
 FspClient::FspClient(uint32_t setIpAddress)
 {
+	static thread_local std::mt19937 generator(std::random_device{}());
+
 	deleted = false;
-	key = std::rand();
+	key = static_cast<uint16_t>(generator());
 	ipAddress = setIpAddress;
+	id = nextId++;
 	lastUpdate = std::time(nullptr);
 }
 
-boolean FspClient::isOutdated() {
+bool FspClient::isOutdated() {
 	auto current = std::time(nullptr);
 	double difference = difftime(current, lastUpdate);
 	return MAX_AFK_TIME < difference;
 }
 
+void FspClient::closeUploadFile() {
+	if (uploadFileStream.is_open()) {
+		uploadFileStream.close();
+	}
+
+#ifndef _WIN32
+	if (0 <= uploadDescriptor) {
+		close(uploadDescriptor);
+		uploadDescriptor = -1;
+	}
+#endif
+}
+
+void FspClient::closeFiles() {
+	closeUploadFile();
+	readHandle.reset();
+	readSubPath.clear();
+	readPath.clear();
+	readahead.reset();
+}
+
+std::shared_ptr<FileHandle> FspClient::openReadFile(const std::filesystem::path& path) {
+	// Consecutive requests for the same file skip the lock of the shared cache
+	const std::filesystem::path& routedPath = replicaRoute.route(path);
+	if (readHandle == nullptr || !readHandle->isValid() || readHandle->path != routedPath) {
+		readHandle = FileHandleCache::open(routedPath);
+	}
+
+	return readHandle;
+}
+
+#ifndef _WIN32
+bool FspClient::openUploadDescriptor() {
+	if (0 <= uploadDescriptor) {
+		return true;
+	}
+
+	uploadDescriptor = open(getTempFilePath().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	return 0 <= uploadDescriptor;
+}
+#endif
+
 void FspClient::deleteBufferFile() {
 	try
 	{
-		std::filesystem::path tempFile = getTempFilePath();
-		if (FspPacket::lastUploadFile == tempFile) {
-			FspPacket::lastUploadFileStream.close();
-		}
-
+		closeFiles();
 		std::filesystem::remove(getTempFilePath());
 	}
 	catch (const std::exception&)
@@ -39,7 +86,7 @@ void FspClient::deleteBufferFile() {
 
 std::filesystem::path FspClient::getTempFilePath() {
 	std::filesystem::path tempPath = std::filesystem::current_path();
-	tempPath.append(std::to_string(ipAddress) + ".tmp");
+	tempPath.append(std::to_string(ipAddress) + "_" + std::to_string(id) + ".tmp");
 	return tempPath;
 }
 
@@ -47,9 +94,7 @@ FspClient& FspClient::getClient(uint32_t ipAddress, uint16_t actualKey)
 {
 	auto iterator = FspClient::clients.find(ipAddress);
 	if (iterator == FspClient::clients.end()) {
-		FspClient c(ipAddress);
-		FspClient::clients.insert({ ipAddress, c });
-		return FspClient::clients.find(ipAddress)->second;
+		return FspClient::clients.try_emplace(ipAddress, ipAddress).first->second;
 	}
 	else
 	{
@@ -58,7 +103,7 @@ FspClient& FspClient::getClient(uint32_t ipAddress, uint16_t actualKey)
 		if (FspClient::checkKeys && c.key != actualKey) {
 			double difference = difftime(now, c.lastUpdate);
 			if (difference < BAD_KEY_GRACE_TIME) {
-				throw std::exception("Bad key");
+				throw std::runtime_error("Bad key");
 			}
 		}
 
@@ -71,7 +116,7 @@ void FspClient::cleanUp() {
 	std::map<uint32_t, FspClient>::iterator it = FspClient::clients.begin();
 	while (it != FspClient::clients.end())
 	{
-		if (it->second.deleted || it->second.isOutdated()) {
+		if (!it->second.busy && (it->second.deleted || it->second.isOutdated())) {
 			it->second.deleteBufferFile();
 			it = FspClient::clients.erase(it);
 		}
@@ -80,4 +125,4 @@ void FspClient::cleanUp() {
 			++it;
 		}
 	}
-}
\ No newline at end of file
+}
@@ -1,28 +1,91 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
 #include <map>
-#include <winsock2.h>
+#include <memory>
+#include <string>
 #include <filesystem>
+#include <fstream>
+#include <vector>
+#include "BootProfile.h"
+#include "FileHandleCache.h"
+#include "Readahead.h"
+#include "Replicas.h"
+#include "StorageTier.h"
+
 class FspClient
 {
 public:
 	uint16_t key;
 	uint32_t ipAddress;
+
+	// Unique per session, every shard and worker keeps its own sessions of the same address
+	uint64_t id;
 	bool deleted;
 	std::time_t lastUpdate;
 
+	// Set while an asynchronous handler works on this client, it is neither expired nor served concurrently
+	bool busy = false;
+
+	// Requests that arrived while busy, served in order once the running handler completes
+	std::deque<std::function<void()>> pendingRequests;
+
+	// File of the previous FspPacket::getFile() request, reused while it is still valid
+	std::shared_ptr<FileHandle> readHandle;
+
+	// Request path readHandle was resolved from and the path before it was routed to a replica (low latency mode)
+	std::string readSubPath;
+	std::filesystem::path readPath;
+
+	// Mirror of the served directory readHandle is read from
+	ReplicaRoute replicaRoute;
+
+	// Sequential run detection for the blocks read from readHandle
+	Readahead readahead;
+
+	// Records or replays the boot sequence of the image the client reads
+	BootProfile bootProfile;
+
+	// Counts the bytes read per file for the fast tier
+	StorageTier storageTier;
+
+	// Cache data for FspPacket::uploadFile()
+	std::filesystem::path uploadFilePath;
+	std::ofstream uploadFileStream;
+
+#ifndef _WIN32
+	// Descriptor for asynchronous uploads (io_uring backend)
+	int uploadDescriptor = -1;
+
+	bool openUploadDescriptor();
+#endif
+
 	FspClient(uint32_t setIpAddress);
 	std::filesystem::path getTempFilePath();
+	std::shared_ptr<FileHandle> openReadFile(const std::filesystem::path& path);
+	void closeUploadFile();
+	void closeFiles();
 	void deleteBufferFile();
-	boolean isOutdated();
+	bool isOutdated();
 
-	static boolean checkKeys;
+	static bool checkKeys;
 
 	static void cleanUp();
 	static FspClient& getClient(uint32_t ipAddress, uint16_t actualKey);
-	static std::map<uint32_t, FspClient> clients;
+
+	// Every socket or worker thread serves its own set of clients
+	static thread_local std::map<uint32_t, FspClient> clients;
+
+	static const uint16_t CLEANUP_INTERVAL = 10;
+	static const uint8_t MAX_PENDING_REQUESTS = 16;
 
 private:
 	static const uint16_t MAX_AFK_TIME = 5 * 60;
 	static const uint8_t BAD_KEY_GRACE_TIME = 60;
+
+	static std::atomic<uint64_t> nextId;
 };
 
@@ -1,10 +1,11 @@
 #include "FspDirEnt.h"
 #include "FspHelper.h"
+#include "CompressedImage.h"
+#include <stdexcept>
 
 FspDirEnt::FspDirEnt(std::filesystem::directory_entry entry)
 {
 	filename = entry.path().filename().generic_string();
-	size = entry.file_size();
 
 	time = FspHelper::fileTimeTypeToUnix(entry.last_write_time());
 	std::filesystem::file_status status = entry.status();
@@ -12,13 +13,44 @@ FspDirEnt::FspDirEnt(std::filesystem::directory_entry entry)
 	switch (status.type())
 	{
 	case std::filesystem::file_type::directory:
+		// file_size() is only defined for regular files outside of Windows
+		size = 0;
 		type = TYPE::TYPE_DIR;
 		break;
 	case std::filesystem::file_type::regular:
-		type = TYPE::TYPE_FILE;
+		setFile(entry.path(), entry.file_size());
 		break;
 	default:
-		throw std::exception("Invalid file");
+		throw std::runtime_error("Invalid file");
+	}
+}
+
+FspDirEnt::FspDirEnt(const std::filesystem::path& path, uint32_t setTime, uint64_t fileSize, bool directory)
+{
+	filename = path.filename().generic_string();
+	time = setTime;
+	size = 0;
+	type = TYPE::TYPE_DIR;
+
+	if (!directory) {
+		setFile(path, fileSize);
+	}
+}
+
+void FspDirEnt::setFile(const std::filesystem::path& path, uint64_t fileSize)
+{
+	size = static_cast<uint32_t>(fileSize);
+	type = TYPE::TYPE_FILE;
+
+	// Compressed images are listed with their decoded size as .iso, unless such a file exists as well
+	if (CompressedImage::isCompressedName(path)) {
+		uint64_t imageSize = CompressedImage::readSize(path);
+		std::filesystem::path imagePath = CompressedImage::getImageName(path);
+		std::error_code error;
+		if (0 < imageSize && !std::filesystem::exists(imagePath, error)) {
+			size = static_cast<uint32_t>(imageSize);
+			filename = imagePath.filename().generic_string();
+		}
 	}
 }
 
@@ -1,6 +1,8 @@
 #pragma once
 #include <cstdint>
 #include <filesystem>
+#include <string>
+#include <vector>
 
 class FspDirEnt
 {
@@ -20,6 +22,9 @@ public:
 	std::string filename;
 
 	FspDirEnt(std::filesystem::directory_entry entry);
+
+	// Entry whose metadata is already known, e.g. from statx
+	FspDirEnt(const std::filesystem::path& path, uint32_t setTime, uint64_t fileSize, bool directory);
 	std::vector<uint8_t> getRawBytes(bool includeFilenameAndPadding = true);
 
 	static FspDirEnt getSkipEntry(int padding);
@@ -27,5 +32,6 @@ public:
 private:
 	uint16_t padding = 0;
 	FspDirEnt(TYPE setType, int setPadding);
+	void setFile(const std::filesystem::path& path, uint64_t fileSize);
 };
 
@@ -1,15 +1,30 @@
 #include "FspHelper.h"
 #include "FspPacket.h"
 #include "UdpSocket.h"
+#include "CompressedImage.h"
+#include "PathCache.h"
+#include "StorageTier.h"
 #include <regex>
 #include <filesystem>
 #include <vector>
+#include <stdexcept>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
+
+std::filesystem::path FspHelper::sidecarDirectory;
 
 std::string FspHelper::getSubPath(std::vector<uint8_t> data, std::string& outPassword)
 {
 	std::string appendage;
 	appendage.insert(appendage.end(), data.begin(), data.end());
 
+	// Paths are null terminated on the wire, POSIX paths must not contain the terminator
+	size_t terminator = appendage.find('\0');
+	if (terminator != std::string::npos) {
+		appendage.erase(terminator);
+	}
+
 	size_t position = appendage.find_last_of('\n');
 	if (position != std::string::npos) {
 		outPassword.insert(outPassword.end(), appendage.begin() + position + 1, appendage.end());
@@ -19,7 +34,39 @@ std::string FspHelper::getSubPath(std::vector<uint8_t> data, std::string& outPas
 	return appendage;
 }
 
-std::filesystem::path FspHelper::getCompletePath(std::string subPath, std::vector<std::filesystem::file_type> fileTypes)
+std::filesystem::path FspHelper::getCompletePath(std::string subPath, const std::vector<std::filesystem::file_type>& fileTypes)
+{
+	// Commands that create or remove files ask for several types, they are rare and never cached
+	bool regular = fileTypes.size() == 1 && fileTypes[0] == std::filesystem::file_type::regular;
+	bool directory = fileTypes.size() == 1 && fileTypes[0] == std::filesystem::file_type::directory;
+	if (!regular && !directory) {
+		return findPath(std::move(subPath), fileTypes);
+	}
+
+	std::string key = PathCache::getKey(subPath, fileTypes[0]);
+	std::filesystem::path actualPath;
+	if (!PathCache::find(key, actualPath)) {
+		try
+		{
+			actualPath = findPath(subPath, fileTypes);
+		}
+		catch (const std::exception&)
+		{
+			actualPath.clear();
+		}
+
+		PathCache::insert(key, actualPath);
+	}
+
+	if (actualPath.empty()) {
+		throw std::runtime_error("Invalid path specified");
+	}
+
+	// Reads of promoted files go to their copy in the fast tier, promotions change independently of the cache
+	return regular ? StorageTier::resolve(actualPath) : actualPath;
+}
+
+std::filesystem::path FspHelper::findPath(std::string subPath, const std::vector<std::filesystem::file_type>& fileTypes)
 {
 	subPath.erase(0, subPath.find_first_not_of('\\'));
 	subPath.erase(0, subPath.find_first_not_of('/'));
@@ -32,16 +79,34 @@ std::filesystem::path FspHelper::getCompletePath(std::string subPath, std::vecto
 	trimPath.erase(trimPath.find_last_not_of('\\') + 1);
 	trimPath.erase(trimPath.find_last_not_of('/') + 1);
 
-	actualPath = std::filesystem::absolute(trimPath);
+	actualPath = normalize(trimPath);
 
 	if (!checkPath(base, actualPath, fileTypes)) {
-		throw std::exception("Invalid path specified");
+		// Compressed images are read as the .iso they are listed as
+		std::filesystem::path compressedPath;
+		if (fileTypes.size() == 1 && fileTypes[0] == std::filesystem::file_type::regular) {
+			compressedPath = CompressedImage::findCompressed(actualPath);
+		}
+
+		if (compressedPath.empty() || !checkPath(base, compressedPath, fileTypes)) {
+			throw std::runtime_error("Invalid path specified");
+		}
+
+		return compressedPath;
 	}
 
 	return actualPath;
 }
 
-boolean FspHelper::checkPath(std::filesystem::path base, std::filesystem::path actualPath, std::vector<std::filesystem::file_type> fileTypes)
+std::filesystem::path FspHelper::normalize(const std::filesystem::path& path)
+{
+	// Request paths are built from the base path as given, e.g. "./dir/game.iso" or "../games/game.iso"
+	std::error_code error;
+	std::filesystem::path absolutePath = std::filesystem::absolute(path, error);
+	return error ? path.lexically_normal() : absolutePath.lexically_normal();
+}
+
+bool FspHelper::checkPath(const std::filesystem::path& base, const std::filesystem::path& actualPath, const std::vector<std::filesystem::file_type>& fileTypes)
 {
 	// Directory validity check
 	if (actualPath != base) {
@@ -51,6 +116,10 @@ boolean FspHelper::checkPath(std::filesystem::path base, std::filesystem::path a
 		}
 	}
 
+	if (isSidecarName(actualPath.filename().string())) {
+		return false;
+	}
+
 	std::filesystem::file_status status = std::filesystem::status(actualPath);
 	if (std::find(fileTypes.begin(), fileTypes.end(), status.type()) == fileTypes.end()) {
 		return false;
@@ -63,7 +132,7 @@ boolean FspHelper::checkPath(std::filesystem::path base, std::filesystem::path a
 	return true;
 }
 
-std::unique_ptr<FspPacket> FspHelper::validatePassword(std::string expected, std::string actual, FspClient fspClient, uint16_t sequence)
+std::unique_ptr<FspPacket> FspHelper::validatePassword(std::string expected, std::string actual, const FspClient& fspClient, uint16_t sequence)
 {
 	if (expected.length() == 0) {
 		return nullptr;
@@ -91,7 +160,11 @@ std::unique_ptr<FspPacket> FspHelper::validatePassword(std::string expected, std
 
 uint32_t FspHelper::fileTimeTypeToUnix(std::filesystem::file_time_type fileTime)
 {
+#if defined(_WIN32)
 	std::chrono::time_point<std::chrono::system_clock> systemTime = std::chrono::clock_cast<std::chrono::system_clock>(fileTime);
+#else
+	auto systemTime = std::filesystem::file_time_type::clock::to_sys(fileTime);
+#endif
 	return std::chrono::system_clock::to_time_t(systemTime);
 }
 
@@ -102,7 +175,7 @@ uint32_t FspHelper::ipStringToUint32(std::string ipAddress, uint16_t& port)
 	std::smatch matches;
 	auto result = std::regex_search(ipAddress, matches, ipRegex);
 	if (!result) {
-		throw std::exception("Invalid ipv4 address");
+		throw std::runtime_error("Invalid ipv4 address");
 	}
 
 	if (matches.size() == 8) {
@@ -125,16 +198,47 @@ std::string FspHelper::uInt32ToIpString(uint32_t ip, uint16_t port)
 	std::string ipString;
 	uint8_t shift = 24;
 	while (shift <= 24) {
+		ipString.append(std::to_string((ip >> shift) & 0xFF));
 		if (0 < shift) {
-			ipString.append(std::format("{:d}.", (ip >> shift) & 0xFF));
-		}
-		else {
-			ipString.append(std::format("{:d}", (ip >> shift) & 0xFF));
+			ipString.append(".");
 		}
 
 		shift -= 8;
 	}
 
-	ipString.append(std::format(":{:d}", port));
+	ipString.append(":" + std::to_string(port));
 	return ipString;
 }
+
+bool FspHelper::isSidecarName(const std::string& name)
+{
+	for (const std::string extension : { ".fspprofile", ".fspzero", ".fspproxy" }) {
+		size_t position = name.rfind(extension);
+		if (position != std::string::npos && 0 < position && (position + extension.size() == name.size() || name[position + extension.size()] == '.')) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+std::filesystem::path FspHelper::getSidecarPath(const std::filesystem::path& servedPath, const std::string& extension)
+{
+	// Copies in the fast tier share the files of their original
+	std::filesystem::path filePath = StorageTier::getOriginalPath(servedPath);
+	if (sidecarDirectory.empty()) {
+		std::filesystem::path path = filePath;
+		path += extension;
+		return path;
+	}
+
+	// FNV-1a of the file path, stable across runs and platforms
+	uint64_t hash = 14695981039346656037ULL;
+	for (auto character : filePath.native()) {
+		hash = (hash ^ static_cast<uint64_t>(character)) * 1099511628211ULL;
+	}
+
+	std::ostringstream name;
+	name << filePath.stem().string() << "-" << std::hex << std::setw(16) << std::setfill('0') << hash << extension;
+	return sidecarDirectory / name.str();
+}
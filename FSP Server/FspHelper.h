@@ -8,12 +8,24 @@ class FspHelper
 {
 public:
 	static std::string getSubPath(std::vector<uint8_t> data, std::string& outPassword);
-	static std::filesystem::path getCompletePath(std::string subPath, std::vector<std::filesystem::file_type> fileTypes);
-	static std::unique_ptr<FspPacket> validatePassword(std::string expected, std::string actual, FspClient fspClient, uint16_t sequence);
+	// Lookups of a single regular file or directory are cached by PathCache
+	static std::filesystem::path getCompletePath(std::string subPath, const std::vector<std::filesystem::file_type>& fileTypes);
+
+	// Absolute and lexically normal, getCompletePath returns normalized paths only
+	static std::filesystem::path normalize(const std::filesystem::path& path);
+	static std::unique_ptr<FspPacket> validatePassword(std::string expected, std::string actual, const FspClient& fspClient, uint16_t sequence);
 	static uint32_t fileTimeTypeToUnix(std::filesystem::file_time_type fileTime);
 	static uint32_t ipStringToUint32(std::string ipAddress, uint16_t& port);
 	static std::string uInt32ToIpString(uint32_t ip, uint16_t port);
+
+	// Directory for files the server keeps about served files, empty stores them next to the file
+	static std::filesystem::path sidecarDirectory;
+	static std::filesystem::path getSidecarPath(const std::filesystem::path& servedPath, const std::string& extension);
+
+	// Sidecars and their temporary files, they are neither listed nor served
+	static bool isSidecarName(const std::string& name);
 private:
-	static boolean checkPath(std::filesystem::path base, std::filesystem::path actualPath, std::vector<std::filesystem::file_type> fileTypes);
+	static bool checkPath(const std::filesystem::path& base, const std::filesystem::path& actualPath, const std::vector<std::filesystem::file_type>& fileTypes);
+	static std::filesystem::path findPath(std::string subPath, const std::vector<std::filesystem::file_type>& fileTypes);
 };
 
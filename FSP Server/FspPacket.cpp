@@ -6,38 +6,46 @@
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <intrin.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include "FspDirEnt.h"
+#include "ListingCache.h"
+#include "MetadataIndex.h"
+#include "PathCache.h"
+#include "FspStats.h"
+#include "BlockCache.h"
+#include "FileHandleCache.h"
+#include "Replicas.h"
+#include "StorageTier.h"
+#include "Upstream.h"
+#ifndef _WIN32
+#include "AsyncExecutor.h"
+#include "FspTask.h"
+#endif
 #include <span>
 
-std::vector<std::vector<uint8_t>> FspPacket::directoryCache = {};
-std::filesystem::path FspPacket::lastListedPath = std::filesystem::path();
-uint16_t FspPacket::lastListedPathBlockSize;
-
-std::ifstream FspPacket::lastGetFileStream;
-std::filesystem::path FspPacket::lastGetFile;
-uint16_t FspPacket::lastGetFileBlockSize;
-
-std::ofstream FspPacket::lastUploadFileStream;
-std::filesystem::path FspPacket::lastUploadFile;
+FspPacket::FspPacket(std::vector<char> message) : FspPacket(std::move(message), Direction::TO_SERVER)
+{
+}
 
-FspPacket::FspPacket(std::vector<char> message)
+FspPacket::FspPacket(std::vector<char> message, Direction sender)
 {
-	direction = Direction::TO_SERVER;
+	direction = sender;
 
 	if (message.size() < sizeof(FspHeader)) {
 		throw std::invalid_argument("Message length is too small");
 	}
 
-	if (!validateToServerChecksum(message)) {
+	if (!validateChecksum(message)) {
 		throw std::invalid_argument("Invalid checksum encountered");
 	}
 
 	std::memcpy(&header, message.data(), sizeof(FspHeader));
-	header.KEY = _byteswap_ushort(header.KEY);
-	header.SEQUENCE = _byteswap_ushort(header.SEQUENCE);
-	header.DATA_LENGTH = _byteswap_ushort(header.DATA_LENGTH);
-	header.FILE_POSITION = _byteswap_ulong(header.FILE_POSITION);
+	header.KEY = ntohs(header.KEY);
+	header.SEQUENCE = ntohs(header.SEQUENCE);
+	header.DATA_LENGTH = ntohs(header.DATA_LENGTH);
+	header.FILE_POSITION = ntohl(header.FILE_POSITION);
 
 	if (0 < header.DATA_LENGTH) {
 		if ((message.size() - sizeof(header)) < header.DATA_LENGTH) {
@@ -58,28 +66,70 @@ FspPacket::FspPacket(FspHeader sentHeader, std::vector<uint8_t> sentData, std::v
 {
 	direction = Direction::FROM_SERVER;
 	header = sentHeader;
-	data = sentData;
-	extraData = sentExtraData;
+	data = std::move(sentData);
+	extraData = std::move(sentExtraData);
+
+	// Summed up in place instead of serializing the whole packet once more
+	FspHeader wireHeader = getWireHeader();
+	wireHeader.MESSAGE_CHECKSUM = 0;
+	uint32_t sum = sumBytes(reinterpret_cast<const char*>(&wireHeader), sizeof(wireHeader));
+	sum += sumBytes(reinterpret_cast<const char*>(data.data()), data.size());
+	sum += sumBytes(reinterpret_cast<const char*>(extraData.data()), extraData.size());
+	header.MESSAGE_CHECKSUM = finishChecksum(sum);
+}
+
+std::vector<char> FspPacket::createRequest(char command, uint16_t key, uint16_t sequence, uint32_t position, const std::vector<uint8_t>& sentData, const std::vector<uint8_t>& sentExtraData)
+{
+	FspHeader h;
+	h.FSP_COMMAND = command;
+	h.MESSAGE_CHECKSUM = 0;
+	h.KEY = htons(key);
+	h.SEQUENCE = htons(sequence);
+	h.DATA_LENGTH = htons(static_cast<uint16_t>(sentData.size()));
+	h.FILE_POSITION = htonl(position);
+
+	std::vector<char> message(sizeof(h) + sentData.size() + sentExtraData.size());
+	std::memcpy(message.data(), &h, sizeof(h));
+	std::memcpy(message.data() + sizeof(h), sentData.data(), sentData.size());
+	std::memcpy(message.data() + sizeof(h) + sentData.size(), sentExtraData.data(), sentExtraData.size());
+	message[1] = getChecksum(message.data(), message.size(), Direction::TO_SERVER);
+
+	return message;
+}
 
-	std::vector<char> rawBytes = getRawBytes();
-	header.MESSAGE_CHECKSUM = getChecksum(rawBytes);
+std::unique_ptr<FspPacket> FspPacket::parseResponse(std::vector<char> message)
+{
+	return std::unique_ptr<FspPacket>(new FspPacket(std::move(message), Direction::FROM_SERVER));
 }
 
 std::vector<char> FspPacket::getRawBytes()
+{
+	std::vector<char> rawPacket;
+	writeRawBytes(rawPacket);
+
+	return rawPacket;
+}
+
+FspPacket::FspHeader FspPacket::getWireHeader()
 {
 	FspHeader temp = header;
-	temp.KEY = _byteswap_ushort(header.KEY);
-	temp.SEQUENCE = _byteswap_ushort(header.SEQUENCE);
-	temp.DATA_LENGTH = _byteswap_ushort(header.DATA_LENGTH);
-	temp.FILE_POSITION = _byteswap_ulong(header.FILE_POSITION);
+	temp.KEY = htons(header.KEY);
+	temp.SEQUENCE = htons(header.SEQUENCE);
+	temp.DATA_LENGTH = htons(header.DATA_LENGTH);
+	temp.FILE_POSITION = htonl(header.FILE_POSITION);
 
-	int len = packetLength();
-	std::vector<char> rawPacket = std::vector<char>(len);
+	return temp;
+}
+
+void FspPacket::writeRawBytes(std::vector<char>& rawPacket)
+{
+	FspHeader temp = getWireHeader();
+
+	// Resizing keeps the capacity, a preallocated buffer is not reallocated
+	rawPacket.resize(packetLength());
 	std::memcpy(rawPacket.data(), &temp, sizeof(temp));
 	std::memcpy(rawPacket.data() + sizeof(header), data.data(), data.size());
 	std::memcpy(rawPacket.data() + sizeof(header) + data.size(), extraData.data(), extraData.size());
-
-	return rawPacket;
 }
 
 std::unique_ptr<FspPacket> FspPacket::process(FspClient& fspClient, std::string password)
@@ -88,6 +138,13 @@ std::unique_ptr<FspPacket> FspPacket::process(FspClient& fspClient, std::string
 		throw std::invalid_argument("Packet has not been received from a client");
 	}
 
+	if (Upstream::isEnabled()) {
+		auto response = forwardRequest(fspClient, password);
+		if (response != nullptr) {
+			return response;
+		}
+	}
+
 	switch (header.FSP_COMMAND)
 	{
 	case FspCommand::CC_GET_PRO:
@@ -122,22 +179,39 @@ std::unique_ptr<FspPacket> FspPacket::process(FspClient& fspClient, std::string
 
 char FspPacket::getChecksum(std::vector<char>& message)
 {
-	if (message.size() < sizeof(FspHeader)) {
+	return getChecksum(message.data(), message.size(), direction);
+}
+
+char FspPacket::getChecksum(const char* message, size_t size, Direction direction)
+{
+	if (size < sizeof(FspHeader)) {
 		return 0;
 	}
 
 	uint32_t actual = 0;
 	if (direction == Direction::TO_SERVER) {
-		actual = static_cast<uint32_t>(message.size());
+		actual = static_cast<uint32_t>(size);
 	}
 
-	for (size_t i = 0; i < message.size(); ++i) {
-		uint8_t byte = (i == 1) ? 0 : static_cast<uint8_t>(message[i]);
-		actual += byte;
+	// The checksum byte itself is not part of the sum
+	actual += sumBytes(message, size) - static_cast<uint8_t>(message[1]);
+	return finishChecksum(actual);
+}
+
+uint32_t FspPacket::sumBytes(const char* bytes, size_t size)
+{
+	uint32_t sum = 0;
+	for (size_t i = 0; i < size; ++i) {
+		sum += static_cast<uint8_t>(bytes[i]);
 	}
 
-	actual += actual >> 8;
-	return static_cast<char>(actual & 0xFF);
+	return sum;
+}
+
+char FspPacket::finishChecksum(uint32_t sum)
+{
+	sum += sum >> 8;
+	return static_cast<char>(sum & 0xFF);
 }
 
 int FspPacket::packetLength()
@@ -145,7 +219,7 @@ int FspPacket::packetLength()
 	return (sizeof(header) + data.size() + extraData.size());
 }
 
-bool FspPacket::validateToServerChecksum(std::vector<char>& message)
+bool FspPacket::validateChecksum(std::vector<char>& message)
 {
 	char expected = getChecksum(message);
 	char actual = message[1];
@@ -153,6 +227,68 @@ bool FspPacket::validateToServerChecksum(std::vector<char>& message)
 	return actual == expected;
 }
 
+uint16_t FspPacket::getPreferredBlockSize()
+{
+	uint16_t blockSize = 1024;
+	if (extraData.size() == 2) {
+		uint16_t preferredBlockSize = extraData[1];
+		preferredBlockSize += extraData[0] << 8;
+		if (0 < preferredBlockSize) {
+			blockSize = preferredBlockSize;
+		}
+	}
+
+	return blockSize;
+}
+
+
+
+std::unique_ptr<FspPacket> FspPacket::forwardRequest(FspClient& fspClient, std::string password)
+{
+	std::string givenPassword;
+	std::string subPath = FspHelper::getSubPath(data, givenPassword);
+
+	switch (header.FSP_COMMAND)
+	{
+	case FspCommand::CC_GET_DIR:
+	case FspCommand::CC_STAT:
+	case FspCommand::CC_GET_FILE:
+		break;
+	case FspCommand::CC_UP_LOAD:
+	case FspCommand::CC_INSTALL:
+	case FspCommand::CC_DEL_FILE:
+	case FspCommand::CC_DEL_DIR:
+	case FspCommand::CC_MAKE_DIR:
+	case FspCommand::CC_RENAME:
+		return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, "Proxy is read-only");
+	default:
+		return nullptr;
+	}
+
+	auto error = FspHelper::validatePassword(password, givenPassword, fspClient, header.SEQUENCE);
+	if (error != nullptr) {
+		return error;
+	}
+
+	FspHeader h;
+	h.FSP_COMMAND = header.FSP_COMMAND;
+	h.MESSAGE_CHECKSUM = 0;
+	h.KEY = fspClient.key;
+	h.SEQUENCE = header.SEQUENCE;
+	h.FILE_POSITION = header.FSP_COMMAND == FspCommand::CC_STAT ? 0 : header.FILE_POSITION;
+
+	std::vector<uint8_t> sentData;
+	std::string upstreamError;
+	bool success = header.FSP_COMMAND == FspCommand::CC_GET_FILE
+		? Upstream::read(subPath, header.FILE_POSITION, getPreferredBlockSize(), sentData, upstreamError)
+		: Upstream::getMetadata(header.FSP_COMMAND, subPath, header.FILE_POSITION, getPreferredBlockSize(), sentData, upstreamError);
+	if (!success) {
+		return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, upstreamError);
+	}
+
+	h.DATA_LENGTH = static_cast<uint16_t>(sentData.size());
+	return std::make_unique<FspPacket>(h, sentData, std::vector<uint8_t>{});
+}
 
 std::unique_ptr<FspPacket> FspPacket::getDirectoryProtection(FspClient& fspClient)
 {
@@ -180,14 +316,7 @@ std::unique_ptr<FspPacket> FspPacket::getDirectory(FspClient& fspClient, std::st
 		return error;
 	}
 
-	uint16_t blockSize = 1024;
-	if (extraData.size() == 2) {
-		uint16_t preferredBlockSize = extraData[1];
-		preferredBlockSize += extraData[0] << 8;
-		if (0 < preferredBlockSize) {
-			blockSize = preferredBlockSize;
-		}
-	}
+	uint16_t blockSize = getPreferredBlockSize();
 
 	FspHeader h;
 	h.FSP_COMMAND = header.FSP_COMMAND;
@@ -206,74 +335,14 @@ std::unique_ptr<FspPacket> FspPacket::getDirectory(FspClient& fspClient, std::st
 		return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, "Bad path");
 	}
 
-	if (lastListedPath != path || lastListedPathBlockSize != blockSize) {
-		lastListedPathBlockSize = blockSize;
-		lastListedPath = path;
-		directoryCache.clear();
-
-		std::vector<uint8_t> data = {};
-		std::vector<FspDirEnt> entries;
-		for (const auto& entry : std::filesystem::directory_iterator(path)) {
-			entries.push_back(FspDirEnt(entry));
-		}
-
-		for (int i = 0; i < entries.size(); i++) {
-			try
-			{
-				std::vector<uint8_t> bytes = entries[i].getRawBytes();
-				if (blockSize < data.size() + bytes.size()) {
-					if (FspDirEnt::HEADER_SIZE <= blockSize - data.size()) {
-						FspDirEnt skip = FspDirEnt::getSkipEntry(blockSize - data.size() - FspDirEnt::HEADER_SIZE);
-						std::vector<uint8_t> skipBytes = skip.getRawBytes(false);
-						data.insert(data.end(), skipBytes.begin(), skipBytes.end());
-					}
-					else if (i < entries.size() - 1) {
-						data.resize(blockSize, 0);
-					}
-
-					directoryCache.push_back(data);
-					data.clear();
-				}
-
-				// Simply skip the file if the preffered block size is too small
-				if (data.size() + bytes.size() <= blockSize)
-				{
-					data.insert(data.end(), bytes.begin(), bytes.end());
-				}
-			}
-			catch (const std::exception&)
-			{
-				continue;
-			}
-		}
-
-		if (data.size() + FspDirEnt::HEADER_SIZE <= blockSize) {
-			FspDirEnt end = FspDirEnt::getEndEntry(0);
-			std::vector<uint8_t> endBytes = end.getRawBytes();
-			data.insert(data.end(), endBytes.begin(), endBytes.end());
-		}
-		else
-		{
-			data.resize(blockSize, 0x0);
-			directoryCache.push_back(data);
-			data.clear();
-
-			FspDirEnt end = FspDirEnt::getEndEntry(0);
-			std::vector<uint8_t> endBytes = end.getRawBytes();
-			data.insert(data.end(), endBytes.begin(), endBytes.end());
-		}
-
-		directoryCache.push_back(data);
-	}
-
-	uint16_t key = std::floor(header.FILE_POSITION / blockSize);
-	if (directoryCache.size() - 1 < key) {
+	std::vector<uint8_t> block;
+	if (!ListingCache::getBlock(path, blockSize, header.FILE_POSITION / blockSize, block)) {
 		h.DATA_LENGTH = 0;
 		return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
 	}
 
-	h.DATA_LENGTH = directoryCache[key].size();
-	return std::make_unique<FspPacket>(h, directoryCache[key], std::vector<uint8_t>{});
+	h.DATA_LENGTH = block.size();
+	return std::make_unique<FspPacket>(h, std::move(block), std::vector<uint8_t>{});
 }
 
 std::unique_ptr<FspPacket> FspPacket::fileStat(FspClient& fspClient, std::string password)
@@ -292,6 +361,16 @@ std::unique_ptr<FspPacket> FspPacket::fileStat(FspClient& fspClient, std::string
 	h.FILE_POSITION = 0;
 	h.DATA_LENGTH = FspDirEnt::HEADER_SIZE;
 
+	std::vector<uint8_t> cached;
+	if (MetadataIndex::stat(subPath, cached)) {
+		return std::make_unique<FspPacket>(h, std::move(cached), std::vector<uint8_t>{});
+	}
+
+	std::string key = PathCache::getKey(subPath, std::filesystem::file_type::regular);
+	if (PathCache::findStat(key, cached)) {
+		return std::make_unique<FspPacket>(h, std::move(cached), std::vector<uint8_t>{});
+	}
+
 	std::filesystem::path path;
 	try
 	{
@@ -305,8 +384,10 @@ std::unique_ptr<FspPacket> FspPacket::fileStat(FspClient& fspClient, std::string
 
 	std::filesystem::directory_entry e(path);
 	FspDirEnt fspDirEnt(e);
+	std::vector<uint8_t> response = fspDirEnt.getRawBytes(false);
+	PathCache::insertStat(key, response);
 
-	return std::make_unique<FspPacket>(h, fspDirEnt.getRawBytes(false), std::vector<uint8_t>{});
+	return std::make_unique<FspPacket>(h, std::move(response), std::vector<uint8_t>{});
 }
 
 std::unique_ptr<FspPacket> FspPacket::deleteDirectory(FspClient& fspClient, std::string password) {
@@ -333,13 +414,10 @@ std::unique_ptr<FspPacket> FspPacket::deleteDirectory(FspClient& fspClient, std:
 		if (std::filesystem::is_directory(path)) {
 			if (!std::filesystem::remove_all(path))
 			{
-				throw std::exception("Directory could not be deleted");
+				throw std::runtime_error("Directory could not be deleted");
 			}
 
-			if (std::filesystem::is_directory(lastListedPath) && std::filesystem::equivalent(path, lastListedPath))
-			{
-				lastListedPath = std::filesystem::path();
-			}
+			invalidatePath(path, false);
 		}
 	}
 	catch (const std::exception&)
@@ -380,14 +458,10 @@ std::unique_ptr<FspPacket> FspPacket::deleteFile(FspClient& fspClient, std::stri
 		if (std::filesystem::is_regular_file(path)) {
 			if (!std::filesystem::remove(path))
 			{
-				throw std::exception("File could not be deleted");
+				throw std::runtime_error("File could not be deleted");
 			}
 
-			auto pathWithoutName = path.parent_path();
-			if (std::filesystem::is_directory(lastListedPath) && std::filesystem::equivalent(pathWithoutName, lastListedPath))
-			{
-				lastListedPath = std::filesystem::path();
-			}
+			invalidatePath(path, true);
 		}
 	}
 	catch (const std::exception&)
@@ -414,14 +488,7 @@ std::unique_ptr<FspPacket> FspPacket::getFile(FspClient& fspClient, std::string
 		return error;
 	}
 
-	uint16_t blockSize = 1024;
-	if (extraData.size() == 2) {
-		uint16_t preferredBlockSize = extraData[1];
-		preferredBlockSize += extraData[0] << 8;
-		if (0 < preferredBlockSize) {
-			blockSize = preferredBlockSize;
-		}
-	}
+	uint16_t blockSize = getPreferredBlockSize();
 
 	FspHeader h;
 	h.FSP_COMMAND = header.FSP_COMMAND;
@@ -441,28 +508,31 @@ std::unique_ptr<FspPacket> FspPacket::getFile(FspClient& fspClient, std::string
 		return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
 	}
 
-	if (lastGetFile != path || lastGetFileBlockSize != blockSize || !lastGetFileStream.is_open() || !lastGetFileStream.good()) {
-		if (lastGetFileStream.is_open()) {
-			lastGetFileStream.close();
-		}
+	std::shared_ptr<FileHandle> file = fspClient.openReadFile(path);
+	if (file == nullptr) {
+		h.DATA_LENGTH = 0;
+		return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
+	}
 
-		lastGetFile = path;
-		lastGetFileBlockSize = blockSize;
-		lastGetFileStream = std::ifstream(path, std::ios::binary);
-		if (!lastGetFileStream.good()) {
-			h.DATA_LENGTH = 0;
-			return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
-		}
+	uint32_t length = h.FILE_POSITION < file->size ? static_cast<uint32_t>(std::min<uint64_t>(blockSize, file->size - h.FILE_POSITION)) : 0;
+	fspClient.readahead.access(*file, h.FILE_POSITION, length);
+	fspClient.bootProfile.access(subPath, *file, h.FILE_POSITION, length);
+	fspClient.storageTier.access(*file, length);
+	std::vector<uint8_t> bytes(length);
+	int64_t result;
+	if (file->zeros.contains(h.FILE_POSITION, length)) {
+		// The buffer is already zeroed
+		result = length;
+		FspStats::zeroBlocks.fetch_add(1, std::memory_order_relaxed);
+	}
+	else
+	{
+		result = BlockCache::isEnabled() ? BlockCache::read(*file, reinterpret_cast<char*>(bytes.data()), length, h.FILE_POSITION) : file->read(bytes.data(), length, h.FILE_POSITION);
 	}
 
-	lastGetFileStream.seekg(0, std::ios::end);
-	auto fileSize = lastGetFileStream.tellg();
-	h.DATA_LENGTH = h.FILE_POSITION + blockSize < fileSize ? blockSize : ((uint64_t)fileSize - h.FILE_POSITION);
-	std::vector<uint8_t> bytes;
-	bytes.resize(h.DATA_LENGTH);
-	lastGetFileStream.seekg(h.FILE_POSITION);
-	lastGetFileStream.read((char*)bytes.data(), h.DATA_LENGTH);
-	return std::make_unique<FspPacket>(h, bytes, std::vector<uint8_t>{});
+	bytes.resize(result < 0 ? 0 : static_cast<size_t>(result));
+	h.DATA_LENGTH = static_cast<uint16_t>(bytes.size());
+	return std::make_unique<FspPacket>(h, std::move(bytes), std::vector<uint8_t>{});
 }
 
 std::unique_ptr<FspPacket> FspPacket::completeUploadFile(FspClient& fspClient, std::string password) {
@@ -481,7 +551,7 @@ std::unique_ptr<FspPacket> FspPacket::completeUploadFile(FspClient& fspClient, s
 	h.MESSAGE_CHECKSUM = 0;
 
 	std::filesystem::path sourcePath = fspClient.getTempFilePath();
-	lastUploadFileStream.close();
+	fspClient.closeUploadFile();
 	if (data.size() == 0) {
 		try
 		{
@@ -512,8 +582,11 @@ std::unique_ptr<FspPacket> FspPacket::completeUploadFile(FspClient& fspClient, s
 		std::filesystem::path directory = targetPath;
 		directory.remove_filename();
 
+		// Missing directories are created along with the file
+		std::filesystem::path existingParent = getExistingParent(targetPath);
 		std::filesystem::create_directories(directory);
 		std::filesystem::rename(sourcePath, targetPath);
+		invalidatePath(targetPath, true, existingParent);
 	}
 	catch (const std::exception&)
 	{
@@ -526,22 +599,23 @@ std::unique_ptr<FspPacket> FspPacket::completeUploadFile(FspClient& fspClient, s
 std::unique_ptr<FspPacket> FspPacket::uploadFile(FspClient& fspClient, std::string password) {
 	std::filesystem::path path = fspClient.getTempFilePath();
 
-	if (lastUploadFile != path || !lastUploadFileStream.is_open() || !lastUploadFileStream.good()) {
-		if (lastUploadFileStream.is_open()) {
-			lastUploadFileStream.close();
+	std::ofstream& uploadStream = fspClient.uploadFileStream;
+	if (fspClient.uploadFilePath != path || !uploadStream.is_open() || !uploadStream.good()) {
+		if (uploadStream.is_open()) {
+			uploadStream.close();
 		}
 
-		lastUploadFile = path;
-		lastUploadFileStream = std::ofstream(path, std::ios::binary);
-		if (!lastUploadFileStream.good()) {
+		fspClient.uploadFilePath = path;
+		uploadStream = std::ofstream(path, std::ios::binary);
+		if (!uploadStream.good()) {
 			return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, "Upload failed");
 		}
 	}
 
 	try
 	{
-		lastUploadFileStream.seekp(header.FILE_POSITION);
-		lastUploadFileStream.write((char*)data.data(), data.size());
+		uploadStream.seekp(header.FILE_POSITION);
+		uploadStream.write((char*)data.data(), data.size());
 	}
 	catch (const std::exception&) {
 		return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, "Upload failed");
@@ -568,6 +642,8 @@ std::unique_ptr<FspPacket> FspPacket::rename(FspClient& fspClient, std::string p
 		path = FspHelper::getCompletePath(subPath, { std::filesystem::file_type::directory, std::filesystem::file_type::regular });
 		renamePath = FspHelper::getCompletePath(renameSubPath, { std::filesystem::file_type::not_found, std::filesystem::file_type::directory });
 
+		// Missing parent directories of the target are created as well
+		std::filesystem::path existingParent = getExistingParent(renamePath);
 		if (std::filesystem::is_directory(path)) {
 			std::filesystem::create_directories(renamePath.parent_path());
 		}
@@ -575,13 +651,11 @@ std::unique_ptr<FspPacket> FspPacket::rename(FspClient& fspClient, std::string p
 		{
 			auto pathWithoutName = renamePath.parent_path();
 			std::filesystem::create_directories(pathWithoutName);
-			if (std::filesystem::is_directory(lastListedPath) && std::filesystem::equivalent(pathWithoutName, lastListedPath))
-			{
-				lastListedPath = std::filesystem::path();
-			}
 		}
 
 		std::filesystem::rename(path, renamePath);
+		invalidatePath(path, false);
+		invalidatePath(renamePath, false, existingParent);
 	}
 	catch (const std::exception&) {}
 
@@ -600,7 +674,11 @@ std::unique_ptr<FspPacket> FspPacket::makeDirectory(FspClient& fspClient, std::s
 	try
 	{
 		path = FspHelper::getCompletePath(subPath, { std::filesystem::file_type::not_found , std::filesystem::file_type::directory });
+
+		// Missing parent directories are created as well
+		std::filesystem::path existingParent = getExistingParent(path);
 		std::filesystem::create_directories(path);
+		invalidatePath(path, false, existingParent);
 	}
 	catch (const std::exception&)
 	{
@@ -621,6 +699,35 @@ std::unique_ptr<FspPacket> FspPacket::makeDirectory(FspClient& fspClient, std::s
 	return std::make_unique<FspPacket>(h, sentData, sentExtraData);
 }
 
+void FspPacket::invalidatePath(const std::filesystem::path& path, bool parentOnly, const std::filesystem::path& existingParent)
+{
+	FileHandleCache::invalidate(path);
+	PathCache::invalidate(path);
+	StorageTier::invalidate(path);
+	Replicas::invalidate(path);
+	MetadataIndex::update(path);
+	ListingCache::invalidate(path.parent_path());
+	if (!parentOnly) {
+		ListingCache::invalidate(path);
+	}
+
+	// Directories created along with path had no listing yet, only the one of the topmost one's parent changed
+	if (!existingParent.empty() && existingParent != path.parent_path()) {
+		ListingCache::invalidate(existingParent);
+	}
+}
+
+std::filesystem::path FspPacket::getExistingParent(const std::filesystem::path& path)
+{
+	std::error_code error;
+	std::filesystem::path parent = path.parent_path();
+	while (!parent.empty() && !std::filesystem::exists(parent, error) && parent != parent.parent_path()) {
+		parent = parent.parent_path();
+	}
+
+	return parent;
+}
+
 std::unique_ptr<FspPacket> FspPacket::closeSession(FspClient& fspClient, std::string password) {
 	fspClient.deleted = true;
 	FspHeader h = header;
@@ -631,7 +738,7 @@ std::unique_ptr<FspPacket> FspPacket::closeSession(FspClient& fspClient, std::st
 	return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
 }
 
-std::unique_ptr<FspPacket> FspPacket::createErrorPacket(FspClient fspClient, uint16_t sequence, std::string data, uint16_t errorCode)
+std::unique_ptr<FspPacket> FspPacket::createErrorPacket(const FspClient& fspClient, uint16_t sequence, std::string data, uint16_t errorCode)
 {
 	std::vector<uint8_t> sentData(data.begin(), data.end());
 	sentData.push_back(0x0);
@@ -648,4 +755,233 @@ std::unique_ptr<FspPacket> FspPacket::createErrorPacket(FspClient fspClient, uin
 	h.FILE_POSITION = sentExtraData.size();
 
 	return std::make_unique<FspPacket>(h, sentData, sentExtraData);
-}
\ No newline at end of file
+}
+
+#ifndef _WIN32
+FspTask FspPacket::processAsync(std::unique_ptr<FspPacket> request, FspClient& fspClient, std::string password, AsyncExecutor& executor)
+{
+	if (request->direction == Direction::FROM_SERVER) {
+		throw std::invalid_argument("Packet has not been received from a client");
+	}
+
+	// Proxied requests wait for the upstream server, they are kept off the socket thread
+	if (Upstream::isEnabled()) {
+		co_return co_await executor.runAsync([&]() { return request->process(fspClient, password); });
+	}
+
+	switch (request->header.FSP_COMMAND)
+	{
+	case FspCommand::CC_GET_FILE:
+		co_return co_await request->getFileAsync(fspClient, password, executor);
+	case FspCommand::CC_UP_LOAD:
+		co_return co_await request->uploadFileAsync(fspClient, password, executor);
+	case FspCommand::CC_GET_DIR:
+	case FspCommand::CC_STAT:
+	case FspCommand::CC_RENAME:
+	case FspCommand::CC_MAKE_DIR:
+	case FspCommand::CC_INSTALL:
+	case FspCommand::CC_DEL_FILE:
+	case FspCommand::CC_DEL_DIR:
+		// Directory scans, stats and renames block on the disk, keep them off the socket thread
+		co_return co_await executor.runAsync([&]() { return request->process(fspClient, password); });
+	default:
+		co_return request->process(fspClient, password);
+	}
+}
+
+FspTask FspPacket::getFileAsync(FspClient& fspClient, std::string password, AsyncExecutor& executor)
+{
+	std::string givenPassword;
+	std::string subPath = FspHelper::getSubPath(data, givenPassword);
+
+	auto error = FspHelper::validatePassword(password, givenPassword, fspClient, header.SEQUENCE);
+	if (error != nullptr) {
+		co_return error;
+	}
+
+	uint16_t blockSize = getPreferredBlockSize();
+
+	FspHeader h;
+	h.FSP_COMMAND = header.FSP_COMMAND;
+	h.MESSAGE_CHECKSUM = 0;
+	h.KEY = fspClient.key;
+	h.SEQUENCE = header.SEQUENCE;
+	h.FILE_POSITION = header.FILE_POSITION;
+	h.DATA_LENGTH = 0;
+
+	std::filesystem::path path;
+	try
+	{
+		path = FspHelper::getCompletePath(subPath, { std::filesystem::file_type::regular });
+	}
+	catch (const std::exception&)
+	{
+		co_return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
+	}
+
+	// Held until the read completes, the cache may evict the handle in the meantime
+	std::shared_ptr<FileHandle> file = fspClient.openReadFile(path);
+	if (file == nullptr) {
+		co_return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
+	}
+
+	uint32_t length = h.FILE_POSITION < file->size ? static_cast<uint32_t>(std::min<uint64_t>(blockSize, file->size - h.FILE_POSITION)) : 0;
+	fspClient.readahead.access(*file, h.FILE_POSITION, length);
+	fspClient.bootProfile.access(subPath, *file, h.FILE_POSITION, length);
+	fspClient.storageTier.access(*file, length);
+	if (length == 0) {
+		// Reads at or past the end of the file, the block range below would be empty
+		co_return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
+	}
+
+	std::vector<uint8_t> bytes(length);
+	int result;
+	if (file->zeros.contains(h.FILE_POSITION, length)) {
+		result = static_cast<int>(length);
+		FspStats::zeroBlocks.fetch_add(1, std::memory_order_relaxed);
+	}
+	else if (file->isCompressed()) {
+		// Compressed blocks are read and decoded on the helper threads
+		result = co_await executor.runAsync([&]() {
+			return static_cast<int>(BlockCache::isEnabled() ? BlockCache::read(*file, reinterpret_cast<char*>(bytes.data()), length, h.FILE_POSITION) : file->read(bytes.data(), length, h.FILE_POSITION));
+		});
+	}
+	else if (!BlockCache::isEnabled()) {
+		result = co_await executor.readAsync(file->getDescriptor(), bytes.data(), length, h.FILE_POSITION);
+	}
+	else if (BlockCache::lookup(*file, reinterpret_cast<char*>(bytes.data()), length, h.FILE_POSITION)) {
+		result = static_cast<int>(length);
+	}
+	else
+	{
+		// The whole blocks around the range are read and cached
+		uint64_t start = h.FILE_POSITION - h.FILE_POSITION % BlockCache::BLOCK_SIZE;
+		uint64_t end = std::min<uint64_t>(file->size, (h.FILE_POSITION + length + BlockCache::BLOCK_SIZE - 1) / BlockCache::BLOCK_SIZE * BlockCache::BLOCK_SIZE);
+		std::vector<char> blocks(static_cast<size_t>(end - start));
+		result = co_await executor.readAsync(file->getDescriptor(), blocks.data(), static_cast<uint32_t>(blocks.size()), start);
+
+		if (0 <= result) {
+			for (size_t offset = 0; offset < static_cast<size_t>(result); offset += BlockCache::BLOCK_SIZE) {
+				BlockCache::insert(*file, start + offset, blocks.data() + offset, std::min<size_t>(BlockCache::BLOCK_SIZE, result - offset));
+			}
+
+			size_t skipped = static_cast<size_t>(h.FILE_POSITION - start);
+			result = static_cast<size_t>(result) <= skipped ? 0 : static_cast<int>(std::min<size_t>(length, result - skipped));
+			std::memcpy(bytes.data(), blocks.data() + skipped, std::max(result, 0));
+		}
+	}
+
+	bytes.resize(result < 0 ? 0 : result);
+	h.DATA_LENGTH = static_cast<uint16_t>(bytes.size());
+	co_return std::make_unique<FspPacket>(h, bytes, std::vector<uint8_t>{});
+}
+
+FspTask FspPacket::uploadFileAsync(FspClient& fspClient, std::string password, AsyncExecutor& executor)
+{
+	if (!fspClient.openUploadDescriptor()) {
+		co_return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, "Upload failed");
+	}
+
+	int result = co_await executor.writeAsync(fspClient.uploadDescriptor, data.data(), static_cast<uint32_t>(data.size()), header.FILE_POSITION);
+	if (result < 0 || static_cast<size_t>(result) < data.size()) {
+		co_return FspPacket::createErrorPacket(fspClient, header.SEQUENCE, "Upload failed");
+	}
+
+	FspHeader h = header;
+	h.KEY = fspClient.key;
+	h.MESSAGE_CHECKSUM = 0;
+	h.DATA_LENGTH = 0;
+
+	co_return std::make_unique<FspPacket>(h, std::vector<uint8_t>{}, std::vector<uint8_t>{});
+}
+bool FspPacket::writeFileResponse(FspClient& fspClient, const std::string& password, std::vector<char>& rawPacket, FileSlice& payload)
+{
+	payload = {};
+	if (direction != Direction::TO_SERVER || header.FSP_COMMAND != FspCommand::CC_GET_FILE || Upstream::isEnabled()) {
+		return false;
+	}
+
+	std::string givenPassword;
+	std::string subPath = FspHelper::getSubPath(data, givenPassword);
+	if (FspHelper::validatePassword(password, givenPassword, fspClient, header.SEQUENCE) != nullptr) {
+		return false;
+	}
+
+	// Resolving the path costs several system calls, it is only repeated once the file has been invalidated
+	if (fspClient.readHandle == nullptr || !fspClient.readHandle->isValid() || fspClient.readSubPath != subPath) {
+		try
+		{
+			fspClient.readPath = FspHelper::getCompletePath(subPath, { std::filesystem::file_type::regular });
+			if (fspClient.openReadFile(fspClient.readPath) == nullptr) {
+				return false;
+			}
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+
+		fspClient.readSubPath = subPath;
+	}
+	else if (Replicas::isEnabled() && fspClient.openReadFile(fspClient.readPath) == nullptr)
+	{
+		// The replica is chosen again by the current load, see ReplicaRoute::REBALANCE_INTERVAL
+		return false;
+	}
+
+	const FileHandle& file = *fspClient.readHandle;
+	uint16_t blockSize = getPreferredBlockSize();
+	size_t length = header.FILE_POSITION < file.size ? static_cast<size_t>(std::min<uint64_t>(blockSize, file.size - header.FILE_POSITION)) : 0;
+	fspClient.readahead.access(file, header.FILE_POSITION, length);
+	fspClient.bootProfile.access(subPath, file, header.FILE_POSITION, length);
+	fspClient.storageTier.access(file, length);
+
+	FspHeader h;
+	h.FSP_COMMAND = header.FSP_COMMAND;
+	h.MESSAGE_CHECKSUM = 0;
+	h.KEY = htons(fspClient.key);
+	h.SEQUENCE = htons(header.SEQUENCE);
+	h.FILE_POSITION = htonl(header.FILE_POSITION);
+
+	bool zeros = file.zeros.contains(header.FILE_POSITION, length);
+	if (zeros || (!BlockCache::isEnabled() && file.getMapping() != nullptr)) {
+		// The data is sent straight from the zero page or the mapping, only the header is written
+		if (zeros) {
+			payload.data = ZeroMap::zeroPage;
+			FspStats::zeroBlocks.fetch_add(1, std::memory_order_relaxed);
+		}
+		else
+		{
+			payload.file = fspClient.readHandle;
+			payload.data = file.getMapping() + header.FILE_POSITION;
+		}
+
+		// A file truncated in place faults the mapping, the request is served by process() from the reopened file
+		uint32_t payloadSum = 0;
+		if (!zeros && !fspClient.readHandle->sumMapping(header.FILE_POSITION, length, sumBytes, payloadSum)) {
+			payload = {};
+			return false;
+		}
+
+		payload.length = length;
+		h.DATA_LENGTH = htons(static_cast<uint16_t>(length));
+		rawPacket.resize(sizeof(FspHeader));
+		std::memcpy(rawPacket.data(), &h, sizeof(h));
+		rawPacket[1] = finishChecksum(sumBytes(rawPacket.data(), rawPacket.size()) + payloadSum);
+		return true;
+	}
+
+	rawPacket.resize(sizeof(FspHeader) + length);
+	int64_t result = BlockCache::isEnabled() ? BlockCache::read(file, rawPacket.data() + sizeof(FspHeader), length, header.FILE_POSITION) : file.read(rawPacket.data() + sizeof(FspHeader), length, header.FILE_POSITION);
+	if (result < 0) {
+		return false;
+	}
+
+	rawPacket.resize(sizeof(FspHeader) + result);
+	h.DATA_LENGTH = htons(static_cast<uint16_t>(result));
+	std::memcpy(rawPacket.data(), &h, sizeof(h));
+	rawPacket[1] = getChecksum(rawPacket.data(), rawPacket.size(), Direction::FROM_SERVER);
+
+	return true;
+}
+#endif
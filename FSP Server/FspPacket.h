@@ -2,8 +2,14 @@
 #include <vector>
 #include "FspClient.h"
 #include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
 #include <vector>
 
+class FspTask;
+class AsyncExecutor;
+
 class FspPacket
 {
 	struct FspHeader {
@@ -51,27 +57,42 @@ class FspPacket
 	};
 
 public:
-	static std::unique_ptr<FspPacket> createErrorPacket(FspClient fspClient, uint16_t sequence, std::string data, uint16_t errorCode = 0);
+	static std::unique_ptr<FspPacket> createErrorPacket(const FspClient& fspClient, uint16_t sequence, std::string data, uint16_t errorCode = 0);
+#ifndef _WIN32
+	static FspTask processAsync(std::unique_ptr<FspPacket> request, FspClient& fspClient, std::string password, AsyncExecutor& executor);
+#endif
 
 	FspPacket(std::vector<char> message);
+
+	// Request and response of the session with an upstream server (proxy mode)
+	static std::vector<char> createRequest(char command, uint16_t key, uint16_t sequence, uint32_t position, const std::vector<uint8_t>& sentData, const std::vector<uint8_t>& sentExtraData);
+	static std::unique_ptr<FspPacket> parseResponse(std::vector<char> message);
+
 	FspPacket(FspHeader sentHeader, std::vector<uint8_t> sentData, std::vector<uint8_t> sentExtraData);
 	std::vector<char> getRawBytes();
+	void writeRawBytes(std::vector<char>& rawPacket);
 	std::unique_ptr<FspPacket> process(FspClient& fspClient, std::string password);
 	char getChecksum(std::vector<char>& message);
 	int packetLength();
+#ifndef _WIN32
+	// Writes the CC_GET_FILE response header to rawPacket, whose capacity is reused across requests.
+	// The data is referenced in payload if the file is memory mapped and appended to rawPacket otherwise.
+	// Returns false if the request has to take the regular process() path.
+	bool writeFileResponse(FspClient& fspClient, const std::string& password, std::vector<char>& rawPacket, FileSlice& payload);
+#endif
 
 	FspHeader header;
 	std::vector<uint8_t> data;
 	std::vector<uint8_t> extraData;
 
-	// Cache data for uploadFile()
-	static std::ofstream lastUploadFileStream;
-	static std::filesystem::path lastUploadFile;
-
 private:
 	Direction direction;
 
-	bool validateToServerChecksum(std::vector<char>& message);
+	FspPacket(std::vector<char> message, Direction sender);
+	std::unique_ptr<FspPacket> forwardRequest(FspClient& fspClient, std::string password);
+
+	bool validateChecksum(std::vector<char>& message);
+	uint16_t getPreferredBlockSize();
 	std::unique_ptr<FspPacket> getDirectoryProtection(FspClient& fspClient);
 	std::unique_ptr<FspPacket> getDirectory(FspClient& fspClient, std::string password);
 	std::unique_ptr<FspPacket> fileStat(FspClient& fspClient, std::string password);
@@ -83,14 +104,22 @@ private:
 	std::unique_ptr<FspPacket> deleteFile(FspClient& fspClient, std::string password);
 	std::unique_ptr<FspPacket> deleteDirectory(FspClient& fspClient, std::string password);
 	std::unique_ptr<FspPacket> closeSession(FspClient& fspClient, std::string password);
+#ifndef _WIN32
+	FspTask getFileAsync(FspClient& fspClient, std::string password, AsyncExecutor& executor);
+	FspTask uploadFileAsync(FspClient& fspClient, std::string password, AsyncExecutor& executor);
+#endif
+
+	FspHeader getWireHeader();
+
+	// Drops everything cached about path after a command changed it, including the listing of its parent.
+	// The listing of path itself is kept if parentOnly is set, e.g. because path is a file. existingParent
+	// is getExistingParent(path) from before the command if it may have created missing parent directories.
+	static void invalidatePath(const std::filesystem::path& path, bool parentOnly, const std::filesystem::path& existingParent = {});
 
-	// Cache data for getDirectory()
-	static uint16_t lastListedPathBlockSize;
-	static std::filesystem::path lastListedPath;
-	static std::vector<std::vector<uint8_t>> directoryCache;
+	// Nearest directory above path that exists, its listing changes once the missing ones are created
+	static std::filesystem::path getExistingParent(const std::filesystem::path& path);
 
-	// Cache data for getFile()
-	static uint16_t lastGetFileBlockSize;
-	static std::filesystem::path lastGetFile;
-	static std::ifstream lastGetFileStream;
+	static char getChecksum(const char* message, size_t size, Direction direction);
+	static uint32_t sumBytes(const char* bytes, size_t size);
+	static char finishChecksum(uint32_t sum);
 };
\ No newline at end of file
@@ -0,0 +1,89 @@
+#include "FspStats.h"
+#include "UdpSocket.h"
+#include <iostream>
+
+std::atomic<uint64_t> FspStats::receivedPackets = 0;
+std::atomic<uint64_t> FspStats::receiveCalls = 0;
+std::atomic<uint64_t> FspStats::sentPackets = 0;
+std::atomic<uint64_t> FspStats::sendCalls = 0;
+std::atomic<uint64_t> FspStats::xdpReceivedPackets = 0;
+std::atomic<uint64_t> FspStats::xdpSentPackets = 0;
+std::atomic<uint64_t> FspStats::readaheadHits = 0;
+std::atomic<uint64_t> FspStats::readaheadMisses = 0;
+std::atomic<uint64_t> FspStats::readaheadCalls = 0;
+std::atomic<uint64_t> FspStats::readaheadBytes = 0;
+std::atomic<uint64_t> FspStats::blockCacheHits = 0;
+std::atomic<uint64_t> FspStats::blockCacheMisses = 0;
+std::atomic<uint64_t> FspStats::blockCacheEvictions = 0;
+std::atomic<uint64_t> FspStats::blockCacheLogicalBytes = 0;
+std::atomic<uint64_t> FspStats::blockCachePhysicalBytes = 0;
+std::atomic<uint64_t> FspStats::zeroBlocks = 0;
+std::atomic<uint64_t> FspStats::tierPromotions = 0;
+std::atomic<uint64_t> FspStats::tierDemotions = 0;
+uint16_t FspStats::interval = 0;
+std::chrono::steady_clock::time_point FspStats::lastPrint = std::chrono::steady_clock::now();
+
+bool FspStats::isDue()
+{
+	if (interval == 0) {
+		return false;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - lastPrint < std::chrono::seconds(interval)) {
+		return false;
+	}
+
+	lastPrint = now;
+	return true;
+}
+
+void FspStats::print()
+{
+	uint64_t received = receivedPackets.load();
+	uint64_t receives = receiveCalls.load();
+	uint64_t sent = sentPackets.load();
+	uint64_t sends = sendCalls.load();
+
+	std::cout << "Stats: batch size " << UdpSocket::batchSize
+		<< ", received " << received << " packets in " << receives << " calls"
+		<< " (avg " << (receives == 0 ? 0.0 : (double)received / receives) << ")"
+		<< ", sent " << sent << " packets in " << sends << " calls"
+		<< " (avg " << (sends == 0 ? 0.0 : (double)sent / sends) << ")";
+
+	uint64_t xdpReceived = xdpReceivedPackets.load();
+	if (0 < xdpReceived) {
+		std::cout << ", xdp received " << xdpReceived << " packets, sent " << xdpSentPackets.load() << " from the ring";
+	}
+
+	uint64_t hits = readaheadHits.load();
+	uint64_t blocks = hits + readaheadMisses.load();
+	if (0 < blocks) {
+		uint64_t windows = readaheadCalls.load();
+		std::cout << ", readahead hit rate " << 100.0 * hits / blocks << "%"
+			<< ", avg window " << (windows == 0 ? 0 : readaheadBytes.load() / windows / 1024) << " KiB";
+	}
+
+	uint64_t cacheHits = blockCacheHits.load();
+	uint64_t cacheMisses = blockCacheMisses.load();
+	if (0 < cacheHits + cacheMisses) {
+		std::cout << ", block cache " << cacheHits << " hits, " << cacheMisses << " misses, " << blockCacheEvictions.load() << " evictions";
+
+		uint64_t physicalBytes = blockCachePhysicalBytes.load();
+		if (0 < physicalBytes) {
+			std::cout << ", dedup ratio " << (double)blockCacheLogicalBytes.load() / physicalBytes;
+		}
+	}
+
+	uint64_t zeros = zeroBlocks.load();
+	if (0 < zeros) {
+		std::cout << ", " << zeros << " zero blocks";
+	}
+
+	uint64_t promotions = tierPromotions.load();
+	if (0 < promotions) {
+		std::cout << ", fast tier " << promotions << " promotions, " << tierDemotions.load() << " demotions";
+	}
+
+	std::cout << std::endl;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class FspStats
+{
+public:
+	static std::atomic<uint64_t> receivedPackets;
+	static std::atomic<uint64_t> receiveCalls;
+	static std::atomic<uint64_t> sentPackets;
+	static std::atomic<uint64_t> sendCalls;
+
+	// Requests answered through the AF_XDP fast path and responses sent straight from its ring
+	static std::atomic<uint64_t> xdpReceivedPackets;
+	static std::atomic<uint64_t> xdpSentPackets;
+
+	// Blocks served from a range prefetched by Readahead and all other blocks
+	static std::atomic<uint64_t> readaheadHits;
+	static std::atomic<uint64_t> readaheadMisses;
+
+	// Windows handed to the kernel and their total size
+	static std::atomic<uint64_t> readaheadCalls;
+	static std::atomic<uint64_t> readaheadBytes;
+
+	// Block lookups of the BlockCache and blocks dropped to make room
+	static std::atomic<uint64_t> blockCacheHits;
+	static std::atomic<uint64_t> blockCacheMisses;
+	static std::atomic<uint64_t> blockCacheEvictions;
+
+	// Bytes of all cached blocks and of the block memory they use, they differ with deduplication
+	static std::atomic<uint64_t> blockCacheLogicalBytes;
+	static std::atomic<uint64_t> blockCachePhysicalBytes;
+
+	// Blocks answered from the zero page
+	static std::atomic<uint64_t> zeroBlocks;
+
+	// Files copied to and dropped from the fast tier
+	static std::atomic<uint64_t> tierPromotions;
+	static std::atomic<uint64_t> tierDemotions;
+
+	// Interval in seconds in which stats are printed, 0 disables them
+	static uint16_t interval;
+
+	static bool isDue();
+	static void print();
+
+private:
+	static std::chrono::steady_clock::time_point lastPrint;
+};
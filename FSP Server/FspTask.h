@@ -0,0 +1,126 @@
+#pragma once
+#include "FspPacket.h"
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+
+// Coroutine type of the asynchronous request handlers. A task is started
+// lazily with start(); once the handler co_returns its response packet the
+// completion callback is invoked and the coroutine frame destroys itself.
+// Tasks can also be co_awaited from another handler.
+class FspTask
+{
+public:
+	struct promise_type
+	{
+		std::unique_ptr<FspPacket> result;
+		std::function<void(std::unique_ptr<FspPacket>)> onComplete;
+
+		FspTask get_return_object()
+		{
+			return FspTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		auto final_suspend() noexcept
+		{
+			struct FinalAwaiter
+			{
+				bool await_ready() noexcept
+				{
+					return false;
+				}
+
+				void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+				{
+					auto callback = std::move(handle.promise().onComplete);
+					auto result = std::move(handle.promise().result);
+					handle.destroy();
+					if (callback) {
+						callback(std::move(result));
+					}
+				}
+
+				void await_resume() noexcept
+				{
+				}
+			};
+
+			return FinalAwaiter{};
+		}
+
+		void return_value(std::unique_ptr<FspPacket> value)
+		{
+			result = std::move(value);
+		}
+
+		void unhandled_exception()
+		{
+			try
+			{
+				std::rethrow_exception(std::current_exception());
+			}
+			catch (const std::exception& e)
+			{
+				std::cout << "Error: " << e.what() << std::endl;
+			}
+
+			result = nullptr;
+		}
+	};
+
+	FspTask(FspTask&& other) noexcept : handle(other.handle)
+	{
+		other.handle = nullptr;
+	}
+
+	FspTask(const FspTask&) = delete;
+	FspTask& operator=(const FspTask&) = delete;
+
+	~FspTask()
+	{
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	void start(std::function<void(std::unique_ptr<FspPacket>)> onComplete)
+	{
+		auto started = handle;
+		handle = nullptr;
+		started.promise().onComplete = std::move(onComplete);
+		started.resume();
+	}
+
+	bool await_ready() noexcept
+	{
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> caller)
+	{
+		start([this, caller](std::unique_ptr<FspPacket> result) {
+			awaitedResult = std::move(result);
+			caller.resume();
+		});
+	}
+
+	std::unique_ptr<FspPacket> await_resume()
+	{
+		return std::move(awaitedResult);
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+	std::unique_ptr<FspPacket> awaitedResult;
+
+	explicit FspTask(std::coroutine_handle<promise_type> setHandle) : handle(setHandle)
+	{
+	}
+};
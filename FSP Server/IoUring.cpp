@@ -0,0 +1,122 @@
+#include "IoUring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+IoUring::IoUring(unsigned int entries)
+{
+	io_uring_params params = {};
+	ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+	if (ringFd < 0) {
+		throw std::runtime_error(std::string("io_uring_setup() failed: ") + std::strerror(errno));
+	}
+
+	submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMapping) {
+		submissionRingSize = std::max(submissionRingSize, completionRingSize);
+		completionRingSize = submissionRingSize;
+	}
+
+	submissionRing = mmap(nullptr, submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+	completionRing = singleMapping ? submissionRing : mmap(nullptr, completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+	submissionsSize = params.sq_entries * sizeof(io_uring_sqe);
+	submissions = static_cast<io_uring_sqe*>(mmap(nullptr, submissionsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+
+	if (submissionRing == MAP_FAILED || completionRing == MAP_FAILED || submissions == MAP_FAILED) {
+		int error = errno;
+		close(ringFd);
+		throw std::runtime_error(std::string("Could not map io_uring: ") + std::strerror(error));
+	}
+
+	char* sq = static_cast<char*>(submissionRing);
+	submissionHead = reinterpret_cast<unsigned int*>(sq + params.sq_off.head);
+	submissionTail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+	submissionMask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+	submissionEntries = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_entries);
+	submissionArray = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+
+	char* cq = static_cast<char*>(completionRing);
+	completionHead = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+	completionTail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+	completionMask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+	completions = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	localTail = *submissionTail;
+	submittedTail = localTail;
+}
+
+IoUring::~IoUring()
+{
+	munmap(submissions, submissionsSize);
+	if (completionRing != submissionRing) {
+		munmap(completionRing, completionRingSize);
+	}
+
+	munmap(submissionRing, submissionRingSize);
+	close(ringFd);
+}
+
+io_uring_sqe* IoUring::getSubmission()
+{
+	unsigned int head = __atomic_load_n(submissionHead, __ATOMIC_ACQUIRE);
+	if (*submissionEntries <= localTail - head) {
+		return nullptr;
+	}
+
+	unsigned int index = localTail & *submissionMask;
+	io_uring_sqe* submission = &submissions[index];
+	std::memset(submission, 0, sizeof(io_uring_sqe));
+	submissionArray[index] = index;
+	localTail++;
+
+	return submission;
+}
+
+int IoUring::submit(unsigned int waitFor)
+{
+	__atomic_store_n(submissionTail, localTail, __ATOMIC_RELEASE);
+
+	unsigned int pending = localTail - submittedTail;
+	unsigned int flags = 0 < waitFor ? IORING_ENTER_GETEVENTS : 0;
+	if (pending == 0 && waitFor == 0) {
+		return 0;
+	}
+
+	int result = static_cast<int>(syscall(__NR_io_uring_enter, ringFd, pending, waitFor, flags, nullptr, 0));
+	if (result < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+			return 0;
+		}
+
+		throw std::runtime_error(std::string("io_uring_enter() failed: ") + std::strerror(errno));
+	}
+
+	submittedTail += result;
+	return result;
+}
+
+size_t IoUring::forEachCompletion(const std::function<void(const io_uring_cqe&)>& callback)
+{
+	unsigned int head = *completionHead;
+	unsigned int tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+
+	while (head != tail) {
+		// Copy, the callback may submit new entries which can reuse the slot
+		io_uring_cqe completion = completions[head & *completionMask];
+		head++;
+		__atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+
+		callback(completion);
+		count++;
+	}
+
+	return count;
+}
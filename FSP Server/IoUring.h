@@ -0,0 +1,42 @@
+#pragma once
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <functional>
+
+// Minimal io_uring wrapper on top of the raw system calls. A ring is not
+// thread safe, every thread that submits I/O owns its own instance.
+class IoUring
+{
+public:
+	IoUring(unsigned int entries);
+	~IoUring();
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+	// Returns a zeroed submission queue entry or nullptr if the queue is full
+	io_uring_sqe* getSubmission();
+	int submit(unsigned int waitFor = 0);
+	size_t forEachCompletion(const std::function<void(const io_uring_cqe&)>& callback);
+
+private:
+	int ringFd;
+	unsigned int submittedTail;
+	unsigned int localTail;
+
+	void* submissionRing;
+	size_t submissionRingSize;
+	void* completionRing;
+	size_t completionRingSize;
+	io_uring_sqe* submissions;
+	size_t submissionsSize;
+
+	unsigned int* submissionHead;
+	unsigned int* submissionTail;
+	unsigned int* submissionMask;
+	unsigned int* submissionEntries;
+	unsigned int* submissionArray;
+	unsigned int* completionHead;
+	unsigned int* completionTail;
+	unsigned int* completionMask;
+	io_uring_cqe* completions;
+};
@@ -0,0 +1,290 @@
+#include "ListingCache.h"
+#include "FspDirEnt.h"
+#include "FspHelper.h"
+#include "MetadataIndex.h"
+#include "PathCache.h"
+#include <thread>
+#ifndef _WIN32
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+std::mutex ListingCache::mutex;
+std::list<std::shared_ptr<ListingCache::Listing>> ListingCache::listings;
+std::unordered_map<std::filesystem::path::string_type, std::list<std::shared_ptr<ListingCache::Listing>>::iterator> ListingCache::index;
+std::atomic<uint64_t> ListingCache::generation = 0;
+#ifndef _WIN32
+int ListingCache::inotifyDescriptor = -1;
+std::unordered_map<int, ListingCache::Watch> ListingCache::watches;
+#endif
+
+bool ListingCache::getBlock(const std::filesystem::path& directory, uint16_t blockSize, size_t blockIndex, std::vector<uint8_t>& block)
+{
+	std::shared_ptr<Listing> listing;
+	uint64_t currentGeneration = generation.load();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iterator = index.find(directory.native());
+		bool current = iterator != index.end() && (*iterator->second)->generation == currentGeneration;
+#ifdef _WIN32
+		current = current && std::chrono::steady_clock::now() - (*iterator->second)->created < MAX_AGE;
+#endif
+		if (current) {
+			listings.splice(listings.begin(), listings, iterator->second);
+			listing = *iterator->second;
+		}
+	}
+
+	if (listing == nullptr) {
+		listing = std::make_shared<Listing>();
+		listing->directory = directory;
+		listing->generation = currentGeneration;
+		listing->created = std::chrono::steady_clock::now();
+#ifndef _WIN32
+		// Watched before reading, changes while it is read drop the listing
+		addWatch(*listing);
+#endif
+		if (MetadataIndex::getEntries(directory, listing->entries)) {
+			listing->scanned = true;
+		}
+		else
+		{
+#ifdef _WIN32
+			std::error_code error;
+			listing->iterator = std::filesystem::directory_iterator(directory, error);
+#else
+			listing->scanner = std::make_unique<DirectoryScanner>(directory);
+#endif
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iterator = index.find(directory.native());
+		if (iterator != index.end()) {
+			erase(iterator->second);
+		}
+
+		listings.push_front(listing);
+		index[directory.native()] = listings.begin();
+		if (MAX_LISTINGS < listings.size()) {
+			erase(std::prev(listings.end()));
+		}
+	}
+
+	bool found;
+	bool startCompletion;
+	{
+		// Only as many entries are read as the requested block needs
+		std::lock_guard<std::mutex> lock(listing->mutex);
+		Pages& pages = listing->pages[blockSize];
+		while (pages.blocks.size() <= blockIndex && !pages.complete) {
+			if (pages.splitEntries + 1 < listing->entries.size() || listing->scanned) {
+				split(*listing, pages, blockSize);
+			}
+			else
+			{
+				scan(*listing, SCAN_STEP);
+			}
+		}
+
+		found = blockIndex < pages.blocks.size();
+		if (found) {
+			block = pages.blocks[blockIndex];
+		}
+
+		startCompletion = !listing->scanned && !listing->completing;
+		listing->completing = listing->completing || startCompletion;
+	}
+
+	// The client looks at the first page while the rest is read
+	if (startCompletion) {
+		std::thread(complete, listing).detach();
+	}
+
+	return found;
+}
+
+void ListingCache::scan(Listing& listing, size_t count)
+{
+#ifdef _WIN32
+	std::error_code error;
+	const std::filesystem::directory_iterator end;
+	for (size_t i = 0; i < count && listing.iterator != end; i++) {
+		try
+		{
+			if (!FspHelper::isSidecarName(listing.iterator->path().filename().string())) {
+				listing.entries.push_back(FspDirEnt(*listing.iterator).getRawBytes());
+			}
+		}
+		catch (const std::exception&)
+		{
+		}
+
+		listing.iterator.increment(error);
+		if (error) {
+			listing.iterator = end;
+		}
+	}
+
+	listing.scanned = listing.iterator == end;
+#else
+	listing.scanned = !listing.scanner->read(listing.entries, count);
+	if (listing.scanned) {
+		listing.scanner.reset();
+	}
+#endif
+}
+
+void ListingCache::split(Listing& listing, Pages& pages, uint16_t blockSize)
+{
+	// An entry is only split off once the next one is known, the last entry is padded differently
+	std::vector<uint8_t>& data = pages.data;
+	const std::vector<std::vector<uint8_t>>& entries = listing.entries;
+	for (; pages.splitEntries < entries.size() && (pages.splitEntries + 1 < entries.size() || listing.scanned); pages.splitEntries++) {
+		const std::vector<uint8_t>& bytes = entries[pages.splitEntries];
+		if (blockSize < data.size() + bytes.size()) {
+			if (FspDirEnt::HEADER_SIZE <= blockSize - data.size()) {
+				FspDirEnt skip = FspDirEnt::getSkipEntry(blockSize - data.size() - FspDirEnt::HEADER_SIZE);
+				std::vector<uint8_t> skipBytes = skip.getRawBytes(false);
+				data.insert(data.end(), skipBytes.begin(), skipBytes.end());
+			}
+			else if (pages.splitEntries < entries.size() - 1 || !listing.scanned) {
+				data.resize(blockSize, 0);
+			}
+
+			pages.blocks.push_back(data);
+			data.clear();
+		}
+
+		// Simply skip the file if the preffered block size is too small
+		if (data.size() + bytes.size() <= blockSize)
+		{
+			data.insert(data.end(), bytes.begin(), bytes.end());
+		}
+	}
+
+	if (!listing.scanned || pages.splitEntries < entries.size()) {
+		return;
+	}
+
+	FspDirEnt end = FspDirEnt::getEndEntry(0);
+	std::vector<uint8_t> endBytes = end.getRawBytes();
+	if (blockSize < data.size() + FspDirEnt::HEADER_SIZE) {
+		data.resize(blockSize, 0x0);
+		pages.blocks.push_back(data);
+		data.clear();
+	}
+
+	data.insert(data.end(), endBytes.begin(), endBytes.end());
+	pages.blocks.push_back(data);
+	data.clear();
+	pages.complete = true;
+}
+
+void ListingCache::complete(std::shared_ptr<Listing> listing)
+{
+	// Released between steps, clients paging through the listing are answered in between
+	while (true) {
+		std::lock_guard<std::mutex> lock(listing->mutex);
+		if (listing->scanned) {
+			listing->completing = false;
+			return;
+		}
+
+		scan(*listing, SCAN_STEP);
+	}
+}
+
+void ListingCache::invalidate(const std::filesystem::path& directory)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iterator = index.find(directory.native());
+	if (iterator != index.end()) {
+		erase(iterator->second);
+	}
+}
+
+void ListingCache::erase(std::list<std::shared_ptr<Listing>>::iterator iterator)
+{
+#ifndef _WIN32
+	auto watch = watches.find((*iterator)->watch);
+	if (watch != watches.end() && --watch->second.listings == 0) {
+		inotify_rm_watch(inotifyDescriptor, watch->first);
+		watches.erase(watch);
+	}
+#endif
+
+	index.erase((*iterator)->directory.native());
+	listings.erase(iterator);
+}
+
+#ifndef _WIN32
+void ListingCache::addWatch(Listing& listing)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (inotifyDescriptor < 0) {
+		inotifyDescriptor = inotify_init1(IN_CLOEXEC);
+		if (inotifyDescriptor < 0) {
+			return;
+		}
+
+		std::thread(watchChanges).detach();
+	}
+
+	// Changes of the entries themselves, e.g. a file being written, alter their size and time
+	const uint32_t EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+	listing.watch = inotify_add_watch(inotifyDescriptor, listing.directory.c_str(), EVENTS);
+	if (0 <= listing.watch) {
+		Watch& watch = watches[listing.watch];
+		watch.directory = listing.directory.native();
+		watch.listings++;
+	}
+}
+
+void ListingCache::watchChanges()
+{
+	std::vector<char> buffer(64 * 1024);
+	while (true) {
+		ssize_t length = read(inotifyDescriptor, buffer.data(), buffer.size());
+		if (length <= 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (ssize_t offset = 0; offset < length;) {
+			auto event = reinterpret_cast<const inotify_event*>(buffer.data() + offset);
+			offset += sizeof(inotify_event) + event->len;
+
+			// The overflow event is not tied to a watch, every listing may be outdated
+			if (event->mask & IN_Q_OVERFLOW) {
+				generation++;
+				continue;
+			}
+
+			auto watch = watches.find(event->wd);
+			if (watch == watches.end()) {
+				continue;
+			}
+
+			// The modification time of the directory changes as well, it is part of the listing of its parent
+			std::filesystem::path directory = watch->second.directory;
+			MetadataIndex::invalidate(directory);
+			MetadataIndex::invalidate(directory.parent_path());
+			PathCache::invalidate(directory);
+
+			auto iterator = index.find(directory.native());
+			if (iterator != index.end() && (*iterator->second)->watch == event->wd) {
+				erase(iterator->second);
+			}
+
+			iterator = index.find(directory.parent_path().native());
+			if (iterator != index.end()) {
+				erase(iterator->second);
+			}
+		}
+	}
+}
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include "DirectoryScanner.h"
+#endif
+
+// Directory listings shared by all clients. The entries of a directory are encoded once, the blocks
+// sent for CC_GET_DIR are split from them for every block size that is asked for. Directories are read
+// only as far as the requested block needs, the rest is read in the background once it has been sent.
+// Listings are dropped by the server's own mutating commands and, on Linux, by inotify for changes
+// made outside of the server.
+class ListingCache
+{
+public:
+	static const size_t MAX_LISTINGS = 64;
+
+	// Entries read per step, the listing is locked for one step at a time
+	static const size_t SCAN_STEP = 256;
+
+	// Without inotify changes made outside of the server are picked up once a listing is this old (Windows)
+	static constexpr std::chrono::steady_clock::duration MAX_AGE = std::chrono::seconds(5);
+
+	// Block index of the listing of directory for blockSize, false if the listing has fewer blocks
+	static bool getBlock(const std::filesystem::path& directory, uint16_t blockSize, size_t index, std::vector<uint8_t>& block);
+
+	// Called by every mutating command for the directories it changed, the change is visible to the next CC_GET_DIR
+	static void invalidate(const std::filesystem::path& directory);
+
+private:
+	// Blocks of one block size, split off the entries read so far
+	struct Pages
+	{
+		std::vector<std::vector<uint8_t>> blocks;
+		std::vector<uint8_t> data;
+		size_t splitEntries = 0;
+		bool complete = false;
+	};
+
+	struct Listing
+	{
+		std::filesystem::path directory;
+		uint64_t generation = 0;
+		std::chrono::steady_clock::time_point created;
+		int watch = -1;
+
+		// Guards everything below, held for one step of reading or splitting
+		std::mutex mutex;
+#ifdef _WIN32
+		std::filesystem::directory_iterator iterator;
+#else
+		std::unique_ptr<DirectoryScanner> scanner;
+#endif
+		bool scanned = false;
+		bool completing = false;
+
+		// Encoded entries including name and padding, independent of the block size
+		std::vector<std::vector<uint8_t>> entries;
+		std::map<uint16_t, Pages> pages;
+	};
+
+	static std::mutex mutex;
+
+	// Most recently used first
+	static std::list<std::shared_ptr<Listing>> listings;
+	static std::unordered_map<std::filesystem::path::string_type, std::list<std::shared_ptr<Listing>>::iterator> index;
+	static std::atomic<uint64_t> generation;
+
+	// Both are called with the mutex of the listing held
+	static void scan(Listing& listing, size_t count);
+	static void split(Listing& listing, Pages& pages, uint16_t blockSize);
+
+	static void complete(std::shared_ptr<Listing> listing);
+	static void erase(std::list<std::shared_ptr<Listing>>::iterator iterator);
+
+#ifndef _WIN32
+	// inotify returns the same watch for every listing of a directory, it is removed with its last listing
+	struct Watch
+	{
+		std::filesystem::path::string_type directory;
+		size_t listings = 0;
+	};
+
+	static int inotifyDescriptor;
+	static std::unordered_map<int, Watch> watches;
+
+	static void addWatch(Listing& listing);
+	static void watchChanges();
+#endif
+};
@@ -0,0 +1,876 @@
+#include "MetadataIndex.h"
+#include "CompressedImage.h"
+#include "FspDirEnt.h"
+#include "FspHelper.h"
+#include "ListingCache.h"
+#include "UdpSocket.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#ifndef _WIN32
+#include "DirectoryScanner.h"
+#endif
+
+std::filesystem::path MetadataIndex::snapshotPath;
+std::filesystem::path MetadataIndex::root;
+std::atomic<bool> MetadataIndex::ready = false;
+std::shared_mutex MetadataIndex::mutex;
+std::vector<uint8_t> MetadataIndex::pool;
+std::vector<MetadataIndex::Entry> MetadataIndex::entries;
+size_t MetadataIndex::unusedBytes = 0;
+std::unordered_map<std::string, MetadataIndex::Directory> MetadataIndex::directories;
+std::unordered_map<std::string, uint32_t> MetadataIndex::files;
+std::unordered_set<std::string> MetadataIndex::restrictedFiles;
+std::unordered_set<std::string> MetadataIndex::removedDirectories;
+std::unordered_set<std::string> MetadataIndex::addedDirectories;
+std::mutex MetadataIndex::changeMutex;
+std::unordered_set<std::string> MetadataIndex::changed;
+std::vector<std::filesystem::path> MetadataIndex::pendingUpdates;
+std::atomic<bool> MetadataIndex::dirty = false;
+
+static const char SNAPSHOT_MAGIC[] = "FSP metadata index 2";
+
+// Set in the stored length of restricted entries
+static const uint32_t RESTRICTED_FLAG = 1u << 31;
+
+bool MetadataIndex::isEnabled()
+{
+	return !snapshotPath.empty();
+}
+
+template <typename Function>
+void MetadataIndex::forEachEntry(const Directory& directory, Function function)
+{
+	for (uint32_t i = directory.first; i < directory.first + directory.count; i++) {
+		if (entries[i].length != 0) {
+			function(i);
+		}
+	}
+
+	for (uint32_t i : directory.added) {
+		if (entries[i].length != 0) {
+			function(i);
+		}
+	}
+}
+
+void MetadataIndex::start()
+{
+	if (!isEnabled()) {
+		return;
+	}
+
+	root = std::filesystem::absolute(UdpSocket::basePath).lexically_normal();
+	if (root.filename().empty()) {
+		root = root.parent_path();
+	}
+
+	std::thread(run).detach();
+}
+
+void MetadataIndex::run()
+{
+	auto start = std::chrono::steady_clock::now();
+	std::unordered_map<std::string, Scan> snapshot;
+	bool loaded = load(snapshot);
+	size_t read = build(snapshot, "");
+
+	// Commands that changed files during the scan are applied before the index is used
+	while (true) {
+		std::vector<std::filesystem::path> updates;
+		{
+			std::lock_guard<std::mutex> lock(changeMutex);
+			if (pendingUpdates.empty()) {
+				ready = true;
+				break;
+			}
+
+			updates.swap(pendingUpdates);
+		}
+
+		for (const auto& path : updates) {
+			apply(path);
+		}
+	}
+
+	size_t entryCount;
+	size_t directoryCount;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		entryCount = files.size();
+		directoryCount = directories.size();
+	}
+
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+	std::cout << "Metadata index: " << entryCount << " entries in " << directoryCount << " directories, "
+		<< read << " directories read " << (loaded ? "after loading the snapshot" : "without a snapshot") << " in " << duration.count() << " ms" << std::endl;
+
+	if (0 < read) {
+		save();
+	}
+
+	auto lastSave = std::chrono::steady_clock::now();
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+
+		std::unordered_set<std::string> keys;
+		{
+			std::lock_guard<std::mutex> lock(changeMutex);
+			keys.swap(changed);
+		}
+
+		rebuild();
+		for (const auto& key : keys) {
+			refresh(key);
+		}
+
+		{
+			std::unique_lock<std::shared_mutex> lock(mutex);
+			if (pool.size() / 2 < unusedBytes) {
+				compact();
+			}
+		}
+
+		if (dirty && std::chrono::seconds(SAVE_INTERVAL) <= std::chrono::steady_clock::now() - lastSave) {
+			save();
+			lastSave = std::chrono::steady_clock::now();
+		}
+	}
+}
+
+bool MetadataIndex::getEntries(const std::filesystem::path& directory, std::vector<std::vector<uint8_t>>& result)
+{
+	std::string key;
+	if (!ready || !getKey(directory, key)) {
+		return false;
+	}
+
+	int64_t modified = getModified(directory);
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto iterator = directories.find(key);
+		if (iterator == directories.end() || iterator->second.changes != iterator->second.readChanges || isRemoved(key)) {
+			return false;
+		}
+
+		const Directory& indexed = iterator->second;
+		if (indexed.modified == modified) {
+			result.reserve(result.size() + indexed.count + indexed.added.size());
+			forEachEntry(indexed, [&](uint32_t i) {
+				const uint8_t* bytes = pool.data() + entries[i].offset;
+				result.emplace_back(bytes, bytes + entries[i].length);
+			});
+
+			return true;
+		}
+	}
+
+	// Changed outside of the server while nothing watched it
+	invalidate(directory);
+	return false;
+}
+
+bool MetadataIndex::stat(const std::string& subPath, std::vector<uint8_t>& response)
+{
+	if (!ready) {
+		return false;
+	}
+
+	// Same trimming as FspHelper::getCompletePath, paths leaving the served directory are left to it
+	std::string trimmed = subPath;
+	trimmed.erase(0, trimmed.find_first_not_of("\\/"));
+	trimmed.erase(trimmed.find_last_not_of("\\/") + 1);
+	std::string key = std::filesystem::path(trimmed).lexically_normal().generic_string();
+	if (!key.empty() && key.back() == '/') {
+		key.pop_back();
+	}
+
+	if (key == ".") {
+		key.clear();
+	}
+
+	// Paths leaving the served directory and hidden names at its top are rejected by FspHelper::checkPath
+	if (key.empty() || key[0] == '.') {
+		return false;
+	}
+
+	std::string parent = getParentKey(key);
+	int64_t modified = getModified(getPath(parent));
+	bool found = false;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto directory = directories.find(parent);
+		if (directory == directories.end() || directory->second.changes != directory->second.readChanges || isRemoved(parent)) {
+			return false;
+		}
+
+		// Names not listed, e.g. the stored name of a compressed image, are looked up on the disk
+		auto file = files.find(key);
+		if (file == files.end() || restrictedFiles.find(key) != restrictedFiles.end()) {
+			return false;
+		}
+
+		if (directory->second.modified != modified) {
+			lock.unlock();
+			invalidate(getPath(parent));
+			return false;
+		}
+
+		const uint8_t* bytes = pool.data() + entries[file->second].offset;
+		if (!isDirectory(bytes)) {
+			response.assign(bytes, bytes + FspDirEnt::HEADER_SIZE);
+			found = true;
+		}
+	}
+
+	if (!found) {
+		// Directories can not be stat'ed
+		response = FspDirEnt::getEndEntry(0).getRawBytes(false);
+		return true;
+	}
+
+	// Padded the same way FspDirEnt::getRawBytes(false) pads it
+	response.resize((response.size() + 3) / 4 * 4, 0);
+	return true;
+}
+
+void MetadataIndex::update(const std::filesystem::path& path)
+{
+	if (!isEnabled()) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(changeMutex);
+		if (!ready) {
+			pendingUpdates.push_back(path);
+			return;
+		}
+	}
+
+	apply(path);
+}
+
+void MetadataIndex::apply(const std::filesystem::path& path)
+{
+	std::string key;
+	if (!getKey(path, key) || key.empty() || FspHelper::isSidecarName(path.filename().string())) {
+		return;
+	}
+
+	// Missing parent directories may have been created along with path
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		while (!key.empty() && (directories.find(getParentKey(key)) == directories.end() || isRemoved(getParentKey(key)))) {
+			key = getParentKey(key);
+		}
+	}
+
+	if (key.empty()) {
+		return;
+	}
+
+	// Read before taking the lock, it is only held to patch the entries. The modification time of the
+	// parent is taken after the command, the patched listing is as current as a read at this point.
+	std::filesystem::path changedPath = getPath(key);
+	std::string parent = getParentKey(key);
+	int64_t parentModified = getModified(getPath(parent));
+	std::vector<uint8_t> bytes;
+	std::error_code error;
+	if (std::filesystem::exists(changedPath, error)) {
+		try
+		{
+			bytes = FspDirEnt(std::filesystem::directory_entry(changedPath)).getRawBytes();
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+
+	// The parent lists the changed entry, its own parent lists the new modification time of the parent
+	std::vector<uint8_t> parentBytes;
+	if (!parent.empty()) {
+		try
+		{
+			parentBytes = FspDirEnt(std::filesystem::directory_entry(getPath(parent))).getRawBytes();
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+
+	// Which of an image and its compressed version is listed depends on both, the parent is read again
+	bool image = CompressedImage::isCompressedName(changedPath) || !CompressedImage::findCompressed(changedPath).empty();
+	bool directory = !bytes.empty() && isDirectory(bytes.data()) && !std::filesystem::is_symlink(changedPath, error);
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		auto listing = directories.find(parent);
+		if (listing == directories.end() || isRemoved(parent)) {
+			return;
+		}
+
+		if (!image) {
+			if (directories.find(key) != directories.end()) {
+				removedDirectories.insert(key);
+			}
+
+			if (directory) {
+				addedDirectories.insert(key);
+			}
+
+			patch(listing->second, key, bytes, isRestricted(changedPath));
+			listing->second.modified = parentModified;
+		}
+
+		auto grandparent = parent.empty() ? directories.end() : directories.find(getParentKey(parent));
+		if (grandparent != directories.end() && !parentBytes.empty() && files.find(parent) != files.end()) {
+			patch(grandparent->second, parent, parentBytes, isRestricted(getPath(parent)));
+		}
+	}
+
+	if (image) {
+		invalidate(getPath(parent));
+	}
+}
+
+void MetadataIndex::patch(Directory& directory, const std::string& key, const std::vector<uint8_t>& bytes, bool restricted)
+{
+	if (restricted && !bytes.empty()) {
+		restrictedFiles.insert(key);
+	}
+	else
+	{
+		restrictedFiles.erase(key);
+	}
+
+	auto file = files.find(key);
+	if (file != files.end()) {
+		Entry& entry = entries[file->second];
+		unusedBytes += entry.length;
+		if (bytes.empty()) {
+			entry.length = 0;
+			files.erase(file);
+		}
+		else
+		{
+			entry = Entry{ pool.size(), static_cast<uint32_t>(bytes.size()) };
+			pool.insert(pool.end(), bytes.begin(), bytes.end());
+		}
+	}
+	else if (!bytes.empty()) {
+		files[key] = static_cast<uint32_t>(entries.size());
+		directory.added.push_back(static_cast<uint32_t>(entries.size()));
+		entries.push_back(Entry{ pool.size(), static_cast<uint32_t>(bytes.size()) });
+		pool.insert(pool.end(), bytes.begin(), bytes.end());
+	}
+
+	// A read of the directory still running would store the listing from before the change, see store()
+	directory.changes++;
+	directory.readChanges++;
+	dirty = true;
+}
+
+bool MetadataIndex::isRestricted(const std::filesystem::path& path)
+{
+	std::error_code error;
+	std::filesystem::file_status status = std::filesystem::status(path, error);
+	return std::filesystem::is_symlink(path, error) || (status.permissions() & std::filesystem::perms::owner_read) == std::filesystem::perms::none;
+}
+
+bool MetadataIndex::isRemoved(const std::string& key)
+{
+	if (removedDirectories.empty()) {
+		return false;
+	}
+
+	std::string current = key;
+	while (removedDirectories.find(current) == removedDirectories.end()) {
+		if (current.empty()) {
+			return false;
+		}
+
+		current = getParentKey(current);
+	}
+
+	return true;
+}
+
+void MetadataIndex::invalidate(const std::filesystem::path& directory)
+{
+	std::string key;
+	if (!isEnabled() || !getKey(directory, key)) {
+		return;
+	}
+
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		auto iterator = directories.find(key);
+		if (iterator != directories.end()) {
+			iterator->second.changes++;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(changeMutex);
+	changed.insert(key);
+}
+
+void MetadataIndex::save()
+{
+	if (!isEnabled() || !ready) {
+		return;
+	}
+
+	dirty = false;
+	std::filesystem::path temporaryPath = snapshotPath;
+	temporaryPath += ".tmp";
+
+	{
+		std::ofstream stream(temporaryPath, std::ios::binary | std::ios::trunc);
+		std::string rootName = root.generic_string();
+		stream << SNAPSHOT_MAGIC << '\n' << rootName << '\n';
+
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		for (const auto& [key, directory] : directories) {
+			if (isRemoved(key)) {
+				continue;
+			}
+
+			uint32_t count = 0;
+			forEachEntry(directory, [&](uint32_t) { count++; });
+
+			uint32_t keyLength = static_cast<uint32_t>(key.size());
+			stream.write(reinterpret_cast<const char*>(&keyLength), sizeof(keyLength));
+			stream.write(key.data(), keyLength);
+			stream.write(reinterpret_cast<const char*>(&directory.modified), sizeof(directory.modified));
+			stream.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			forEachEntry(directory, [&](uint32_t i) {
+				const uint8_t* bytes = pool.data() + entries[i].offset;
+				uint32_t length = entries[i].length;
+				if (restrictedFiles.find(getChildKey(key, getName(bytes, length))) != restrictedFiles.end()) {
+					length |= RESTRICTED_FLAG;
+				}
+
+				stream.write(reinterpret_cast<const char*>(&length), sizeof(length));
+				stream.write(reinterpret_cast<const char*>(pool.data() + entries[i].offset), entries[i].length);
+			});
+		}
+
+		if (!stream.good()) {
+			std::cout << "Error: Could not write the metadata index to \"" << snapshotPath.string() << "\"" << std::endl;
+			return;
+		}
+	}
+
+	// Replaced in one step, an interrupted write leaves the previous snapshot intact
+	std::error_code error;
+	std::filesystem::rename(temporaryPath, snapshotPath, error);
+}
+
+bool MetadataIndex::load(std::unordered_map<std::string, Scan>& snapshot)
+{
+	std::ifstream stream(snapshotPath, std::ios::binary);
+	std::string magic;
+	std::string rootName;
+	if (!std::getline(stream, magic) || magic != SNAPSHOT_MAGIC || !std::getline(stream, rootName) || rootName != root.generic_string()) {
+		return false;
+	}
+
+	while (true) {
+		uint32_t keyLength;
+		if (!stream.read(reinterpret_cast<char*>(&keyLength), sizeof(keyLength))) {
+			return true;
+		}
+
+		Scan scan;
+		uint32_t count = 0;
+		scan.key.resize(keyLength);
+		stream.read(scan.key.data(), keyLength);
+		stream.read(reinterpret_cast<char*>(&scan.modified), sizeof(scan.modified));
+		stream.read(reinterpret_cast<char*>(&count), sizeof(count));
+		for (uint32_t i = 0; i < count && stream; i++) {
+			uint32_t length = 0;
+			stream.read(reinterpret_cast<char*>(&length), sizeof(length));
+			bool restricted = (length & RESTRICTED_FLAG) != 0;
+			length &= ~RESTRICTED_FLAG;
+			if (length < FspDirEnt::HEADER_SIZE || 1024 < length) {
+				stream.setstate(std::ios::failbit);
+				break;
+			}
+
+			std::vector<uint8_t> entry(length);
+			stream.read(reinterpret_cast<char*>(entry.data()), length);
+			if (restricted) {
+				scan.restricted.insert(getName(entry.data(), entry.size()));
+			}
+
+			scan.entries.push_back(std::move(entry));
+		}
+
+		if (!stream) {
+			// A damaged snapshot is ignored, the whole tree is read again
+			snapshot.clear();
+			return false;
+		}
+
+		snapshot[scan.key] = std::move(scan);
+	}
+}
+
+size_t MetadataIndex::build(std::unordered_map<std::string, Scan>& snapshot, const std::string& key)
+{
+	std::mutex queueMutex;
+	std::condition_variable queueCondition;
+	std::deque<std::string> queue = { key };
+	size_t active = 0;
+	std::atomic<size_t> read = 0;
+
+	auto work = [&]() {
+		while (true) {
+			std::string next;
+			{
+				std::unique_lock<std::mutex> lock(queueMutex);
+				queueCondition.wait(lock, [&]() { return !queue.empty() || active == 0; });
+				if (queue.empty()) {
+					return;
+				}
+
+				next = std::move(queue.front());
+				queue.pop_front();
+				active++;
+			}
+
+			// Only the modification time of a directory is compared, a file rewritten in place keeps it
+			Scan scan;
+			scan.key = next;
+			auto stored = snapshot.find(next);
+			int64_t modified = getModified(getPath(next));
+			if (stored != snapshot.end() && stored->second.modified == modified) {
+				scan.modified = modified;
+				scan.entries = std::move(stored->second.entries);
+				scan.restricted = std::move(stored->second.restricted);
+			}
+			else
+			{
+				MetadataIndex::read(scan);
+				read++;
+			}
+
+			// Symbolic links to directories are not followed, they could lead out of the tree or in a circle
+			std::vector<std::string> children;
+			for (const auto& entry : scan.entries) {
+				if (!isDirectory(entry.data())) {
+					continue;
+				}
+
+				std::string child = getChildKey(next, getName(entry.data(), entry.size()));
+				std::error_code error;
+				if (snapshot.find(child) != snapshot.end() || !std::filesystem::is_symlink(getPath(child), error)) {
+					children.push_back(std::move(child));
+				}
+			}
+
+			store(scan);
+
+			std::lock_guard<std::mutex> lock(queueMutex);
+			queue.insert(queue.end(), std::make_move_iterator(children.begin()), std::make_move_iterator(children.end()));
+			active--;
+			queueCondition.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < SCAN_THREADS; i++) {
+		threads.emplace_back(work);
+	}
+
+	work();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	return read;
+}
+
+void MetadataIndex::read(Scan& scan)
+{
+	// Taken before reading, a change during the read is noticed on the next comparison
+	std::filesystem::path directory = getPath(scan.key);
+	scan.modified = getModified(directory);
+	scan.entries.clear();
+	scan.restricted.clear();
+
+#ifdef _WIN32
+	std::error_code error;
+	for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+		if (FspHelper::isSidecarName(entry.path().filename().string())) {
+			continue;
+		}
+
+		try
+		{
+			FspDirEnt listed(entry);
+			scan.entries.push_back(listed.getRawBytes());
+			if (isRestricted(entry.path())) {
+				scan.restricted.insert(listed.filename);
+			}
+		}
+		catch (const std::exception&)
+		{
+		}
+	}
+#else
+	DirectoryScanner scanner(directory);
+	while (scanner.read(scan.entries, ListingCache::SCAN_STEP)) {
+	}
+
+	scan.restricted.insert(scanner.restricted.begin(), scanner.restricted.end());
+#endif
+}
+
+void MetadataIndex::store(Scan& scan)
+{
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	Directory directory = { static_cast<uint32_t>(entries.size()), static_cast<uint32_t>(scan.entries.size()), scan.modified, 0, 0, {} };
+
+	auto existing = directories.find(scan.key);
+	if (existing != directories.end()) {
+		// Changes reported while the directory was read keep it from being answered
+		directory.changes = existing->second.changes;
+		directory.readChanges = scan.changes;
+		forEachEntry(existing->second, [&](uint32_t i) {
+			std::string child = getChildKey(scan.key, getName(pool.data() + entries[i].offset, entries[i].length));
+			files.erase(child);
+			restrictedFiles.erase(child);
+			unusedBytes += entries[i].length;
+		});
+
+		// Patched by update() while it was read, it is read once more
+		if (directory.changes != directory.readChanges) {
+			std::lock_guard<std::mutex> changeLock(changeMutex);
+			changed.insert(scan.key);
+		}
+	}
+
+	for (const auto& bytes : scan.entries) {
+		std::string name = getName(bytes.data(), bytes.size());
+		if (scan.restricted.find(name) != scan.restricted.end()) {
+			restrictedFiles.insert(getChildKey(scan.key, name));
+		}
+
+		files[getChildKey(scan.key, name)] = static_cast<uint32_t>(entries.size());
+		entries.push_back(Entry{ pool.size(), static_cast<uint32_t>(bytes.size()) });
+		pool.insert(pool.end(), bytes.begin(), bytes.end());
+	}
+
+	directories[scan.key] = directory;
+	dirty = true;
+
+	if (pool.size() / 2 < unusedBytes) {
+		compact();
+	}
+}
+
+void MetadataIndex::remove(const std::string& key)
+{
+	std::unique_lock<std::shared_mutex> lock(mutex);
+	auto iterator = directories.begin();
+	while (iterator != directories.end()) {
+		const std::string& directoryKey = iterator->first;
+		bool below = directoryKey == key || (key.size() < directoryKey.size() && directoryKey.compare(0, key.size(), key) == 0 && directoryKey[key.size()] == '/');
+		if (!below) {
+			++iterator;
+			continue;
+		}
+
+		forEachEntry(iterator->second, [&](uint32_t i) {
+			std::string child = getChildKey(directoryKey, getName(pool.data() + entries[i].offset, entries[i].length));
+			files.erase(child);
+			restrictedFiles.erase(child);
+			unusedBytes += entries[i].length;
+		});
+
+		iterator = directories.erase(iterator);
+		dirty = true;
+	}
+
+	removedDirectories.erase(key);
+}
+
+void MetadataIndex::compact()
+{
+	// Called with the lock held, entries of replaced listings are dropped from the pool
+	std::vector<uint8_t> compactedPool;
+	std::vector<Entry> compactedEntries;
+	compactedPool.reserve(pool.size() - unusedBytes);
+	compactedEntries.reserve(files.size());
+
+	for (auto& [key, directory] : directories) {
+		uint32_t first = static_cast<uint32_t>(compactedEntries.size());
+		forEachEntry(directory, [&](uint32_t i) {
+			const uint8_t* bytes = pool.data() + entries[i].offset;
+			files[getChildKey(key, getName(bytes, entries[i].length))] = static_cast<uint32_t>(compactedEntries.size());
+			compactedEntries.push_back(Entry{ compactedPool.size(), entries[i].length });
+			compactedPool.insert(compactedPool.end(), bytes, bytes + entries[i].length);
+		});
+
+		directory.first = first;
+		directory.count = static_cast<uint32_t>(compactedEntries.size()) - first;
+		directory.added.clear();
+	}
+
+	pool.swap(compactedPool);
+	entries.swap(compactedEntries);
+	unusedBytes = 0;
+}
+
+void MetadataIndex::refresh(const std::string& key)
+{
+	Scan scan;
+	scan.key = key;
+	std::unordered_set<std::string> previousChildren;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		auto iterator = directories.find(key);
+		if (iterator == directories.end()) {
+			return;
+		}
+
+		scan.changes = iterator->second.changes;
+		forEachEntry(iterator->second, [&](uint32_t i) {
+			const uint8_t* bytes = pool.data() + entries[i].offset;
+			if (isDirectory(bytes)) {
+				previousChildren.insert(getChildKey(key, getName(bytes, entries[i].length)));
+			}
+		});
+	}
+
+	read(scan);
+
+	std::vector<std::string> addedChildren;
+	for (const auto& entry : scan.entries) {
+		if (!isDirectory(entry.data())) {
+			continue;
+		}
+
+		std::string child = getChildKey(key, getName(entry.data(), entry.size()));
+		std::error_code error;
+		if (previousChildren.erase(child) == 0 && !std::filesystem::is_symlink(getPath(child), error)) {
+			addedChildren.push_back(child);
+		}
+	}
+
+	store(scan);
+
+	for (const auto& child : previousChildren) {
+		remove(child);
+	}
+
+	for (const auto& child : addedChildren) {
+		std::unordered_map<std::string, Scan> snapshot;
+		build(snapshot, child);
+	}
+}
+
+void MetadataIndex::rebuild()
+{
+	std::vector<std::string> removed;
+	std::vector<std::string> added;
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		removed.assign(removedDirectories.begin(), removedDirectories.end());
+		added.assign(addedDirectories.begin(), addedDirectories.end());
+		addedDirectories.clear();
+	}
+
+	for (const auto& key : removed) {
+		remove(key);
+	}
+
+	for (const auto& key : added) {
+		std::error_code error;
+		if (!std::filesystem::is_directory(getPath(key), error)) {
+			continue;
+		}
+
+		{
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			if (files.find(key) == files.end() || directories.find(key) != directories.end() || isRemoved(key)) {
+				continue;
+			}
+		}
+
+		std::unordered_map<std::string, Scan> snapshot;
+		build(snapshot, key);
+
+		// Removed again while it was read
+		bool listed;
+		{
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			listed = files.find(key) != files.end();
+		}
+
+		if (!listed) {
+			remove(key);
+		}
+	}
+}
+
+bool MetadataIndex::getKey(const std::filesystem::path& path, std::string& key)
+{
+	std::error_code error;
+	std::filesystem::path relative = std::filesystem::absolute(path, error).lexically_normal().lexically_relative(root);
+	if (relative.empty() || *relative.begin() == "..") {
+		return false;
+	}
+
+	key = relative.generic_string();
+	if (!key.empty() && key.back() == '/') {
+		key.pop_back();
+	}
+
+	if (key == ".") {
+		key.clear();
+	}
+
+	return true;
+}
+
+std::string MetadataIndex::getChildKey(const std::string& directory, const std::string& name)
+{
+	return directory.empty() ? name : directory + "/" + name;
+}
+
+std::string MetadataIndex::getParentKey(const std::string& key)
+{
+	size_t separator = key.rfind('/');
+	return separator == std::string::npos ? "" : key.substr(0, separator);
+}
+
+std::filesystem::path MetadataIndex::getPath(const std::string& key)
+{
+	return key.empty() ? root : root / std::filesystem::path(key);
+}
+
+std::string MetadataIndex::getName(const uint8_t* entry, size_t length)
+{
+	const char* name = reinterpret_cast<const char*>(entry + FspDirEnt::HEADER_SIZE);
+	return std::string(name, strnlen(name, length - FspDirEnt::HEADER_SIZE));
+}
+
+bool MetadataIndex::isDirectory(const uint8_t* entry)
+{
+	// Type byte of the encoded entry, see FspDirEnt
+	return entry[8] == 0x02;
+}
+
+int64_t MetadataIndex::getModified(const std::filesystem::path& path)
+{
+	std::error_code error;
+	auto modified = std::filesystem::last_write_time(path, error);
+	return error ? 0 : static_cast<int64_t>(modified.time_since_epoch().count());
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Optional index of every directory below the served directory. It is built by one parallel scan at
+// startup or loaded from the snapshot of the previous run, in which case only directories whose
+// modification time changed are read again. CC_GET_DIR and CC_STAT are answered from the encoded
+// entries it keeps without touching the disk. The server's own mutating commands update it right
+// away, changes reported by inotify are read again in the background.
+class MetadataIndex
+{
+public:
+	// Snapshot file, empty disables the index
+	static std::filesystem::path snapshotPath;
+
+	static const size_t SCAN_THREADS = 4;
+
+	// Changed directories are read again every second, the snapshot is written at most this often
+	static const uint32_t SAVE_INTERVAL = 60;
+
+	static bool isEnabled();
+
+	// Loads or builds the index in the background, until it is ready requests are answered from the disk
+	static void start();
+
+	// Encoded entries of directory in listing order, false if it is not indexed
+	static bool getEntries(const std::filesystem::path& directory, std::vector<std::vector<uint8_t>>& entries);
+
+	// CC_STAT response for the sub path sent by a client, false if it is not indexed
+	static bool stat(const std::string& subPath, std::vector<uint8_t>& response);
+
+	// Called by every mutating command after it changed path, which may have been created or removed.
+	// Only its entry in the parent is patched, directories below it are read again in the background.
+	static void update(const std::filesystem::path& path);
+
+	// Directory changed outside of the server, it is read again in the background
+	static void invalidate(const std::filesystem::path& directory);
+
+	static void save();
+
+private:
+	// Range of the pool holding one encoded entry, its name starts after the header
+	struct Entry
+	{
+		uint64_t offset;
+		uint32_t length;
+	};
+
+	struct Directory
+	{
+		uint32_t first;
+		uint32_t count;
+
+		// Modification time when it was read, compared against the disk on every lookup. Changes in
+		// directories without an inotify watch and on Windows are noticed this way.
+		int64_t modified;
+
+		// Reported changes and those already read again, a changed directory is not answered from the index
+		uint32_t changes = 0;
+		uint32_t readChanges = 0;
+
+		// Entries added by update() after the directory was read, they are listed after the others
+		std::vector<uint32_t> added;
+	};
+
+	struct Scan
+	{
+		std::string key;
+		int64_t modified = 0;
+		uint32_t changes = 0;
+		std::vector<std::vector<uint8_t>> entries;
+
+		// Names of the entries that may be symbolic links or lack the owner's read permission
+		std::unordered_set<std::string> restricted;
+	};
+
+	static std::filesystem::path root;
+	static std::atomic<bool> ready;
+	static std::shared_mutex mutex;
+
+	// All encoded entries back to back, entries of a directory are contiguous apart from those added
+	// by update(). Entries it removed keep their place with a length of 0 until the next compaction.
+	static std::vector<uint8_t> pool;
+	static std::vector<Entry> entries;
+	static size_t unusedBytes;
+
+	// Keyed by the generic path relative to the served directory, the served directory itself is ""
+	static std::unordered_map<std::string, Directory> directories;
+
+	// Directory key and entry name to the entry, for CC_STAT
+	static std::unordered_map<std::string, uint32_t> files;
+
+	// Entries CC_STAT leaves to FspHelper::checkPath, see DirectoryScanner::restricted
+	static std::unordered_set<std::string> restrictedFiles;
+
+	// Directories whose entry update() removed or replaced, they and everything below them are not
+	// answered until the background pass dropped them. New directories are read by it as well.
+	static std::unordered_set<std::string> removedDirectories;
+	static std::unordered_set<std::string> addedDirectories;
+
+	static std::mutex changeMutex;
+	static std::unordered_set<std::string> changed;
+	static std::vector<std::filesystem::path> pendingUpdates;
+	static std::atomic<bool> dirty;
+
+	static bool getKey(const std::filesystem::path& path, std::string& key);
+	static std::string getChildKey(const std::string& directory, const std::string& name);
+	static std::string getParentKey(const std::string& key);
+	static std::filesystem::path getPath(const std::string& key);
+	static std::string getName(const uint8_t* entry, size_t length);
+	static bool isDirectory(const uint8_t* entry);
+	static int64_t getModified(const std::filesystem::path& path);
+
+	// Reads key and every directory below it, directories of the snapshot that are unchanged are taken from it
+	static size_t build(std::unordered_map<std::string, Scan>& snapshot, const std::string& key);
+	static void read(Scan& scan);
+	static void store(Scan& scan);
+	static void remove(const std::string& key);
+	static void compact();
+	static void apply(const std::filesystem::path& path);
+
+	// Replaces or adds the entry of key in directory, empty bytes remove it. Called with the lock held.
+	static void patch(Directory& directory, const std::string& key, const std::vector<uint8_t>& bytes, bool restricted);
+	static bool isRestricted(const std::filesystem::path& path);
+	static bool isRemoved(const std::string& key);
+
+	// Calls function with the index of every entry of directory in listing order
+	template <typename Function>
+	static void forEachEntry(const Directory& directory, Function function);
+
+	// Reads an indexed directory again, added subdirectories are indexed and removed ones dropped
+	static void refresh(const std::string& key);
+	static bool load(std::unordered_map<std::string, Scan>& snapshot);
+
+	// Drops the directories removed by update() and reads those it added
+	static void rebuild();
+	static void run();
+};
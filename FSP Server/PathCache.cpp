@@ -0,0 +1,102 @@
+#include "PathCache.h"
+
+std::mutex PathCache::mutex;
+std::list<PathCache::Entry> PathCache::entries;
+std::unordered_map<std::string, std::list<PathCache::Entry>::iterator> PathCache::index;
+
+std::string PathCache::getKey(const std::string& subPath, std::filesystem::file_type type)
+{
+	return (type == std::filesystem::file_type::regular ? "f:" : "d:") + subPath;
+}
+
+std::list<PathCache::Entry>::iterator PathCache::lookup(const std::string& key)
+{
+	auto iterator = index.find(key);
+	if (iterator == index.end()) {
+		return entries.end();
+	}
+
+	if (iterator->second->expires < std::chrono::steady_clock::now()) {
+		entries.erase(iterator->second);
+		index.erase(iterator);
+		return entries.end();
+	}
+
+	entries.splice(entries.begin(), entries, iterator->second);
+	return iterator->second;
+}
+
+bool PathCache::find(const std::string& key, std::filesystem::path& path)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = lookup(key);
+	if (entry == entries.end()) {
+		return false;
+	}
+
+	path = entry->path;
+	return true;
+}
+
+void PathCache::insert(const std::string& key, const std::filesystem::path& path)
+{
+	auto expires = std::chrono::steady_clock::now() + (path.empty() ? NOT_FOUND_MAX_AGE : MAX_AGE);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iterator = index.find(key);
+	if (iterator != index.end()) {
+		entries.erase(iterator->second);
+		index.erase(iterator);
+	}
+
+	entries.push_front(Entry{ key, path, {}, expires });
+	index[key] = entries.begin();
+
+	if (MAX_ENTRIES < entries.size()) {
+		index.erase(entries.back().key);
+		entries.pop_back();
+	}
+}
+
+bool PathCache::findStat(const std::string& key, std::vector<uint8_t>& response)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = lookup(key);
+	if (entry == entries.end() || entry->stat.empty()) {
+		return false;
+	}
+
+	response = entry->stat;
+	return true;
+}
+
+void PathCache::insertStat(const std::string& key, const std::vector<uint8_t>& response)
+{
+	// Only stored next to a resolved path, it is dropped together with it
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = lookup(key);
+	if (entry != entries.end() && !entry->path.empty()) {
+		entry->stat = response;
+	}
+}
+
+void PathCache::invalidate(const std::filesystem::path& path)
+{
+	const auto& prefix = path.native();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto iterator = entries.begin();
+	while (iterator != entries.end()) {
+		// Creating a file or directory can make any path cached as not found valid
+		const auto& cached = iterator->path.native();
+		bool below = prefix.size() < cached.size() && cached.compare(0, prefix.size(), prefix) == 0 && cached[prefix.size()] == std::filesystem::path::preferred_separator;
+		if (cached.empty() || cached == prefix || below) {
+			index.erase(iterator->key);
+			iterator = entries.erase(iterator);
+		}
+		else
+		{
+			++iterator;
+		}
+	}
+}
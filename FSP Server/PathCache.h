@@ -0,0 +1,54 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Bounded LRU of resolved client paths shared by all threads, keyed by the sub path a client sent and
+// the file type it asked for. Paths that do not exist are cached as well, Swiss probes the same missing
+// cheats, configs and banners over and over. The server's own mutating commands drop the affected
+// entries, changes made outside of the server are picked up once an entry is too old.
+class PathCache
+{
+public:
+	static const size_t MAX_ENTRIES = 4096;
+	static constexpr std::chrono::steady_clock::duration MAX_AGE = std::chrono::seconds(5);
+	static constexpr std::chrono::steady_clock::duration NOT_FOUND_MAX_AGE = std::chrono::seconds(1);
+
+	// Key of the lookup of subPath for a regular file or a directory
+	static std::string getKey(const std::string& subPath, std::filesystem::file_type type);
+
+	// True if the lookup is cached, path is empty if it does not exist or may not be read
+	static bool find(const std::string& key, std::filesystem::path& path);
+	static void insert(const std::string& key, const std::filesystem::path& path);
+
+	// CC_STAT response of a cached regular file, empty until it has been stored
+	static bool findStat(const std::string& key, std::vector<uint8_t>& response);
+	static void insertStat(const std::string& key, const std::vector<uint8_t>& response);
+
+	// Drops path and everything below it, as well as every path cached as not found
+	static void invalidate(const std::filesystem::path& path);
+
+private:
+	struct Entry
+	{
+		std::string key;
+		std::filesystem::path path;
+		std::vector<uint8_t> stat;
+		std::chrono::steady_clock::time_point expires;
+	};
+
+	static std::mutex mutex;
+
+	// Most recently used first
+	static std::list<Entry> entries;
+	static std::unordered_map<std::string, std::list<Entry>::iterator> index;
+
+	// Called with the mutex held, expired entries are erased
+	static std::list<Entry>::iterator lookup(const std::string& key);
+};
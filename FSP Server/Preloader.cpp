@@ -0,0 +1,335 @@
+#include "Preloader.h"
+#include "FspHelper.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+uint64_t Preloader::budget = 4096ULL * 1024 * 1024;
+bool Preloader::lockPages = false;
+std::mutex Preloader::mutex;
+std::condition_variable Preloader::condition;
+std::vector<std::shared_ptr<Preloader::Entry>> Preloader::entries;
+std::deque<std::pair<std::shared_ptr<Preloader::Entry>, uint64_t>> Preloader::chunks;
+std::vector<std::thread> Preloader::threads;
+uint64_t Preloader::reserved = 0;
+std::atomic<bool> Preloader::lockFailed = false;
+
+bool Preloader::loadList(const std::filesystem::path& listPath)
+{
+	std::ifstream stream(listPath);
+	if (!stream.is_open()) {
+		std::cout << "Error: Could not open preload list \"" << listPath.string() << "\"" << std::endl;
+		return false;
+	}
+
+	std::string line;
+	while (std::getline(stream, line)) {
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		line.erase(0, line.find_first_not_of(" \t"));
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		uint64_t prefix = 0;
+		if (parsePrefix(line, prefix)) {
+			add(line, prefix);
+		}
+	}
+
+	return true;
+}
+
+bool Preloader::parsePrefix(std::string& line, uint64_t& prefix)
+{
+	// A trailing number is the prefix in MiB
+	prefix = 0;
+	size_t separator = line.find_last_of(" \t");
+	if (separator == std::string::npos || line.find_first_not_of("0123456789", separator + 1) != std::string::npos) {
+		return true;
+	}
+
+	uint64_t megabytes = 0;
+	auto result = std::from_chars(line.data() + separator + 1, line.data() + line.size(), megabytes);
+	if (result.ec != std::errc() || (UINT64_MAX >> 20) < megabytes) {
+		std::cout << "Error: Invalid preload size \"" << line.substr(separator + 1) << "\" MiB" << std::endl;
+		return false;
+	}
+
+	prefix = megabytes * 1024 * 1024;
+	line.erase(line.find_last_not_of(" \t", separator) + 1);
+	return true;
+}
+
+void Preloader::add(const std::string& subPath, uint64_t prefix)
+{
+	auto entry = std::make_shared<Entry>();
+	try
+	{
+		entry->path = FspHelper::getCompletePath(subPath, { std::filesystem::file_type::regular });
+	}
+	catch (const std::exception&)
+	{
+		std::cout << "Error: Could not preload \"" << subPath << "\", file not found" << std::endl;
+		return;
+	}
+
+	if (!open(*entry, prefix)) {
+		std::cout << "Error: Could not open \"" << subPath << "\" for preloading" << std::endl;
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (const auto& existing : entries) {
+		if (existing->path == entry->path) {
+			// The budget would be reserved a second time for the same pages
+			std::cout << "\"" << subPath << "\" is already preloaded" << std::endl;
+			return;
+		}
+	}
+
+	if (budget - reserved < entry->length) {
+		std::cout << "Preload budget exhausted, only " << (budget - reserved) / (1024 * 1024) << " MiB of \"" << subPath << "\" are preloaded" << std::endl;
+		entry->length = budget - reserved;
+	}
+
+	reserved += entry->length;
+	entries.push_back(entry);
+
+	for (uint64_t offset = 0; offset < entry->length; offset += CHUNK_SIZE) {
+		entry->pendingChunks++;
+		chunks.emplace_back(entry, offset);
+	}
+
+	if (threads.empty()) {
+		for (size_t i = 0; i < THREAD_COUNT; i++) {
+			threads.emplace_back(worker);
+			threads.back().detach();
+		}
+	}
+
+	condition.notify_all();
+}
+
+void Preloader::worker()
+{
+	while (true) {
+		std::shared_ptr<Entry> entry;
+		uint64_t offset;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, []() { return !chunks.empty(); });
+			entry = chunks.front().first;
+			offset = chunks.front().second;
+			chunks.pop_front();
+		}
+
+		size_t length = static_cast<size_t>(std::min<uint64_t>(CHUNK_SIZE, entry->length - offset));
+		loadChunk(*entry, offset, length);
+		entry->loaded += length;
+
+		if (--entry->pendingChunks == 0) {
+			std::ostringstream message;
+			message << "Preloaded \"" << entry->path.filename().string() << "\": " << entry->length / (1024 * 1024) << " MiB, "
+				<< getResidentBytes(*entry) / (1024 * 1024) << " MiB resident" << (lockPages && !lockFailed ? ", locked" : "") << "\n";
+			std::cout << message.str() << std::flush;
+		}
+	}
+}
+
+void Preloader::printStatus()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	uint64_t loaded = 0;
+	uint64_t resident = 0;
+	for (const auto& entry : entries) {
+		uint64_t entryResident = getResidentBytes(*entry);
+		loaded += entry->loaded;
+		resident += entryResident;
+		std::cout << "    " << entry->path.filename().string() << ": " << entry->loaded / (1024 * 1024) << " of " << entry->length / (1024 * 1024) << " MiB loaded, "
+			<< entryResident / (1024 * 1024) << " MiB resident" << std::endl;
+	}
+
+	std::cout << "Preload: " << loaded / (1024 * 1024) << " of " << reserved / (1024 * 1024) << " MiB loaded, " << resident / (1024 * 1024)
+		<< " MiB resident, budget " << budget / (1024 * 1024) << " MiB" << std::endl;
+}
+
+void Preloader::readCommands()
+{
+	std::string line;
+	while (std::getline(std::cin, line)) {
+		std::istringstream stream(line);
+		std::string command;
+		stream >> command;
+
+		if (command == "preload") {
+			std::string arguments;
+			std::getline(stream >> std::ws, arguments);
+			arguments.erase(arguments.find_last_not_of(" \t\r") + 1);
+
+			uint64_t prefix = 0;
+			if (!parsePrefix(arguments, prefix)) {
+				continue;
+			}
+
+			if (arguments.empty()) {
+				std::cout << "Usage: preload [file] [MiB]" << std::endl;
+				continue;
+			}
+
+			add(arguments, prefix);
+		}
+		else if (command == "status")
+		{
+			printStatus();
+		}
+		else if (!command.empty())
+		{
+			std::cout << "Unknown command \"" << command << "\", available: preload [file] [MiB], status" << std::endl;
+		}
+	}
+}
+
+#ifdef _WIN32
+Preloader::Entry::~Entry()
+{
+	if (handle != nullptr && handle != INVALID_HANDLE_VALUE) {
+		CloseHandle(handle);
+	}
+}
+
+bool Preloader::open(Entry& entry, uint64_t prefix)
+{
+	entry.handle = CreateFileW(entry.path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	LARGE_INTEGER fileSize;
+	if (entry.handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(entry.handle, &fileSize)) {
+		return false;
+	}
+
+	entry.length = static_cast<uint64_t>(fileSize.QuadPart);
+	if (0 < prefix) {
+		entry.length = std::min(entry.length, prefix);
+	}
+
+	return true;
+}
+
+void Preloader::loadChunk(Entry& entry, uint64_t offset, size_t length)
+{
+	// Reading the file fills the standby list, pages can not be pinned without mapping the file
+	if (lockPages && !lockFailed.exchange(true)) {
+		std::cout << "Locking preloaded files is not supported on this platform" << std::endl;
+	}
+
+	thread_local std::vector<char> buffer(CHUNK_SIZE);
+	OVERLAPPED overlapped = {};
+	overlapped.Offset = static_cast<DWORD>(offset & 0xFFFFFFFF);
+	overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+	DWORD bytesRead = 0;
+	ReadFile(entry.handle, buffer.data(), static_cast<DWORD>(length), &bytesRead, &overlapped);
+}
+
+uint64_t Preloader::getResidentBytes(const Entry& entry)
+{
+	return entry.loaded;
+}
+#else
+Preloader::Entry::~Entry()
+{
+	if (mapping != nullptr) {
+		munmap(mapping, mappedLength);
+	}
+
+	if (0 <= descriptor) {
+		close(descriptor);
+	}
+}
+
+bool Preloader::open(Entry& entry, uint64_t prefix)
+{
+	entry.descriptor = ::open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat status;
+	if (entry.descriptor < 0 || fstat(entry.descriptor, &status) != 0) {
+		return false;
+	}
+
+	entry.length = static_cast<uint64_t>(status.st_size);
+	if (0 < prefix) {
+		entry.length = std::min(entry.length, prefix);
+	}
+
+	if (entry.length == 0) {
+		return true;
+	}
+
+	// Only the preloaded prefix is mapped and kept for as long as the server runs, locked pages stay pinned through the mapping
+	void* area = mmap(nullptr, entry.length, PROT_READ, MAP_SHARED, entry.descriptor, 0);
+	if (area == MAP_FAILED) {
+		return false;
+	}
+
+	entry.mapping = static_cast<char*>(area);
+	entry.mappedLength = entry.length;
+	return true;
+}
+
+void Preloader::loadChunk(Entry& entry, uint64_t offset, size_t length)
+{
+	char* start = entry.mapping + offset;
+	if (lockPages && !lockFailed) {
+		if (mlock(start, length) == 0) {
+			return;
+		}
+
+		if (!lockFailed.exchange(true)) {
+			std::cout << "Error: Could not lock preloaded files, RLIMIT_MEMLOCK may be too low. Error: " << std::strerror(errno) << std::endl;
+		}
+	}
+
+	// Read through the descriptor rather than the mapping, touching pages of a file truncated in the meantime raises SIGBUS
+	thread_local std::vector<char> buffer(CHUNK_SIZE);
+	size_t position = 0;
+	while (position < length) {
+		ssize_t bytesRead = pread(entry.descriptor, buffer.data(), length - position, static_cast<off_t>(offset + position));
+		if (bytesRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (bytesRead <= 0) {
+			break;
+		}
+
+		position += static_cast<size_t>(bytesRead);
+	}
+}
+
+uint64_t Preloader::getResidentBytes(const Entry& entry)
+{
+	if (entry.mapping == nullptr) {
+		return 0;
+	}
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	size_t pages = static_cast<size_t>((entry.length + pageSize - 1) / pageSize);
+	std::vector<unsigned char> residency(pages);
+	if (mincore(entry.mapping, entry.length, residency.data()) != 0) {
+		return 0;
+	}
+
+	uint64_t residentPages = std::count_if(residency.begin(), residency.end(), [](unsigned char page) { return (page & 1) != 0; });
+	return std::min<uint64_t>(residentPages * pageSize, entry.length);
+}
+#endif
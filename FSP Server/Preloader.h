@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Reads configured images, or their first bytes, into memory before they are requested, so the first
+// boot of a title is served from the page cache. Files are split into chunks that several threads read
+// in parallel, pages can additionally be pinned with mlock() (Linux). The memory budget limits the sum
+// of everything queued.
+class Preloader
+{
+public:
+	// Bytes all preloaded files may take up
+	static uint64_t budget;
+	static bool lockPages;
+
+	static const size_t THREAD_COUNT = 4;
+	static const size_t CHUNK_SIZE = 8 * 1024 * 1024;
+
+	// One file per line relative to the served directory, optionally followed by the prefix in MiB to preload
+	static bool loadList(const std::filesystem::path& listPath);
+
+	// Queues a file, a prefix of 0 preloads all of it
+	static void add(const std::string& subPath, uint64_t prefix);
+
+	static void printStatus();
+
+	// Serves "preload [file] [MiB]" and "status" commands from the console until stdin closes
+	static void readCommands();
+
+private:
+	// Owns the opened file, an entry that fails to open or is refused releases it again
+	struct Entry
+	{
+		std::filesystem::path path;
+		uint64_t length = 0;
+		std::atomic<uint64_t> loaded = 0;
+		std::atomic<size_t> pendingChunks = 0;
+#ifdef _WIN32
+		void* handle = nullptr;
+#else
+		int descriptor = -1;
+		char* mapping = nullptr;
+
+		// The budget may shorten length after the file was mapped
+		uint64_t mappedLength = 0;
+#endif
+
+		Entry() = default;
+		~Entry();
+		Entry(const Entry&) = delete;
+		Entry& operator=(const Entry&) = delete;
+	};
+
+	static std::mutex mutex;
+	static std::condition_variable condition;
+	static std::vector<std::shared_ptr<Entry>> entries;
+	static std::deque<std::pair<std::shared_ptr<Entry>, uint64_t>> chunks;
+	static std::vector<std::thread> threads;
+	static uint64_t reserved;
+	static std::atomic<bool> lockFailed;
+
+	// Splits a trailing number of MiB off line, false after printing a message if it is too large
+	static bool parsePrefix(std::string& line, uint64_t& prefix);
+
+	static bool open(Entry& entry, uint64_t prefix);
+	static void worker();
+	static void loadChunk(Entry& entry, uint64_t offset, size_t length);
+	static uint64_t getResidentBytes(const Entry& entry);
+};
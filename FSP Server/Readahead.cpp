@@ -0,0 +1,59 @@
+#include "Readahead.h"
+#include "FspStats.h"
+#include <algorithm>
+
+uint32_t Readahead::maxWindow = 4 * 1024 * 1024;
+
+void Readahead::access(const FileHandle& file, uint64_t position, size_t length)
+{
+	if (maxWindow == 0) {
+		return;
+	}
+
+	// Retransmissions repeat the previous position and do not break a run
+	if (fileId == file.id && position == lastPosition && position != nextPosition) {
+		return;
+	}
+
+	bool sequential = fileId == file.id && position == nextPosition;
+	bool hit = sequential && position + length <= prefetchedEnd;
+	(hit ? FspStats::readaheadHits : FspStats::readaheadMisses).fetch_add(1, std::memory_order_relaxed);
+
+	if (!sequential) {
+		// Seek or different file, readahead starts over once the new run continues
+		fileId = file.id;
+		window = 0;
+		prefetchedEnd = 0;
+	}
+	else if (window == 0) {
+		// Second block of a run, the first window is issued right away
+		prefetchedEnd = position + length;
+	}
+
+	lastPosition = position;
+	nextPosition = position + length;
+
+	// The next window is requested once half of the current one has been consumed, so
+	// reading it overlaps with serving the rest
+	if (!sequential || file.size <= prefetchedEnd || nextPosition + window / 2 < prefetchedEnd) {
+		return;
+	}
+
+	// Every window that was consumed up to its trigger point doubles the next one
+	window = window == 0 ? std::min(MIN_WINDOW, maxWindow) : std::min(window * 2, maxWindow);
+	uint64_t start = std::max(prefetchedEnd, nextPosition);
+	uint64_t end = std::min<uint64_t>(nextPosition + window, file.size);
+	if (start < end) {
+		file.prefetch(start, end - start);
+		prefetchedEnd = end;
+		FspStats::readaheadCalls.fetch_add(1, std::memory_order_relaxed);
+		FspStats::readaheadBytes.fetch_add(end - start, std::memory_order_relaxed);
+	}
+}
+
+void Readahead::reset()
+{
+	fileId.reset();
+	window = 0;
+	prefetchedEnd = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include "FileHandleCache.h"
+
+// Detects sequential runs of CC_GET_FILE requests of a client and asks the kernel to read
+// the following window in the background, so the next blocks are already in the page cache
+// when they are requested. The window doubles on every hit and is dropped on a seek.
+class Readahead
+{
+public:
+	// Largest window in bytes, 0 disables readahead
+	static uint32_t maxWindow;
+
+	static const uint32_t MIN_WINDOW = 64 * 1024;
+
+	// Called for every block served, before it is read
+	void access(const FileHandle& file, uint64_t position, size_t length);
+	void reset();
+
+private:
+	// FileHandle::id of the file the run belongs to, a freed handle's address may be reused by another file
+	std::optional<uint64_t> fileId;
+
+	uint64_t lastPosition = 0;
+	uint64_t nextPosition = 0;
+
+	// End of the range already handed to the kernel
+	uint64_t prefetchedEnd = 0;
+	uint32_t window = 0;
+};
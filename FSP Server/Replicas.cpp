@@ -0,0 +1,182 @@
+#include "Replicas.h"
+#include "FileHandleCache.h"
+#include "FspHelper.h"
+#include "UdpSocket.h"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+std::vector<std::filesystem::path> Replicas::roots;
+std::vector<std::unique_ptr<Replicas::Replica>> Replicas::replicas;
+std::atomic<uint64_t> Replicas::generation = 0;
+
+void Replicas::start()
+{
+	if (roots.empty()) {
+		return;
+	}
+
+	roots.insert(roots.begin(), UdpSocket::basePath);
+	for (const auto& root : roots) {
+		auto replica = std::make_unique<Replica>();
+		replica->root = FspHelper::normalize(root);
+#ifndef _WIN32
+		struct stat status;
+		if (stat(replica->root.c_str(), &status) == 0) {
+			replica->device = static_cast<uint64_t>(status.st_dev);
+		}
+#endif
+		std::cout << "Replica \"" << replica->root.string() << "\"" << std::endl;
+		replicas.push_back(std::move(replica));
+	}
+
+#ifndef _WIN32
+	std::thread(sample).detach();
+#endif
+}
+
+bool Replicas::isEnabled()
+{
+	return !replicas.empty();
+}
+
+std::filesystem::path Replicas::getRelativePath(const std::filesystem::path& path)
+{
+	std::filesystem::path relative = path.lexically_relative(replicas.front()->root);
+	if (relative.empty() || *relative.begin() == "..") {
+		return {};
+	}
+
+	return relative;
+}
+
+bool Replicas::isMirrored(const std::filesystem::path& original, const std::filesystem::path& copy)
+{
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(copy, error);
+	if (error || size != std::filesystem::file_size(original, error) || error) {
+		return false;
+	}
+
+	auto modified = std::filesystem::last_write_time(copy, error);
+	return !error && modified == std::filesystem::last_write_time(original, error) && !error;
+}
+
+void Replicas::invalidate(const std::filesystem::path& path)
+{
+	if (!isEnabled()) {
+		return;
+	}
+
+	std::filesystem::path relative = getRelativePath(path);
+	if (relative.empty()) {
+		return;
+	}
+
+	generation.fetch_add(1, std::memory_order_release);
+	for (size_t i = 1; i < replicas.size(); i++) {
+		FileHandleCache::invalidate(relative == "." ? replicas[i]->root : replicas[i]->root / relative);
+	}
+}
+
+uint32_t Replicas::Replica::getLoad() const
+{
+	return clients.load(std::memory_order_relaxed) + deviceInFlight.load(std::memory_order_relaxed);
+}
+
+void Replicas::sample()
+{
+#ifndef _WIN32
+	// The queue depth of a disk is only visible to the kernel, it is read from sysfs in short intervals
+	while (true) {
+		for (const auto& replica : replicas) {
+			std::ifstream stream("/sys/dev/block/" + std::to_string(major(replica->device)) + ":" + std::to_string(minor(replica->device)) + "/inflight");
+			uint32_t reads = 0;
+			uint32_t writes = 0;
+			if (stream >> reads >> writes) {
+				replica->deviceInFlight.store(reads + writes, std::memory_order_relaxed);
+			}
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+#endif
+}
+
+ReplicaRoute::~ReplicaRoute()
+{
+	select(nullptr);
+}
+
+const std::filesystem::path& ReplicaRoute::route(const std::filesystem::path& path)
+{
+	if (!Replicas::isEnabled()) {
+		return path;
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	uint64_t currentGeneration = Replicas::generation.load(std::memory_order_acquire);
+	bool sameFile = replica != nullptr && path == file && generation == currentGeneration;
+	if (sameFile && now - lastCheck < REBALANCE_INTERVAL) {
+		return routedFile;
+	}
+
+	lastCheck = now;
+	generation = currentGeneration;
+
+	// Files outside of the served directory, e.g. copies in the fast tier, are not mirrored
+	std::filesystem::path relative = Replicas::getRelativePath(path);
+	if (relative.empty()) {
+		select(nullptr);
+		return path;
+	}
+
+	Replicas::Replica* best = nullptr;
+	for (const auto& candidate : Replicas::replicas) {
+		if (best == nullptr || candidate->getLoad() < best->getLoad()) {
+			best = candidate.get();
+		}
+	}
+
+	// The own read does not count against the current replica
+	if (sameFile && replica->getLoad() <= best->getLoad() + REBALANCE_MARGIN) {
+		return routedFile;
+	}
+
+	// Files the server changed are read from the served directory until the replica caught up
+	std::filesystem::path target = best->root / relative;
+	if (best != Replicas::replicas.front().get() && !Replicas::isMirrored(path, target)) {
+		best = Replicas::replicas.front().get();
+		target = path;
+	}
+
+	select(best);
+	file = path;
+	routedFile = target;
+	return routedFile;
+}
+
+void ReplicaRoute::select(Replicas::Replica* target)
+{
+	if (replica == target) {
+		return;
+	}
+
+	if (replica != nullptr) {
+		replica->clients.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	if (target != nullptr) {
+		target->clients.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	replica = target;
+	if (target == nullptr) {
+		file.clear();
+	}
+}
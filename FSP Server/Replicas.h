@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+// Directories on independent disks that mirror the served directory. Reads of a client are routed to
+// the replica with the fewest pending requests, so consoles booting at the same time spread their
+// reads across the disks. The load of a replica is the number of clients reading from it plus the
+// requests its block device has in flight (Linux). Listings, stats and writes use the served directory.
+class Replicas
+{
+public:
+	static std::vector<std::filesystem::path> roots;
+
+	// Samples the block devices of all roots, the served directory is the first root
+	static void start();
+
+	static bool isEnabled();
+
+	// Called whenever the server changes path, which only changes the served directory. Handles of the
+	// mirrored files below it are dropped and every client chooses its replica again.
+	static void invalidate(const std::filesystem::path& path);
+
+	struct Replica
+	{
+		std::filesystem::path root;
+		uint64_t device = 0;
+		std::atomic<uint32_t> clients = 0;
+		std::atomic<uint32_t> deviceInFlight = 0;
+
+		uint32_t getLoad() const;
+	};
+
+private:
+	friend class ReplicaRoute;
+
+	static std::vector<std::unique_ptr<Replica>> replicas;
+
+	// Bumped by invalidate(), routes chosen before are checked again
+	static std::atomic<uint64_t> generation;
+
+	static void sample();
+
+	// Path relative to the served directory, empty if it is outside of it. Expects a normalized path, see FspHelper::normalize
+	static std::filesystem::path getRelativePath(const std::filesystem::path& path);
+
+	// Replicas that are still being synchronized may lack the file or hold an older version
+	static bool isMirrored(const std::filesystem::path& original, const std::filesystem::path& copy);
+};
+
+// Replica a client reads the current file from, it stays on it while the load is balanced
+class ReplicaRoute
+{
+public:
+	// Load difference at which a client moves to a less loaded replica
+	static const uint32_t REBALANCE_MARGIN = 2;
+	static constexpr std::chrono::steady_clock::duration REBALANCE_INTERVAL = std::chrono::milliseconds(100);
+
+	ReplicaRoute() = default;
+	~ReplicaRoute();
+	ReplicaRoute(const ReplicaRoute&) = delete;
+	ReplicaRoute& operator=(const ReplicaRoute&) = delete;
+
+	// Maps a file of the served directory to the same file on the chosen replica
+	const std::filesystem::path& route(const std::filesystem::path& path);
+
+private:
+	Replicas::Replica* replica = nullptr;
+	std::filesystem::path file;
+	std::filesystem::path routedFile;
+	std::chrono::steady_clock::time_point lastCheck;
+	uint64_t generation = 0;
+
+	void select(Replicas::Replica* target);
+};
@@ -0,0 +1,362 @@
+#include "StorageTier.h"
+#include "FspHelper.h"
+#include "FspStats.h"
+#include "UdpSocket.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+std::filesystem::path StorageTier::fastDirectory;
+uint64_t StorageTier::capacity = 0;
+std::filesystem::path StorageTier::root;
+std::shared_mutex StorageTier::mutex;
+std::unordered_map<std::string, StorageTier::Copy> StorageTier::copies;
+uint64_t StorageTier::usedBytes = 0;
+std::mutex StorageTier::scoreMutex;
+std::unordered_map<std::string, uint64_t> StorageTier::scores;
+std::atomic<uint64_t> StorageTier::generation = 0;
+
+void StorageTier::start()
+{
+	if (fastDirectory.empty()) {
+		return;
+	}
+
+	root = FspHelper::normalize(UdpSocket::basePath);
+	fastDirectory = FspHelper::normalize(fastDirectory);
+
+	// Copies inside the served directory would show up in its listings
+	std::filesystem::path relative = fastDirectory.lexically_relative(root);
+	if (!relative.empty() && *relative.begin() != "..") {
+		std::cout << "Error: The fast tier must not be inside the served directory, tiering is disabled" << std::endl;
+		fastDirectory.clear();
+		return;
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories(fastDirectory, error);
+	adopt();
+
+	if (capacity == 0) {
+		// A tenth of the free space is left to the rest of the system
+		std::filesystem::space_info space = std::filesystem::space(fastDirectory, error);
+		capacity = error ? 0 : usedBytes + space.available / 10 * 9;
+	}
+
+	std::cout << "Fast tier \"" << fastDirectory.string() << "\": " << copies.size() << " copies adopted, "
+		<< usedBytes / (1024 * 1024) << " of " << capacity / (1024 * 1024) << " MiB used" << std::endl;
+
+	std::thread(migrate).detach();
+}
+
+void StorageTier::adopt()
+{
+	std::error_code error;
+	std::vector<std::filesystem::path> outdated;
+	for (std::filesystem::recursive_directory_iterator iterator(fastDirectory, std::filesystem::directory_options::skip_permission_denied, error), end; iterator != end; iterator.increment(error)) {
+		if (error) {
+			break;
+		}
+
+		if (!iterator->is_regular_file(error)) {
+			continue;
+		}
+
+		// Only copies of unchanged originals are kept, unfinished copies end in .fsptier
+		std::filesystem::path original = root / iterator->path().lexically_relative(fastDirectory);
+		uint64_t size = iterator->file_size(error);
+		std::filesystem::file_time_type modified = iterator->last_write_time(error);
+		bool current = iterator->path().extension() != ".fsptier"
+			&& std::filesystem::is_regular_file(original, error)
+			&& std::filesystem::file_size(original, error) == size
+			&& std::filesystem::last_write_time(original, error) == modified;
+
+		if (current && !error) {
+			copies.try_emplace(getKey(original), iterator->path(), size, modified);
+			usedBytes += size;
+		}
+		else
+		{
+			outdated.push_back(iterator->path());
+		}
+	}
+
+	for (const auto& path : outdated) {
+		std::filesystem::remove(path, error);
+	}
+}
+
+std::string StorageTier::getKey(const std::filesystem::path& path)
+{
+	std::filesystem::path relative = path.lexically_relative(root);
+	if (relative.empty() || relative == "." || *relative.begin() == "..") {
+		return "";
+	}
+
+	return relative.generic_string();
+}
+
+std::filesystem::path StorageTier::resolve(const std::filesystem::path& path)
+{
+	if (fastDirectory.empty()) {
+		return path;
+	}
+
+	std::filesystem::path copyPath;
+	uint64_t size = 0;
+	std::filesystem::file_time_type modified;
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex);
+		if (copies.empty()) {
+			return path;
+		}
+
+		auto iterator = copies.find(getKey(path));
+		if (iterator == copies.end()) {
+			return path;
+		}
+
+		Copy& copy = iterator->second;
+		auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+		auto last = copy.lastCheck.load(std::memory_order_relaxed);
+		if (now - last < REVALIDATE_INTERVAL.count() || !copy.lastCheck.compare_exchange_strong(last, now)) {
+			return copy.path;
+		}
+
+		copyPath = copy.path;
+		size = copy.size;
+		modified = copy.modified;
+	}
+
+	// Originals changed outside of the server no longer match their copy
+	std::error_code error;
+	bool unchanged = std::filesystem::file_size(path, error) == size && !error
+		&& std::filesystem::last_write_time(path, error) == modified && !error;
+	if (!unchanged) {
+		invalidate(path);
+		return path;
+	}
+
+	return copyPath;
+}
+
+std::filesystem::path StorageTier::getOriginalPath(const std::filesystem::path& path)
+{
+	if (fastDirectory.empty()) {
+		return path;
+	}
+
+	std::filesystem::path relative = path.lexically_relative(fastDirectory);
+	if (relative.empty() || *relative.begin() == "..") {
+		return path;
+	}
+
+	return root / relative;
+}
+
+void StorageTier::invalidate(const std::filesystem::path& path)
+{
+	if (fastDirectory.empty()) {
+		return;
+	}
+
+	// Paths outside of the served directory have no copies, only the served directory itself drops all of them
+	std::string prefix = getKey(path);
+	if (prefix.empty() && path.lexically_relative(root) != ".") {
+		return;
+	}
+
+	std::vector<std::filesystem::path> removed;
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		generation++;
+
+		auto iterator = copies.begin();
+		while (iterator != copies.end()) {
+			const std::string& key = iterator->first;
+			bool below = prefix.empty() || key == prefix || (prefix.size() < key.size() && key.compare(0, prefix.size(), prefix) == 0 && key[prefix.size()] == '/');
+			if (below) {
+				removed.push_back(iterator->second.path);
+				usedBytes -= iterator->second.size;
+				iterator = copies.erase(iterator);
+			}
+			else
+			{
+				++iterator;
+			}
+		}
+	}
+
+	std::error_code error;
+	for (const auto& copy : removed) {
+		FileHandleCache::invalidate(copy);
+		std::filesystem::remove(copy, error);
+	}
+}
+
+void StorageTier::access(const FileHandle& file, size_t length)
+{
+	if (fastDirectory.empty()) {
+		return;
+	}
+
+	if (fileId != file.id) {
+		flush();
+		fileId = file.id;
+		key = getKey(getOriginalPath(file.path));
+	}
+
+	pendingBytes += length;
+	if (FLUSH_BYTES <= pendingBytes) {
+		flush();
+	}
+}
+
+void StorageTier::flush()
+{
+	if (!key.empty() && 0 < pendingBytes) {
+		std::lock_guard<std::mutex> lock(scoreMutex);
+		scores[key] += pendingBytes;
+	}
+
+	pendingBytes = 0;
+}
+
+void StorageTier::migrate()
+{
+	while (true) {
+		std::this_thread::sleep_for(std::chrono::seconds(MIGRATE_INTERVAL));
+
+		// Halving the scores on every pass lets files that are no longer played cool down
+		std::unordered_map<std::string, uint64_t> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(scoreMutex);
+			snapshot = scores;
+			for (auto iterator = scores.begin(); iterator != scores.end();) {
+				iterator->second /= 2;
+				iterator = iterator->second == 0 ? scores.erase(iterator) : std::next(iterator);
+			}
+		}
+
+		std::vector<std::pair<std::string, uint64_t>> candidates;
+		{
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			for (const auto& [key, score] : snapshot) {
+				if (MIN_PROMOTE_BYTES <= score && copies.find(key) == copies.end()) {
+					candidates.emplace_back(key, score);
+				}
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.second > b.second; });
+		for (const auto& [key, score] : candidates) {
+			promote(key, score, snapshot);
+		}
+	}
+}
+
+bool StorageTier::promote(const std::string& key, uint64_t score, const std::unordered_map<std::string, uint64_t>& snapshot)
+{
+	std::filesystem::path original = root / key;
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(original, error);
+	if (error || capacity < size) {
+		return false;
+	}
+
+	// Copies are only displaced by files read at least twice as much, so two files do not take turns
+	while (true) {
+		std::string victim;
+		uint64_t victimScore = score / 2;
+		{
+			std::shared_lock<std::shared_mutex> lock(mutex);
+			if (usedBytes + size <= capacity) {
+				break;
+			}
+
+			for (const auto& [copyKey, copy] : copies) {
+				auto iterator = snapshot.find(copyKey);
+				uint64_t copyScore = iterator == snapshot.end() ? 0 : iterator->second;
+				if (copyScore < victimScore) {
+					victim = copyKey;
+					victimScore = copyScore;
+				}
+			}
+		}
+
+		if (victim.empty()) {
+			return false;
+		}
+
+		demote(victim);
+	}
+
+	uint64_t startGeneration = generation;
+	std::filesystem::file_time_type modified = std::filesystem::last_write_time(original, error);
+	std::filesystem::path target = fastDirectory / std::filesystem::path(key);
+	std::filesystem::path temporaryPath = target;
+	temporaryPath += ".fsptier";
+
+	// The copy keeps the modification time of the original, so it can be recognized after a restart
+	std::filesystem::create_directories(target.parent_path(), error);
+	if (!std::filesystem::copy_file(original, temporaryPath, std::filesystem::copy_options::overwrite_existing, error)) {
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+
+	std::filesystem::last_write_time(temporaryPath, modified, error);
+	bool unchanged = std::filesystem::file_size(original, error) == size && std::filesystem::last_write_time(original, error) == modified;
+	if (!unchanged || error) {
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		if (generation != startGeneration) {
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+
+		std::filesystem::rename(temporaryPath, target, error);
+		if (error) {
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+
+		copies.try_emplace(key, target, size, modified);
+		usedBytes += size;
+	}
+
+	// Clients reopen the file and are redirected to the copy
+	FileHandleCache::invalidate(original);
+	FspStats::tierPromotions++;
+	std::cout << "Promoted \"" << key << "\" to the fast tier" << std::endl;
+	return true;
+}
+
+void StorageTier::demote(const std::string& key)
+{
+	std::filesystem::path copyPath;
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		auto iterator = copies.find(key);
+		if (iterator == copies.end()) {
+			return;
+		}
+
+		copyPath = iterator->second.path;
+		usedBytes -= iterator->second.size;
+		copies.erase(iterator);
+	}
+
+	// Clients that still read the copy keep their open handle until they reopen the original
+	FileHandleCache::invalidate(copyPath);
+	std::error_code error;
+	std::filesystem::remove(copyPath, error);
+	FspStats::tierDemotions++;
+	std::cout << "Demoted \"" << key << "\" from the fast tier" << std::endl;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include "FileHandleCache.h"
+
+// Moves the most read images of the served directory to a small fast tier, e.g. an SSD next to
+// a large HDD. Clients keep seeing the served directory only, reads of a promoted file are redirected
+// to its copy by FspHelper::getCompletePath. The served directory keeps the original, so demoting
+// a file only deletes the copy. Copies found in the fast tier at startup are adopted if the original
+// is unchanged.
+class StorageTier
+{
+public:
+	// Empty disables tiering
+	static std::filesystem::path fastDirectory;
+
+	// Bytes the copies may take up, 0 uses the free space of the fast tier
+	static uint64_t capacity;
+
+	// Bytes a file has to be read within about a minute before it is promoted
+	static const uint64_t MIN_PROMOTE_BYTES = 16 * 1024 * 1024;
+	static const uint32_t MIGRATE_INTERVAL = 30;
+
+	// Originals are compared with their copy at most this often, like FileHandle::isValid
+	static constexpr std::chrono::steady_clock::duration REVALIDATE_INTERVAL = std::chrono::seconds(1);
+
+	// Adopts existing copies and starts the migration thread
+	static void start();
+
+	// Path of the copy in the fast tier if path has been promoted and the original is unchanged, path otherwise.
+	// Paths given to StorageTier are normalized, see FspHelper::normalize.
+	static std::filesystem::path resolve(const std::filesystem::path& path);
+
+	// Maps a copy in the fast tier back to the file in the served directory
+	static std::filesystem::path getOriginalPath(const std::filesystem::path& path);
+
+	// Drops the copies of path and everything below it, called whenever the server changes files
+	static void invalidate(const std::filesystem::path& path);
+
+	// Called for every block served
+	void access(const FileHandle& file, size_t length);
+
+private:
+	// Reads are summed up per client and only then added to the shared counters
+	static const uint64_t FLUSH_BYTES = 1024 * 1024;
+
+	struct Copy
+	{
+		std::filesystem::path path;
+
+		// Size and modification time of the original when it was copied
+		uint64_t size;
+		std::filesystem::file_time_type modified;
+
+		std::atomic<int64_t> lastCheck = 0;
+	};
+
+	static std::filesystem::path root;
+	static std::shared_mutex mutex;
+
+	// Keyed by the generic path relative to the served directory
+	static std::unordered_map<std::string, Copy> copies;
+	static uint64_t usedBytes;
+
+	// Bytes read per file, halved on every migration pass
+	static std::mutex scoreMutex;
+	static std::unordered_map<std::string, uint64_t> scores;
+
+	// Bumped by invalidate(), a copy made in the meantime may be outdated
+	static std::atomic<uint64_t> generation;
+
+	// FileHandle::id of the file the pending bytes belong to, a freed handle's address may be reused by another file
+	std::optional<uint64_t> fileId;
+	std::string key;
+	uint64_t pendingBytes = 0;
+
+	void flush();
+
+	// Empty for the served directory itself and for paths outside of it
+	static std::string getKey(const std::filesystem::path& path);
+	static void adopt();
+	static void migrate();
+	static bool promote(const std::string& key, uint64_t score, const std::unordered_map<std::string, uint64_t>& snapshot);
+	static void demote(const std::string& key);
+};
@@ -0,0 +1,116 @@
+#include "ThreadPoolExecutor.h"
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+ThreadPoolExecutor::ThreadPoolExecutor(EventLoop& loop, size_t threadCount) : eventLoop(loop)
+{
+	notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (notifyFd < 0) {
+		throw std::runtime_error(std::string("eventfd() failed: ") + std::strerror(errno));
+	}
+
+	eventLoop.addReader(notifyFd, [this]() { drainCompletions(); });
+
+	running = true;
+	for (size_t i = 0; i < threadCount; i++) {
+		threads.emplace_back([this]() { worker(); });
+	}
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor()
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		running = false;
+	}
+
+	jobCondition.notify_all();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	eventLoop.removeReader(notifyFd);
+	close(notifyFd);
+}
+
+void ThreadPoolExecutor::read(int fd, void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback)
+{
+	auto result = std::make_shared<int>(0);
+	run([fd, buffer, length, offset, result]() {
+		ssize_t transferred = pread(fd, buffer, length, static_cast<off_t>(offset));
+		*result = transferred < 0 ? -errno : static_cast<int>(transferred);
+	}, [result, callback]() { callback(*result); });
+}
+
+void ThreadPoolExecutor::write(int fd, const void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback)
+{
+	auto result = std::make_shared<int>(0);
+	run([fd, buffer, length, offset, result]() {
+		ssize_t transferred = pwrite(fd, buffer, length, static_cast<off_t>(offset));
+		*result = transferred < 0 ? -errno : static_cast<int>(transferred);
+	}, [result, callback]() { callback(*result); });
+}
+
+void ThreadPoolExecutor::run(std::function<void()> work, std::function<void()> callback)
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		jobs.push_back([this, work, callback]() {
+			work();
+			complete(callback);
+		});
+	}
+
+	jobCondition.notify_one();
+}
+
+void ThreadPoolExecutor::worker()
+{
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobCondition.wait(lock, [this]() { return !jobs.empty() || !running; });
+			if (jobs.empty()) {
+				return;
+			}
+
+			job = std::move(jobs.front());
+			jobs.pop_front();
+		}
+
+		job();
+	}
+}
+
+void ThreadPoolExecutor::complete(std::function<void()> completion)
+{
+	{
+		std::lock_guard<std::mutex> lock(completionMutex);
+		completions.push_back(std::move(completion));
+	}
+
+	uint64_t one = 1;
+	::write(notifyFd, &one, sizeof(one));
+}
+
+void ThreadPoolExecutor::drainCompletions()
+{
+	uint64_t count;
+	::read(notifyFd, &count, sizeof(count));
+
+	std::vector<std::function<void()>> ready;
+	{
+		std::lock_guard<std::mutex> lock(completionMutex);
+		ready.swap(completions);
+	}
+
+	for (auto& completion : ready) {
+		completion();
+	}
+}
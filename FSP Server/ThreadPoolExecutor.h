@@ -0,0 +1,38 @@
+#pragma once
+#include "AsyncExecutor.h"
+#include "EventLoop.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// AsyncExecutor that performs blocking I/O on a small set of helper threads
+// and hands the completions back to the EventLoop through an eventfd.
+class ThreadPoolExecutor : public AsyncExecutor
+{
+public:
+	ThreadPoolExecutor(EventLoop& loop, size_t threadCount);
+	~ThreadPoolExecutor() override;
+
+	void read(int fd, void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback) override;
+	void write(int fd, const void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback) override;
+	void run(std::function<void()> work, std::function<void()> callback) override;
+
+private:
+	EventLoop& eventLoop;
+	int notifyFd;
+	bool running;
+
+	std::vector<std::thread> threads;
+	std::mutex jobMutex;
+	std::condition_variable jobCondition;
+	std::deque<std::function<void()>> jobs;
+
+	std::mutex completionMutex;
+	std::vector<std::function<void()>> completions;
+
+	void worker();
+	void complete(std::function<void()> completion);
+	void drainCompletions();
+};
@@ -4,9 +4,41 @@
 #include <iostream>
 #include <vector>
 #include "FspHelper.h"
+#include "FspStats.h"
+#ifndef _WIN32
+#include "FspTask.h"
+#include "ThreadPoolExecutor.h"
+#include "UringLoop.h"
+#include "WorkerPool.h"
+#include "XdpSocket.h"
+#endif
 #include <span>
+#ifndef _WIN32
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
 
 std::filesystem::path UdpSocket::basePath;
+uint16_t UdpSocket::batchSize = 32;
+uint16_t UdpSocket::threads = 1;
+uint16_t UdpSocket::workers = 0;
+bool UdpSocket::ioUring = false;
+uint16_t UdpSocket::asyncThreads = 0;
+int UdpSocket::lowLatencyCore = -1;
+uint32_t UdpSocket::busyPoll = 0;
+std::string UdpSocket::xdpInterface;
+
+#ifndef _WIN32
+std::atomic<bool> UdpSocket::printsStats = false;
+std::atomic<uint16_t> UdpSocket::pinnedThreads = 0;
+std::atomic<bool> UdpSocket::xdpAttached = false;
+#endif
+
+#ifdef _WIN32
 std::vector<char> UdpSocket::messageBuffer(BUFLEN);
 
 UdpSocket::UdpSocket(uint32_t ipAddress, uint16_t port, std::string serverPassword)
@@ -26,7 +58,7 @@ UdpSocket::UdpSocket(uint32_t ipAddress, uint16_t port, std::string serverPasswo
 	//ioctlsocket(wSocket, FIONBIO, &mode);
 
 	server.sin_family = AF_INET;
-	server.sin_addr.s_addr = ipAddress;
+	server.sin_addr.s_addr = htonl(ipAddress);
 	server.sin_port = htons(port);
 
 	if (bind(wSocket, (sockaddr*)&server, sizeof(server)) == SOCKET_ERROR) {
@@ -64,23 +96,432 @@ void UdpSocket::listen()
 	}
 
 	if (0 < receivedBytes) {
+		FspStats::receiveCalls++;
+		FspStats::receivedPackets++;
+
+		messageBuffer.resize(receivedBytes);
+		std::vector<char> response = handleMessage(messageBuffer, client);
+		if (!response.empty()) {
+			sendto(wSocket, response.data(), static_cast<int>(response.size()), 0, (sockaddr*)&client, clientLength);
+			FspStats::sendCalls++;
+			FspStats::sentPackets++;
+		}
+
+		FspClient::cleanUp();
+	}
+
+	if (FspStats::isDue()) {
+		FspStats::print();
+	}
+}
+#else
+UdpSocket::UdpSocket(uint32_t ipAddress, uint16_t port, std::string serverPassword)
+{
+	wSocket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (wSocket < 0) {
+		std::cout << "Failed to create UDP socket. Error: " << std::strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	if (1 < threads) {
+		// Let the kernel distribute clients across all sockets bound to this address
+		int enable = 1;
+		if (setsockopt(wSocket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0) {
+			std::cout << "Could not enable SO_REUSEPORT. Error: " << std::strerror(errno) << std::endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	server = {};
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(ipAddress);
+	server.sin_port = htons(port);
+
+	if (bind(wSocket, (sockaddr*)&server, sizeof(server)) != 0) {
+		std::cout << "Could not bind socket. Error: " << std::strerror(errno) << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	std::cout << "Sock bind OK" << std::endl;
+	std::cout << "Listening on " << FspHelper::uInt32ToIpString(ipAddress, port) << std::endl;
+
+	client = {};
+	password = serverPassword;
+
+	size_t batch = batchSize < 1 ? 1 : batchSize;
+	receiveBuffer.resize(batch * BUFLEN);
+	receiveAddresses.resize(batch);
+	receiveVectors.resize(batch);
+	receiveHeaders.resize(batch);
+	received.reserve(batch);
+
+	if (0 <= lowLatencyCore) {
+		enableLowLatency();
+	}
+
+	if (ioUring && 0 <= lowLatencyCore) {
+		std::cout << "Low latency mode spins on the epoll backend, io_uring is not used." << std::endl;
+	}
+	else if (ioUring) {
 		try
 		{
-			messageBuffer.resize(receivedBytes);
-			FspPacket received = FspPacket(messageBuffer);
-			FspClient& fspClient = FspClient::getClient(client.sin_addr.s_addr, received.header.KEY);
-			auto responsePacket = received.process(fspClient, password);
-
-			if (responsePacket != nullptr) {
-				std::vector<char> response = responsePacket->getRawBytes();
-				sendto(wSocket, response.data(), response.size(), 0, (sockaddr*)&client, clientLength);
+			uringLoop = std::make_unique<UringLoop>(wSocket, password, eventLoop, batch, 0 < asyncThreads ? asyncThreads : 2);
+		}
+		catch (const std::exception& e)
+		{
+			std::cout << "Could not set up io_uring, falling back to epoll. " << e.what() << std::endl;
+		}
+	}
+
+	if (uringLoop == nullptr && 0 < workers) {
+		// Workers own the client state and expire their clients themselves
+		workerPool = std::make_unique<WorkerPool>(workers, [this](std::vector<Datagram>& datagrams) { processBatch(datagrams); });
+	}
+	else if (uringLoop == nullptr && 0 < asyncThreads) {
+		executor = std::make_unique<ThreadPoolExecutor>(eventLoop, asyncThreads);
+		eventLoop.addTimer(std::chrono::seconds(FspClient::CLEANUP_INTERVAL), []() { FspClient::cleanUp(); });
+	}
+	else
+	{
+		eventLoop.addTimer(std::chrono::seconds(FspClient::CLEANUP_INTERVAL), []() { FspClient::cleanUp(); });
+	}
+
+	if (!xdpInterface.empty() && !xdpAttached.exchange(true)) {
+		enableXdp(ipAddress, port);
+	}
+
+	if (uringLoop == nullptr && lowLatencyCore < 0) {
+		eventLoop.addReader(wSocket, [this]() { receive(); });
+	}
+	if (0 < FspStats::interval && !printsStats.exchange(true)) {
+		eventLoop.addTimer(std::chrono::seconds(FspStats::interval), []() { FspStats::print(); });
+	}
+}
+
+UdpSocket::~UdpSocket()
+{
+	if (xdpSocket != nullptr) {
+		eventLoop.removeReader(xdpSocket->getFd());
+		xdpSocket.reset();
+	}
+
+	eventLoop.removeReader(wSocket);
+	workerPool.reset();
+	uringLoop.reset();
+	executor.reset();
+	close(wSocket);
+}
+
+void UdpSocket::listen()
+{
+	if (uringLoop != nullptr) {
+		uringLoop->runOnce();
+		return;
+	}
+
+	if (0 <= lowLatencyCore) {
+		// Spin on the non-blocking socket, timers and completions are polled without waiting
+		receive();
+		if (xdpSocket != nullptr) {
+			xdpSocket->receive();
+		}
+
+		if (executor != nullptr || ++spins % LOW_LATENCY_TIMER_SPINS == 0) {
+			eventLoop.runOnce(0);
+		}
+	}
+	else
+	{
+		eventLoop.runOnce();
+	}
+
+	if (!completedResponses.empty()) {
+		sendBatch(completedResponses, completedResponses.size());
+		completedResponses.clear();
+	}
+}
+
+void UdpSocket::enableLowLatency()
+{
+	// Each socket thread gets a core of its own, starting at the configured one
+	int core = lowLatencyCore + pinnedThreads++;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	int result = EINVAL;
+	if (core < CPU_SETSIZE) {
+		CPU_SET(core, &cpus);
+		result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	if (result != 0) {
+		std::cout << "Could not pin socket thread to core " << core << ". Error: " << std::strerror(result) << std::endl;
+	}
+
+	if (0 < busyPoll) {
+		int busyPollTime = static_cast<int>(busyPoll);
+		if (setsockopt(wSocket, SOL_SOCKET, SO_BUSY_POLL, &busyPollTime, sizeof(busyPollTime)) != 0) {
+			std::cout << "Could not enable SO_BUSY_POLL. Error: " << std::strerror(errno) << std::endl;
+		}
+	}
+
+	if (workers == 0) {
+		size_t batch = receiveHeaders.size();
+		responseSlots.resize(batch);
+		for (Datagram& slot : responseSlots) {
+			slot.message.reserve(BUFLEN);
+		}
+	}
+}
+
+void UdpSocket::enableXdp(uint32_t ipAddress, uint16_t port)
+{
+	// Client state is thread local, the fast path has to share the socket thread with the regular handlers
+	if (uringLoop != nullptr || workerPool != nullptr || executor != nullptr) {
+		std::cout << "AF_XDP requires requests to be handled on the socket thread, it is not used with workers, coroutines or io_uring." << std::endl;
+		return;
+	}
+
+	// Other commands of a client would land on another shard with its own key and sequence state
+	if (1 < threads) {
+		std::cout << "AF_XDP requires all requests of a client to be handled by one thread, it is not used with more than one socket thread." << std::endl;
+		return;
+	}
+
+	try
+	{
+		xdpSocket = std::make_unique<XdpSocket>(xdpInterface, ipAddress, port,
+			[this](std::vector<char> message, const sockaddr_in& sender) { return handleMessage(std::move(message), sender); },
+			[this](const sockaddr_in& sender, std::vector<char> response) {
+				std::vector<Datagram> responses = { { std::move(response), sender, {} } };
+				sendBatch(responses, responses.size());
+			});
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Could not set up AF_XDP, all requests take the socket. " << e.what() << std::endl;
+		return;
+	}
+
+	std::cout << "AF_XDP fast path attached to " << xdpInterface << std::endl;
+	if (lowLatencyCore < 0) {
+		eventLoop.addReader(xdpSocket->getFd(), [this]() { xdpSocket->receive(); });
+	}
+}
+
+void UdpSocket::receive()
+{
+	size_t batch = receiveHeaders.size();
+
+	// Drain all pending datagrams before going back to epoll_wait()
+	while (true) {
+		for (size_t i = 0; i < batch; i++) {
+			receiveVectors[i].iov_base = receiveBuffer.data() + i * BUFLEN;
+			receiveVectors[i].iov_len = BUFLEN;
+			receiveHeaders[i] = {};
+			receiveHeaders[i].msg_hdr.msg_name = &receiveAddresses[i];
+			receiveHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+			receiveHeaders[i].msg_hdr.msg_iov = &receiveVectors[i];
+			receiveHeaders[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int count = recvmmsg(wSocket, receiveHeaders.data(), static_cast<unsigned int>(batch), MSG_DONTWAIT, nullptr);
+		if (count < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				return;
 			}
 
-			FspClient::cleanUp();
+			std::cout << "recvmmsg() failed with error: " << std::strerror(errno) << std::endl;
+			exit(EXIT_FAILURE);
 		}
-		catch (const std::exception& e)
+
+		FspStats::receiveCalls++;
+		FspStats::receivedPackets += count;
+
+		received.clear();
+		for (int i = 0; i < count; i++) {
+			const char* message = receiveBuffer.data() + i * BUFLEN;
+			received.push_back({ std::vector<char>(message, message + receiveHeaders[i].msg_len), receiveAddresses[i], {} });
+		}
+
+		if (workerPool != nullptr) {
+			for (Datagram& datagram : received) {
+				workerPool->dispatch(std::move(datagram));
+			}
+		}
+		else if (executor != nullptr) {
+			for (Datagram& datagram : received) {
+				dispatchAsync(std::move(datagram.message), datagram.address, password, *executor, [this](const sockaddr_in& address, std::vector<char> response) {
+					completedResponses.push_back({ std::move(response), address, {} });
+				});
+			}
+		}
+		else
 		{
-			std::cout << "Error: " << e.what() << std::endl;
+			processBatch(received);
+		}
+
+		if (static_cast<size_t>(count) < batch) {
+			return;
+		}
+	}
+}
+
+void UdpSocket::processBatch(std::vector<Datagram>& datagrams)
+{
+	// The low latency mode reuses its preallocated responses, everything else gets fresh ones per batch
+	std::vector<Datagram> batchResponses;
+	if (responseSlots.empty()) {
+		batchResponses.resize(datagrams.size());
+	}
+
+	std::vector<Datagram>& responses = responseSlots.empty() ? batchResponses : responseSlots;
+	size_t count = 0;
+	for (Datagram& datagram : datagrams) {
+		Datagram& response = responses[count];
+		if (handleMessage(std::move(datagram.message), datagram.address, response)) {
+			response.address = datagram.address;
+			count++;
 		}
 	}
+
+	sendBatch(responses, count);
+}
+
+void UdpSocket::sendBatch(std::vector<Datagram>& responses, size_t count)
+{
+	// Reused by every batch of this thread, workers send their responses themselves
+	static thread_local std::vector<iovec> sendVectors;
+	static thread_local std::vector<mmsghdr> sendHeaders;
+	sendVectors.resize(count * 2);
+	sendHeaders.resize(count);
+
+	for (size_t i = 0; i < count; i++) {
+		// File data is gathered straight from its mapping behind the header
+		iovec* vectors = &sendVectors[i * 2];
+		vectors[0].iov_base = responses[i].message.data();
+		vectors[0].iov_len = responses[i].message.size();
+		vectors[1].iov_base = const_cast<char*>(responses[i].payload.data);
+		vectors[1].iov_len = responses[i].payload.length;
+
+		sendHeaders[i] = {};
+		sendHeaders[i].msg_hdr.msg_name = &responses[i].address;
+		sendHeaders[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+		sendHeaders[i].msg_hdr.msg_iov = vectors;
+		sendHeaders[i].msg_hdr.msg_iovlen = 0 < responses[i].payload.length ? 2 : 1;
+	}
+
+	size_t sent = 0;
+	while (sent < count) {
+		int result = sendmmsg(wSocket, sendHeaders.data() + sent, static_cast<unsigned int>(count - sent), 0);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			// The mapped file of this response was truncated, the following responses are still sent
+			if (errno == EFAULT) {
+				sent++;
+				continue;
+			}
+
+			// Responses are best effort, the client retransmits its request
+			std::cout << "sendmmsg() failed with error: " << std::strerror(errno) << std::endl;
+			return;
+		}
+
+		FspStats::sendCalls++;
+		FspStats::sentPackets += result;
+		sent += result;
+	}
+}
+
+void UdpSocket::dispatchAsync(std::vector<char> message, const sockaddr_in& sender, const std::string& password, AsyncExecutor& executor, std::function<void(const sockaddr_in&, std::vector<char>)> send)
+{
+	try
+	{
+		auto received = std::make_unique<FspPacket>(std::move(message));
+		FspClient& fspClient = FspClient::getClient(sender.sin_addr.s_addr, received->header.KEY);
+
+		// Requests of one client are served one at a time so they never share its file streams
+		if (fspClient.busy) {
+			if (fspClient.pendingRequests.size() >= FspClient::MAX_PENDING_REQUESTS) {
+				return;
+			}
+
+			auto pending = std::make_shared<std::unique_ptr<FspPacket>>(std::move(received));
+			fspClient.pendingRequests.push_back([pending, &fspClient, sender, &password, &executor, send]() {
+				startAsync(std::move(*pending), fspClient, sender, password, executor, send);
+			});
+			return;
+		}
+
+		startAsync(std::move(received), fspClient, sender, password, executor, send);
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+}
+
+bool UdpSocket::handleMessage(std::vector<char> message, const sockaddr_in& sender, Datagram& response)
+{
+	try
+	{
+		FspPacket received = FspPacket(std::move(message));
+		FspClient& fspClient = FspClient::getClient(sender.sin_addr.s_addr, received.header.KEY);
+		if (received.writeFileResponse(fspClient, password, response.message, response.payload)) {
+			return true;
+		}
+
+		auto responsePacket = received.process(fspClient, password);
+		if (responsePacket != nullptr) {
+			responsePacket->writeRawBytes(response.message);
+			return true;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	return false;
+}
+
+void UdpSocket::startAsync(std::unique_ptr<FspPacket> received, FspClient& fspClient, const sockaddr_in& sender, const std::string& password, AsyncExecutor& executor, std::function<void(const sockaddr_in&, std::vector<char>)> send)
+{
+	fspClient.busy = true;
+	FspTask task = FspPacket::processAsync(std::move(received), fspClient, password, executor);
+	task.start([&fspClient, sender, send](std::unique_ptr<FspPacket> responsePacket) {
+		fspClient.busy = false;
+		if (responsePacket != nullptr) {
+			send(sender, responsePacket->getRawBytes());
+		}
+
+		if (!fspClient.pendingRequests.empty()) {
+			auto next = std::move(fspClient.pendingRequests.front());
+			fspClient.pendingRequests.pop_front();
+			next();
+		}
+	});
+}
+#endif
+
+std::vector<char> UdpSocket::handleMessage(std::vector<char> message, const sockaddr_in& sender)
+{
+	try
+	{
+		FspPacket received = FspPacket(std::move(message));
+		FspClient& fspClient = FspClient::getClient(sender.sin_addr.s_addr, received.header.KEY);
+		auto responsePacket = received.process(fspClient, password);
+
+		if (responsePacket != nullptr) {
+			return responsePacket->getRawBytes();
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cout << "Error: " << e.what() << std::endl;
+	}
+
+	return {};
 }
@@ -1,22 +1,98 @@
 #pragma once
+#ifdef _WIN32
 #pragma comment(lib, "Ws2_32.lib")
 #include "winsock2.h"
 #include "ws2def.h"
 #include "ws2tcpip.h"
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "EventLoop.h"
+#endif
+#include <atomic>
 #include <string>
+#include <vector>
 #include <filesystem>
+#include <functional>
+#include <memory>
+
+#include "FileHandleCache.h"
 
 #define BUFLEN 1024 * 64
 
+struct Datagram
+{
+	std::vector<char> message;
+	sockaddr_in address;
+
+	// Sent behind message without copying it into the datagram buffer first
+	FileSlice payload;
+};
+
+class WorkerPool;
+class UringLoop;
+class AsyncExecutor;
+class ThreadPoolExecutor;
+class XdpSocket;
+class FspClient;
+class FspPacket;
+
 class UdpSocket
 {
 private:
+#ifdef _WIN32
 	WSAData data;
 	SOCKET wSocket;
+#else
+	int wSocket;
+	EventLoop eventLoop;
+#endif
 	sockaddr_in server;
 	sockaddr_in client;
 
+#ifdef _WIN32
 	static std::vector<char> messageBuffer;
+#else
+	// Buffers for recvmmsg()/sendmmsg(), one slot per datagram of a batch
+	std::vector<char> receiveBuffer;
+	std::vector<sockaddr_in> receiveAddresses;
+	std::vector<iovec> receiveVectors;
+	std::vector<mmsghdr> receiveHeaders;
+	std::vector<Datagram> received;
+
+	std::unique_ptr<WorkerPool> workerPool;
+	std::unique_ptr<UringLoop> uringLoop;
+	std::unique_ptr<ThreadPoolExecutor> executor;
+	std::unique_ptr<XdpSocket> xdpSocket;
+
+	// Responses of asynchronous handlers, flushed once per loop iteration
+	std::vector<Datagram> completedResponses;
+
+	// Response buffers of the low latency mode, allocated once and reused for every batch
+	std::vector<Datagram> responseSlots;
+	uint32_t spins = 0;
+
+	void enableLowLatency();
+	void enableXdp(uint32_t ipAddress, uint16_t port);
+	void receive();
+	void processBatch(std::vector<Datagram>& datagrams);
+	void sendBatch(std::vector<Datagram>& responses, size_t count);
+	bool handleMessage(std::vector<char> message, const sockaddr_in& sender, Datagram& response);
+
+	// Only one of the sockets prints the process wide stats
+	static std::atomic<bool> printsStats;
+
+	// The AF_XDP socket is bound to the first receive queue and served by the first socket thread
+	static std::atomic<bool> xdpAttached;
+
+	// Socket threads pinned so far, each one gets the next core after lowLatencyCore
+	static std::atomic<uint16_t> pinnedThreads;
+
+	// Spins between two polls of the event loop timers in low latency mode
+	static const uint32_t LOW_LATENCY_TIMER_SPINS = 1024;
+#endif
+	std::vector<char> handleMessage(std::vector<char> message, const sockaddr_in& sender);
 public:
 	std::string password;
 
@@ -25,5 +101,37 @@ public:
 	void listen();
 
 	static std::filesystem::path basePath;
+
+	// Maximum number of datagrams received and sent per system call
+	static uint16_t batchSize;
+
+	// Number of SO_REUSEPORT sockets bound to the same address, each served by its own thread
+	static uint16_t threads;
+
+	// Number of worker threads per socket that process requests, 0 processes them on the socket thread
+	static uint16_t workers;
+
+	// Use the io_uring backend for socket and file I/O, falls back to epoll if unavailable
+	static bool ioUring;
+
+	// Helper threads for blocking work of coroutine handlers, 0 processes requests synchronously
+	static uint16_t asyncThreads;
+
+	// Core the first socket thread is pinned to while it spins on its socket, -1 disables the low latency mode
+	static int lowLatencyCore;
+
+	// SO_BUSY_POLL time in microseconds for low latency sockets, 0 leaves the socket option untouched
+	static uint32_t busyPoll;
+
+	// Interface the AF_XDP fast path is attached to, empty disables it
+	static std::string xdpInterface;
+
+#ifndef _WIN32
+	// Runs a request through FspPacket::processAsync(), send is invoked with the response once it completes
+	static void dispatchAsync(std::vector<char> message, const sockaddr_in& sender, const std::string& password, AsyncExecutor& executor, std::function<void(const sockaddr_in&, std::vector<char>)> send);
+
+private:
+	static void startAsync(std::unique_ptr<FspPacket> received, FspClient& fspClient, const sockaddr_in& sender, const std::string& password, AsyncExecutor& executor, std::function<void(const sockaddr_in&, std::vector<char>)> send);
+#endif
 };
 
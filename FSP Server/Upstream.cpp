@@ -0,0 +1,453 @@
+#include "Upstream.h"
+#include "FspHelper.h"
+#include "FspPacket.h"
+#include "UdpSocket.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+bool Upstream::enabled = false;
+uint32_t Upstream::address = 0;
+uint16_t Upstream::upstreamPort = 21;
+std::string Upstream::password;
+std::mutex Upstream::sessionMutex;
+intptr_t Upstream::descriptor = -1;
+uint16_t Upstream::key = 0;
+uint16_t Upstream::sequence = 0;
+std::chrono::steady_clock::time_point Upstream::offlineUntil;
+std::mutex Upstream::metadataMutex;
+std::unordered_map<std::string, Upstream::Metadata> Upstream::metadata;
+std::mutex Upstream::filesMutex;
+std::unordered_map<std::string, std::shared_ptr<Upstream::CachedFile>> Upstream::files;
+uint64_t Upstream::useCounter = 0;
+std::mutex Upstream::prefetchMutex;
+std::condition_variable Upstream::prefetchCondition;
+std::deque<std::pair<std::shared_ptr<Upstream::CachedFile>, size_t>> Upstream::prefetchQueue;
+
+void Upstream::configure(uint32_t ipAddress, uint16_t port, const std::string& setPassword)
+{
+	enabled = true;
+	address = ipAddress;
+	upstreamPort = port;
+	password = setPassword;
+
+	std::cout << "Proxying " << FspHelper::uInt32ToIpString(ipAddress, port) << ", cache in \"" << UdpSocket::basePath.string() << "\"" << std::endl;
+	std::thread(prefetch).detach();
+}
+
+bool Upstream::isEnabled()
+{
+	return enabled;
+}
+
+void Upstream::saveAll()
+{
+	if (!enabled) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(filesMutex);
+	for (const auto& [subPath, file] : files) {
+		std::lock_guard<std::mutex> fileLock(file->mutex);
+		if (0 < file->unsavedChunks) {
+			saveChunkMap(*file);
+		}
+	}
+}
+
+bool Upstream::connect()
+{
+	if (descriptor != -1) {
+		return true;
+	}
+
+	// Created on first use, winsock is initialized by the server socket
+	auto upstreamSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	sockaddr_in server = {};
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(address);
+	server.sin_port = htons(upstreamPort);
+	if (::connect(upstreamSocket, (sockaddr*)&server, sizeof(server)) != 0) {
+		std::cout << "Error: Could not connect to the upstream server" << std::endl;
+#ifdef _WIN32
+		closesocket(upstreamSocket);
+#else
+		close(upstreamSocket);
+#endif
+		return false;
+	}
+
+#ifdef _WIN32
+	DWORD timeout = static_cast<DWORD>(RETRY_TIMEOUT.count());
+#else
+	timeval timeout = { 0, static_cast<suseconds_t>(RETRY_TIMEOUT.count() * 1000) };
+#endif
+	setsockopt(upstreamSocket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+	descriptor = static_cast<intptr_t>(upstreamSocket);
+	return true;
+}
+
+std::unique_ptr<FspPacket> Upstream::request(char command, const std::string& subPath, uint32_t position, uint16_t blockSize)
+{
+	// Path and password are sent the way clients send them, the block size as extra data
+	std::vector<uint8_t> data(subPath.begin(), subPath.end());
+	if (!password.empty()) {
+		data.push_back('\n');
+		data.insert(data.end(), password.begin(), password.end());
+	}
+
+	data.push_back('\0');
+	std::vector<uint8_t> extraData = { static_cast<uint8_t>(blockSize >> 8), static_cast<uint8_t>(blockSize & 0xFF) };
+
+	std::vector<char> response(BUFLEN);
+	for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+		// Held for one attempt only, client requests get their turn while a prefetch is retried
+		std::lock_guard<std::mutex> lock(sessionMutex);
+		if (std::chrono::steady_clock::now() < offlineUntil || !connect()) {
+			return nullptr;
+		}
+
+		// Every attempt gets a new sequence number, late answers to an earlier attempt are skipped
+		uint16_t requestSequence = ++sequence;
+		std::vector<char> message = FspPacket::createRequest(command, key, requestSequence, position, data, extraData);
+		send(descriptor, message.data(), static_cast<int>(message.size()), 0);
+
+		while (true) {
+			response.resize(BUFLEN);
+			int received = recv(descriptor, response.data(), static_cast<int>(response.size()), 0);
+			if (received <= 0) {
+				break;
+			}
+
+			response.resize(received);
+			std::unique_ptr<FspPacket> packet;
+			try
+			{
+				packet = FspPacket::parseResponse(response);
+			}
+			catch (const std::exception&)
+			{
+				continue;
+			}
+
+			if (packet->header.SEQUENCE != requestSequence) {
+				continue;
+			}
+
+			key = packet->header.KEY;
+			return packet;
+		}
+	}
+
+	// Clients are answered from the cache right away instead of waiting for every request to time out
+	std::lock_guard<std::mutex> lock(sessionMutex);
+	offlineUntil = std::chrono::steady_clock::now() + OFFLINE_BACKOFF;
+	return nullptr;
+}
+
+bool Upstream::getMetadata(char command, const std::string& subPath, uint32_t position, uint16_t blockSize, std::vector<uint8_t>& data, std::string& error)
+{
+	std::string cacheKey = std::string(1, command) + std::to_string(blockSize) + ":" + std::to_string(position) + ":" + subPath;
+	auto now = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> lock(metadataMutex);
+		auto iterator = metadata.find(cacheKey);
+		if (iterator != metadata.end() && now - iterator->second.fetched < METADATA_TTL) {
+			data = iterator->second.data;
+			error = iterator->second.error;
+			return error.empty();
+		}
+	}
+
+	std::unique_ptr<FspPacket> response = request(command, subPath, position, blockSize);
+
+	std::lock_guard<std::mutex> lock(metadataMutex);
+	if (response == nullptr) {
+		// An outdated answer is better than none while the upstream server is away
+		auto iterator = metadata.find(cacheKey);
+		if (iterator == metadata.end()) {
+			error = "Upstream server not reachable";
+			return false;
+		}
+
+		data = iterator->second.data;
+		error = iterator->second.error;
+		return error.empty();
+	}
+
+	Metadata entry;
+	entry.fetched = now;
+	if (response->header.FSP_COMMAND == CC_ERR) {
+		entry.error.assign(response->data.begin(), std::find(response->data.begin(), response->data.end(), '\0'));
+	}
+	else
+	{
+		entry.data = response->data;
+	}
+
+	if (MAX_METADATA_ENTRIES <= metadata.size()) {
+		metadata.clear();
+	}
+
+	data = entry.data;
+	error = entry.error;
+	metadata[cacheKey] = std::move(entry);
+	return error.empty();
+}
+
+bool Upstream::read(const std::string& requestedPath, uint32_t position, uint16_t blockSize, std::vector<uint8_t>& data, std::string& error)
+{
+	data.clear();
+
+	// The cache lives below the served directory, paths must not leave it
+	std::filesystem::path normalized = std::filesystem::path(requestedPath).relative_path().lexically_normal();
+	std::string subPath = normalized.generic_string();
+	if (subPath.empty() || subPath.rfind("..", 0) == 0) {
+		return true;
+	}
+
+	// The file is identified by the size and modification time the upstream server reports
+	std::vector<uint8_t> status;
+	std::shared_ptr<CachedFile> file;
+	if (getMetadata(CC_STAT, subPath, 0, 0, status, error)) {
+		const uint8_t TYPE_FILE = 0x01;
+		if (status.size() < 9 || status[8] != TYPE_FILE) {
+			return true;
+		}
+
+		uint32_t time = (status[0] << 24) | (status[1] << 16) | (status[2] << 8) | status[3];
+		uint32_t size = (status[4] << 24) | (status[5] << 16) | (status[6] << 8) | status[7];
+		file = openFile(subPath, size, time);
+	}
+	else
+	{
+		// Cached chunks stay readable while the upstream server is away
+		uint32_t size = 0;
+		uint32_t time = 0;
+		std::ifstream stream(FspHelper::getSidecarPath(UdpSocket::basePath / std::filesystem::path(subPath), ".fspproxy"));
+		std::string magic;
+		std::getline(stream, magic);
+		if (magic != "FSP proxy cache 1" || !(stream >> size >> time)) {
+			return false;
+		}
+
+		file = openFile(subPath, size, time);
+	}
+
+	if (file == nullptr) {
+		error = "Proxy cache not writable";
+		return false;
+	}
+
+	if (file->size <= position) {
+		return true;
+	}
+
+	uint32_t length = std::min<uint32_t>(blockSize, file->size - position);
+	size_t first = position / CHUNK_SIZE;
+	size_t last = (position + length - 1) / CHUNK_SIZE;
+	for (size_t chunk = first; chunk <= last; chunk++) {
+		if (!fetchChunk(*file, chunk, error)) {
+			return false;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(file->mutex);
+	data.resize(length);
+	file->stream.clear();
+	file->stream.seekg(position);
+	file->stream.read(reinterpret_cast<char*>(data.data()), length);
+
+	// Sequential reads keep the next chunks coming while the client works through the current one
+	bool sequential = first == file->nextChunk || first + 1 == file->nextChunk;
+	file->nextChunk = last + 1;
+	if (sequential && file->prefetchedEnd < last + READAHEAD_CHUNKS / 2) {
+		size_t start = std::max(file->prefetchedEnd, last + 1);
+		size_t end = std::min(last + 1 + READAHEAD_CHUNKS, file->chunks.size());
+		std::lock_guard<std::mutex> prefetchLock(prefetchMutex);
+		for (size_t chunk = start; chunk < end; chunk++) {
+			if (!file->chunks[chunk]) {
+				prefetchQueue.emplace_back(file, chunk);
+			}
+		}
+
+		file->prefetchedEnd = std::max(file->prefetchedEnd, end);
+		prefetchCondition.notify_one();
+	}
+	else if (!sequential)
+	{
+		file->prefetchedEnd = 0;
+	}
+
+	return true;
+}
+
+std::shared_ptr<Upstream::CachedFile> Upstream::openFile(const std::string& subPath, uint32_t size, uint32_t time)
+{
+	std::lock_guard<std::mutex> lock(filesMutex);
+	auto iterator = files.find(subPath);
+	if (iterator != files.end()) {
+		if (iterator->second->size == size && iterator->second->time == time) {
+			iterator->second->lastUsed = ++useCounter;
+			return iterator->second;
+		}
+
+		std::lock_guard<std::mutex> fileLock(iterator->second->mutex);
+		iterator->second->current = false;
+	}
+
+	if (MAX_OPEN_FILES <= files.size()) {
+		// Files still used by a client or queued for prefetch stay open, a second stream on the same cache file would diverge from it
+		auto victim = files.end();
+		for (auto candidate = files.begin(); candidate != files.end(); ++candidate) {
+			if (candidate->second.use_count() == 1 && (victim == files.end() || candidate->second->lastUsed < victim->second->lastUsed)) {
+				victim = candidate;
+			}
+		}
+
+		if (victim != files.end()) {
+			{
+				std::lock_guard<std::mutex> fileLock(victim->second->mutex);
+				saveChunkMap(*victim->second);
+			}
+
+			files.erase(victim);
+		}
+	}
+
+	auto file = std::make_shared<CachedFile>();
+	file->subPath = subPath;
+	file->path = UdpSocket::basePath / std::filesystem::path(subPath);
+	file->size = size;
+	file->time = time;
+	file->chunks.assign((size + CHUNK_SIZE - 1) / CHUNK_SIZE, false);
+	loadChunkMap(*file);
+
+	// A new or changed file starts out as a sparse file of the final size
+	std::error_code error;
+	if (std::find(file->chunks.begin(), file->chunks.end(), true) == file->chunks.end() || std::filesystem::file_size(file->path, error) != size) {
+		std::fill(file->chunks.begin(), file->chunks.end(), false);
+		std::filesystem::create_directories(file->path.parent_path(), error);
+		std::ofstream(file->path, std::ios::binary | std::ios::trunc).close();
+		std::filesystem::resize_file(file->path, size, error);
+		if (error) {
+			return nullptr;
+		}
+	}
+
+	file->stream.open(file->path, std::ios::binary | std::ios::in | std::ios::out);
+	if (!file->stream.is_open()) {
+		return nullptr;
+	}
+
+	file->lastUsed = ++useCounter;
+	files[subPath] = file;
+	return file;
+}
+
+bool Upstream::fetchChunk(CachedFile& file, size_t chunk, std::string& error)
+{
+	{
+		std::lock_guard<std::mutex> lock(file.mutex);
+		if (file.chunks[chunk]) {
+			return true;
+		}
+	}
+
+	// Fetched without holding the file, clients reading cached chunks are not held up by the network
+	uint32_t start = static_cast<uint32_t>(chunk * CHUNK_SIZE);
+	uint32_t length = std::min<uint32_t>(CHUNK_SIZE, file.size - start);
+	std::vector<uint8_t> bytes;
+	while (bytes.size() < length) {
+		std::unique_ptr<FspPacket> response = request(CC_GET_FILE, file.subPath, start + static_cast<uint32_t>(bytes.size()), static_cast<uint16_t>(length - bytes.size()));
+		if (response == nullptr || response->header.FSP_COMMAND == CC_ERR || response->data.empty()) {
+			error = response == nullptr ? "Upstream server not reachable" : "Upstream read failed";
+			return false;
+		}
+
+		bytes.insert(bytes.end(), response->data.begin(), response->data.end());
+	}
+
+	std::lock_guard<std::mutex> lock(file.mutex);
+	if (file.current && !file.chunks[chunk]) {
+		file.stream.clear();
+		file.stream.seekp(start);
+		file.stream.write(reinterpret_cast<const char*>(bytes.data()), length);
+		file.chunks[chunk] = true;
+
+		const size_t SAVE_INTERVAL = 64;
+		if (SAVE_INTERVAL <= ++file.unsavedChunks || std::find(file.chunks.begin(), file.chunks.end(), false) == file.chunks.end()) {
+			saveChunkMap(file);
+		}
+	}
+
+	return true;
+}
+
+void Upstream::prefetch()
+{
+	while (true) {
+		std::shared_ptr<CachedFile> file;
+		size_t chunk;
+		{
+			std::unique_lock<std::mutex> lock(prefetchMutex);
+			prefetchCondition.wait(lock, []() { return !prefetchQueue.empty(); });
+			file = prefetchQueue.front().first;
+			chunk = prefetchQueue.front().second;
+			prefetchQueue.pop_front();
+		}
+
+		std::string error;
+		fetchChunk(*file, chunk, error);
+	}
+}
+
+void Upstream::loadChunkMap(CachedFile& file)
+{
+	std::ifstream stream(FspHelper::getSidecarPath(file.path, ".fspproxy"));
+	std::string magic;
+	std::getline(stream, magic);
+	uint32_t size = 0;
+	uint32_t time = 0;
+	std::string chunks;
+	if (magic != "FSP proxy cache 1" || !(stream >> size >> time >> chunks) || size != file.size || time != file.time || chunks.size() != file.chunks.size()) {
+		return;
+	}
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		file.chunks[i] = chunks[i] == '1';
+	}
+}
+
+void Upstream::saveChunkMap(CachedFile& file)
+{
+	// The data is flushed first, the map never claims a chunk that is not on disk
+	file.stream.flush();
+	file.unsavedChunks = 0;
+
+	std::filesystem::path path = FspHelper::getSidecarPath(file.path, ".fspproxy");
+	std::filesystem::path temporaryPath = path;
+	temporaryPath += ".tmp";
+
+	std::error_code error;
+	std::filesystem::create_directories(path.parent_path(), error);
+	{
+		std::ofstream stream(temporaryPath, std::ios::trunc);
+		stream << "FSP proxy cache 1\n" << file.size << " " << file.time << "\n";
+		for (bool present : file.chunks) {
+			stream << (present ? '1' : '0');
+		}
+
+		stream << "\n";
+		if (!stream.good()) {
+			return;
+		}
+	}
+
+	std::filesystem::rename(temporaryPath, path, error);
+}
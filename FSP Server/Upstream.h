@@ -0,0 +1,114 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class FspPacket;
+
+// Proxy mode, the server answers CC_GET_DIR, CC_STAT and CC_GET_FILE from another FSP server. Listings
+// and stats are kept in memory for a few seconds, file blocks are stored in sparse files below the
+// served directory, which becomes a persistent cache of the upstream library. Sequential reads fetch
+// the following blocks in the background. All requests share one upstream session, FSP allows only
+// one request per client in flight.
+class Upstream
+{
+public:
+	static const uint32_t CHUNK_SIZE = 8192;
+	static const size_t READAHEAD_CHUNKS = 16;
+	static const int MAX_ATTEMPTS = 5;
+	static constexpr std::chrono::milliseconds RETRY_TIMEOUT = std::chrono::milliseconds(400);
+	static constexpr std::chrono::steady_clock::duration METADATA_TTL = std::chrono::seconds(10);
+
+	// Time after an unanswered request in which the upstream server is not asked again
+	static constexpr std::chrono::steady_clock::duration OFFLINE_BACKOFF = std::chrono::seconds(5);
+
+	static void configure(uint32_t ipAddress, uint16_t port, const std::string& setPassword);
+	static bool isEnabled();
+
+	// Writes the chunk maps of the open cached files, called when the server shuts down
+	static void saveAll();
+
+	// Response data of a CC_GET_DIR or CC_STAT request. Returns false and the reason in error if the
+	// upstream server answered with an error or could not be reached.
+	static bool getMetadata(char command, const std::string& subPath, uint32_t position, uint16_t blockSize, std::vector<uint8_t>& data, std::string& error);
+
+	// Block of a file, served from the local cache and fetched from the upstream server if missing
+	static bool read(const std::string& subPath, uint32_t position, uint16_t blockSize, std::vector<uint8_t>& data, std::string& error);
+
+private:
+	static const char CC_ERR = 0x40;
+	static const char CC_GET_FILE = 0x42;
+	static const char CC_STAT = 0x4D;
+	static const size_t MAX_METADATA_ENTRIES = 65536;
+	static const size_t MAX_OPEN_FILES = 256;
+
+	struct Metadata
+	{
+		std::vector<uint8_t> data;
+		std::string error;
+		std::chrono::steady_clock::time_point fetched;
+	};
+
+	struct CachedFile
+	{
+		std::mutex mutex;
+		std::string subPath;
+		std::filesystem::path path;
+		uint32_t size = 0;
+		uint32_t time = 0;
+		std::fstream stream;
+		std::vector<bool> chunks;
+		size_t unsavedChunks = 0;
+		size_t nextChunk = 0;
+		size_t prefetchedEnd = 0;
+
+		// Cleared once the upstream file has changed, late chunks of the old version are dropped
+		bool current = true;
+
+		// Value of useCounter when it was last opened, guarded by filesMutex
+		uint64_t lastUsed = 0;
+	};
+
+	static bool enabled;
+	static uint32_t address;
+	static uint16_t upstreamPort;
+	static std::string password;
+
+	// Upstream session, guarded by sessionMutex
+	static std::mutex sessionMutex;
+	static intptr_t descriptor;
+	static uint16_t key;
+	static uint16_t sequence;
+	static std::chrono::steady_clock::time_point offlineUntil;
+
+	static std::mutex metadataMutex;
+	static std::unordered_map<std::string, Metadata> metadata;
+
+	static std::mutex filesMutex;
+	static std::unordered_map<std::string, std::shared_ptr<CachedFile>> files;
+	static uint64_t useCounter;
+
+	static std::mutex prefetchMutex;
+	static std::condition_variable prefetchCondition;
+	static std::deque<std::pair<std::shared_ptr<CachedFile>, size_t>> prefetchQueue;
+
+	// Sends a request and waits for its response, nullptr if the upstream server does not answer
+	static std::unique_ptr<FspPacket> request(char command, const std::string& subPath, uint32_t position, uint16_t blockSize);
+	static bool connect();
+
+	static std::shared_ptr<CachedFile> openFile(const std::string& subPath, uint32_t size, uint32_t time);
+	static bool fetchChunk(CachedFile& file, size_t chunk, std::string& error);
+	static void prefetch();
+	static void loadChunkMap(CachedFile& file);
+	static void saveChunkMap(CachedFile& file);
+};
@@ -0,0 +1,220 @@
+#include "UringLoop.h"
+#include "FspStats.h"
+#include "UdpSocket.h"
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+
+UringLoop::UringLoop(int socket, std::string serverPassword, EventLoop& timers, size_t receiveSlots, size_t helperThreads)
+	: ring(RING_ENTRIES), eventLoop(timers), helpers(timers, helperThreads)
+{
+	wSocket = socket;
+	password = serverPassword;
+	receivedPackets = 0;
+	sentPackets = 0;
+
+	for (size_t i = 0; i < receiveSlots; i++) {
+		auto operation = std::make_unique<Operation>();
+		operation->type = Operation::RECEIVE;
+		operation->buffer.resize(BUFLEN);
+		submitReceive(operation.get());
+		receives.push_back(std::move(operation));
+	}
+
+	pollOperation.type = Operation::POLL;
+	submitPoll();
+	ring.submit();
+}
+
+void UringLoop::runOnce()
+{
+	ring.submit(1);
+	ring.forEachCompletion([this](const io_uring_cqe& completion) { onCompletion(completion); });
+
+	// One io_uring_enter() covers every completion reaped in this round
+	if (0 < receivedPackets) {
+		FspStats::receiveCalls++;
+		FspStats::receivedPackets += receivedPackets;
+	}
+
+	if (0 < sentPackets) {
+		FspStats::sendCalls++;
+		FspStats::sentPackets += sentPackets;
+	}
+
+	receivedPackets = 0;
+	sentPackets = 0;
+}
+
+io_uring_sqe* UringLoop::getSubmission()
+{
+	io_uring_sqe* submission = ring.getSubmission();
+	while (submission == nullptr) {
+		// Queue is full, hand the pending entries to the kernel first
+		ring.submit();
+		submission = ring.getSubmission();
+	}
+
+	return submission;
+}
+
+void UringLoop::submitReceive(Operation* operation)
+{
+	operation->vector.iov_base = operation->buffer.data();
+	operation->vector.iov_len = operation->buffer.size();
+	operation->header = {};
+	operation->header.msg_name = &operation->address;
+	operation->header.msg_namelen = sizeof(sockaddr_in);
+	operation->header.msg_iov = &operation->vector;
+	operation->header.msg_iovlen = 1;
+
+	io_uring_sqe* submission = getSubmission();
+	submission->opcode = IORING_OP_RECVMSG;
+	submission->fd = wSocket;
+	submission->addr = reinterpret_cast<uint64_t>(&operation->header);
+	submission->len = 1;
+	submission->user_data = reinterpret_cast<uint64_t>(operation);
+}
+
+void UringLoop::read(int fd, void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback)
+{
+	Operation* operation = acquire();
+	operation->type = Operation::FILE_IO;
+	operation->callback = std::move(callback);
+
+	io_uring_sqe* submission = getSubmission();
+	submission->opcode = IORING_OP_READ;
+	submission->fd = fd;
+	submission->addr = reinterpret_cast<uint64_t>(buffer);
+	submission->len = length;
+	submission->off = offset;
+	submission->user_data = reinterpret_cast<uint64_t>(operation);
+
+	// The kernel takes its reference to fd on submission, the descriptor may be closed and reused before the next round
+	ring.submit();
+}
+
+void UringLoop::write(int fd, const void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback)
+{
+	Operation* operation = acquire();
+	operation->type = Operation::FILE_IO;
+	operation->callback = std::move(callback);
+
+	io_uring_sqe* submission = getSubmission();
+	submission->opcode = IORING_OP_WRITE;
+	submission->fd = fd;
+	submission->addr = reinterpret_cast<uint64_t>(buffer);
+	submission->len = length;
+	submission->off = offset;
+	submission->user_data = reinterpret_cast<uint64_t>(operation);
+
+	// The kernel takes its reference to fd on submission, the descriptor may be closed and reused before the next round
+	ring.submit();
+}
+
+void UringLoop::run(std::function<void()> work, std::function<void()> callback)
+{
+	helpers.run(std::move(work), std::move(callback));
+}
+
+void UringLoop::submitSend(const sockaddr_in& address, std::vector<char> message)
+{
+	Operation* operation = acquire();
+	operation->type = Operation::SEND;
+	operation->address = address;
+	operation->buffer = std::move(message);
+	operation->vector.iov_base = operation->buffer.data();
+	operation->vector.iov_len = operation->buffer.size();
+	operation->header = {};
+	operation->header.msg_name = &operation->address;
+	operation->header.msg_namelen = sizeof(sockaddr_in);
+	operation->header.msg_iov = &operation->vector;
+	operation->header.msg_iovlen = 1;
+
+	io_uring_sqe* submission = getSubmission();
+	submission->opcode = IORING_OP_SENDMSG;
+	submission->fd = wSocket;
+	submission->addr = reinterpret_cast<uint64_t>(&operation->header);
+	submission->len = 1;
+	submission->user_data = reinterpret_cast<uint64_t>(operation);
+}
+
+void UringLoop::submitPoll()
+{
+	io_uring_sqe* submission = getSubmission();
+	submission->opcode = IORING_OP_POLL_ADD;
+	submission->fd = eventLoop.getFd();
+	submission->poll32_events = POLLIN;
+	submission->user_data = reinterpret_cast<uint64_t>(&pollOperation);
+}
+
+void UringLoop::onCompletion(const io_uring_cqe& completion)
+{
+	Operation* operation = reinterpret_cast<Operation*>(completion.user_data);
+
+	switch (operation->type)
+	{
+	case Operation::RECEIVE:
+		onReceive(operation, completion.res);
+		break;
+	case Operation::FILE_IO:
+	{
+		auto callback = std::move(operation->callback);
+		release(operation);
+		callback(completion.res);
+		break;
+	}
+	case Operation::SEND:
+		if (0 <= completion.res) {
+			sentPackets++;
+		}
+
+		release(operation);
+		break;
+	case Operation::POLL:
+		eventLoop.runOnce(0);
+		submitPoll();
+		break;
+	}
+}
+
+void UringLoop::onReceive(Operation* operation, int result)
+{
+	if (result <= 0) {
+		if (result < 0 && result != -EINTR && result != -EAGAIN) {
+			std::cout << "recvmsg() failed with error: " << std::strerror(-result) << std::endl;
+		}
+
+		submitReceive(operation);
+		return;
+	}
+
+	receivedPackets++;
+
+	// The receive buffer is rearmed right away, the request works on a copy
+	std::vector<char> message(operation->buffer.begin(), operation->buffer.begin() + result);
+	sockaddr_in sender = operation->address;
+	submitReceive(operation);
+
+	UdpSocket::dispatchAsync(std::move(message), sender, password, *this, [this](const sockaddr_in& address, std::vector<char> response) {
+		submitSend(address, std::move(response));
+	});
+}
+
+UringLoop::Operation* UringLoop::acquire()
+{
+	if (freeOperations.empty()) {
+		return new Operation();
+	}
+
+	Operation* operation = freeOperations.back().release();
+	freeOperations.pop_back();
+	return operation;
+}
+
+void UringLoop::release(Operation* operation)
+{
+	operation->buffer.clear();
+	operation->callback = nullptr;
+	freeOperations.emplace_back(operation);
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include "AsyncExecutor.h"
+#include "IoUring.h"
+#include "EventLoop.h"
+#include "ThreadPoolExecutor.h"
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// io_uring backend of UdpSocket. Datagram receives and sends as well as the
+// file reads and writes of the asynchronous request handlers are submitted
+// to one ring, so a slow disk read does not block other requests. Blocking
+// work the ring can not express runs on a ThreadPoolExecutor. The EventLoop
+// of the socket is polled through the ring to keep its timers running.
+class UringLoop : public AsyncExecutor
+{
+public:
+	UringLoop(int socket, std::string serverPassword, EventLoop& timers, size_t receiveSlots, size_t helperThreads);
+	void runOnce();
+
+	void read(int fd, void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback) override;
+	void write(int fd, const void* buffer, uint32_t length, uint64_t offset, std::function<void(int)> callback) override;
+	void run(std::function<void()> work, std::function<void()> callback) override;
+
+private:
+	struct Operation
+	{
+		enum Type {
+			RECEIVE,
+			FILE_IO,
+			SEND,
+			POLL
+		};
+
+		Type type;
+		std::vector<char> buffer;
+		sockaddr_in address;
+		iovec vector;
+		msghdr header;
+		std::function<void(int)> callback;
+	};
+
+	static const unsigned int RING_ENTRIES = 1024;
+
+	IoUring ring;
+	int wSocket;
+	std::string password;
+	EventLoop& eventLoop;
+	ThreadPoolExecutor helpers;
+
+	std::vector<std::unique_ptr<Operation>> receives;
+	std::vector<std::unique_ptr<Operation>> freeOperations;
+	Operation pollOperation;
+	size_t receivedPackets;
+	size_t sentPackets;
+
+	io_uring_sqe* getSubmission();
+	void submitReceive(Operation* operation);
+	void submitSend(const sockaddr_in& address, std::vector<char> message);
+	void submitPoll();
+	void onCompletion(const io_uring_cqe& completion);
+	void onReceive(Operation* operation, int result);
+	Operation* acquire();
+	void release(Operation* operation);
+};
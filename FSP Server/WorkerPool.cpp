@@ -0,0 +1,69 @@
+#include "WorkerPool.h"
+#include "FspClient.h"
+#include <chrono>
+
+WorkerPool::WorkerPool(size_t workerCount, std::function<void(std::vector<Datagram>&)> batchHandler)
+{
+	handler = batchHandler;
+	running = true;
+
+	for (size_t i = 0; i < workerCount; i++) {
+		workers.push_back(std::make_unique<Worker>());
+	}
+
+	for (auto& worker : workers) {
+		Worker* w = worker.get();
+		w->thread = std::thread([this, w]() { run(*w); });
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	running = false;
+	for (auto& worker : workers) {
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+		}
+
+		worker->condition.notify_one();
+		worker->thread.join();
+	}
+}
+
+void WorkerPool::dispatch(Datagram datagram)
+{
+	// Host order, so the low octet of a LAN address selects the worker
+	Worker& worker = *workers[ntohl(datagram.address.sin_addr.s_addr) % workers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.queue.push_back(std::move(datagram));
+	}
+
+	worker.condition.notify_one();
+}
+
+void WorkerPool::run(Worker& worker)
+{
+	std::vector<Datagram> batch;
+	auto lastCleanUp = std::chrono::steady_clock::now();
+	const auto cleanUpInterval = std::chrono::seconds(FspClient::CLEANUP_INTERVAL);
+
+	while (running) {
+		{
+			std::unique_lock<std::mutex> lock(worker.mutex);
+			worker.condition.wait_for(lock, cleanUpInterval, [&]() { return !worker.queue.empty() || !running; });
+			batch.swap(worker.queue);
+		}
+
+		if (!batch.empty()) {
+			handler(batch);
+			batch.clear();
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (cleanUpInterval <= now - lastCleanUp) {
+			FspClient::cleanUp();
+			lastCleanUp = now;
+		}
+	}
+}
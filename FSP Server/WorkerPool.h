@@ -0,0 +1,38 @@
+#pragma once
+#include "UdpSocket.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads. Datagrams are routed by client address so a
+// client is always served by the same worker, which owns that client's
+// session state (FspClient::clients is thread_local).
+class WorkerPool
+{
+public:
+	WorkerPool(size_t workerCount, std::function<void(std::vector<Datagram>&)> batchHandler);
+	~WorkerPool();
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	void dispatch(Datagram datagram);
+
+private:
+	struct Worker
+	{
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::vector<Datagram> queue;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::function<void(std::vector<Datagram>&)> handler;
+	std::atomic<bool> running;
+
+	void run(Worker& worker);
+};
@@ -0,0 +1,449 @@
+#include "XdpSocket.h"
+#include "FspStats.h"
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace
+{
+	int bpf(int command, bpf_attr& attributes)
+	{
+		return static_cast<int>(syscall(__NR_bpf, command, &attributes, sizeof(attributes)));
+	}
+
+	bpf_insn instruction(uint8_t code, uint8_t destination, uint8_t source, int16_t offset, int32_t immediate)
+	{
+		bpf_insn result = {};
+		result.code = code;
+		result.dst_reg = destination;
+		result.src_reg = source;
+		result.off = offset;
+		result.imm = immediate;
+		return result;
+	}
+
+	void writeUInt16(uint8_t* destination, uint16_t value)
+	{
+		destination[0] = static_cast<uint8_t>(value >> 8);
+		destination[1] = static_cast<uint8_t>(value & 0xFF);
+	}
+
+	// Ones' complement sum of big endian words as used by IPv4 and UDP
+	uint16_t getInternetChecksum(const uint8_t* data, size_t length, uint32_t sum)
+	{
+		for (size_t i = 0; i + 1 < length; i += 2) {
+			sum += (data[i] << 8) | data[i + 1];
+		}
+
+		if (length % 2 != 0) {
+			sum += data[length - 1] << 8;
+		}
+
+		while (sum >> 16) {
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+
+		return static_cast<uint16_t>(~sum);
+	}
+
+	std::runtime_error systemError(const std::string& message)
+	{
+		return std::runtime_error(message + ": " + std::strerror(errno));
+	}
+}
+
+XdpSocket::XdpSocket(const std::string& interfaceName, uint32_t ipAddress, uint16_t port, Handler setHandler, Fallback setFallback)
+	: handler(std::move(setHandler)), fallback(std::move(setFallback))
+{
+	int interfaceIndex = static_cast<int>(if_nametoindex(interfaceName.c_str()));
+	if (interfaceIndex == 0) {
+		throw systemError("Unknown interface " + interfaceName);
+	}
+
+	try
+	{
+		// Frames larger than the MTU would need IP fragmentation, those responses take the regular socket
+		int controlSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		ifreq request = {};
+		std::strncpy(request.ifr_name, interfaceName.c_str(), IFNAMSIZ - 1);
+		if (0 <= controlSocket && ioctl(controlSocket, SIOCGIFMTU, &request) == 0) {
+			maxFrameLength = std::min<size_t>(FRAME_SIZE, 14 + static_cast<size_t>(request.ifr_mtu));
+		}
+
+		if (0 <= controlSocket) {
+			close(controlSocket);
+		}
+
+		xdpFd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+		if (xdpFd < 0) {
+			throw systemError("Could not create AF_XDP socket");
+		}
+
+		size_t umemSize = static_cast<size_t>(FRAME_COUNT) * FRAME_SIZE;
+		void* area = mmap(nullptr, umemSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+		if (area == MAP_FAILED) {
+			throw systemError("Could not allocate UMEM");
+		}
+
+		umem = static_cast<uint8_t*>(area);
+
+		xdp_umem_reg registration = {};
+		registration.addr = reinterpret_cast<uint64_t>(umem);
+		registration.len = umemSize;
+		registration.chunk_size = FRAME_SIZE;
+		registration.headroom = 0;
+		if (setsockopt(xdpFd, SOL_XDP, XDP_UMEM_REG, &registration, sizeof(registration)) != 0) {
+			throw systemError("Could not register UMEM");
+		}
+
+		int ringSize = RING_SIZE;
+		if (setsockopt(xdpFd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) != 0
+			|| setsockopt(xdpFd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) != 0
+			|| setsockopt(xdpFd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize)) != 0
+			|| setsockopt(xdpFd, SOL_XDP, XDP_TX_RING, &ringSize, sizeof(ringSize)) != 0) {
+			throw systemError("Could not size AF_XDP rings");
+		}
+
+		xdp_mmap_offsets offsets = {};
+		socklen_t offsetsLength = sizeof(offsets);
+		if (getsockopt(xdpFd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsetsLength) != 0) {
+			throw systemError("Could not query AF_XDP ring offsets");
+		}
+
+		mapRing(receiveRing, offsets.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING);
+		mapRing(transmitRing, offsets.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING);
+		mapRing(fillRing, offsets.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+		mapRing(completionRing, offsets.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+
+		// Generic mode copies packets between the stack and the UMEM, zero copy needs driver support
+		sockaddr_xdp address = {};
+		address.sxdp_family = AF_XDP;
+		address.sxdp_flags = XDP_COPY;
+		address.sxdp_ifindex = interfaceIndex;
+		address.sxdp_queue_id = 0;
+		if (bind(xdpFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+			throw systemError("Could not bind AF_XDP socket to " + interfaceName);
+		}
+
+		auto* fillAddresses = static_cast<uint64_t*>(fillRing.descriptors);
+		for (uint32_t i = 0; i < RING_SIZE; i++) {
+			fillAddresses[i] = static_cast<uint64_t>(i) * FRAME_SIZE;
+		}
+
+		__atomic_store_n(fillRing.producer, *fillRing.producer + RING_SIZE, __ATOMIC_RELEASE);
+
+		for (uint32_t i = RING_SIZE; i < FRAME_COUNT; i++) {
+			freeFrames.push_back(static_cast<uint64_t>(i) * FRAME_SIZE);
+		}
+
+		loadProgram(interfaceIndex, ipAddress, port);
+	}
+	catch (const std::exception&)
+	{
+		release();
+		throw;
+	}
+}
+
+XdpSocket::~XdpSocket()
+{
+	release();
+}
+
+int XdpSocket::getFd()
+{
+	return xdpFd;
+}
+
+void XdpSocket::receive()
+{
+	reclaimFrames();
+
+	uint32_t consumer = *receiveRing.consumer;
+	uint32_t available = __atomic_load_n(receiveRing.producer, __ATOMIC_ACQUIRE) - consumer;
+	if (available == 0) {
+		return;
+	}
+
+	auto* descriptors = static_cast<xdp_desc*>(receiveRing.descriptors);
+	auto* fillAddresses = static_cast<uint64_t*>(fillRing.descriptors);
+	uint32_t fillProducer = *fillRing.producer;
+	uint32_t transmitted = 0;
+
+	for (uint32_t i = 0; i < available; i++) {
+		const xdp_desc& descriptor = descriptors[(consumer + i) & (RING_SIZE - 1)];
+		const uint8_t* frame = umem + descriptor.addr;
+
+		// The frame may carry Ethernet padding, the UDP length tells the actual datagram size
+		uint16_t udpLength = HEADERS_LENGTH <= descriptor.len ? static_cast<uint16_t>((frame[38] << 8) | frame[39]) : 0;
+		if (8 <= udpLength && HEADERS_LENGTH - 8 + udpLength <= descriptor.len) {
+			sockaddr_in sender = {};
+			sender.sin_family = AF_INET;
+			std::memcpy(&sender.sin_addr.s_addr, frame + 26, sizeof(sender.sin_addr.s_addr));
+			std::memcpy(&sender.sin_port, frame + 34, sizeof(sender.sin_port));
+
+			std::vector<char> message(frame + HEADERS_LENGTH, frame + HEADERS_LENGTH + udpLength - 8);
+			std::vector<char> response = handler(std::move(message), sender);
+			if (!response.empty()) {
+				if (transmit(frame, response)) {
+					transmitted++;
+				}
+				else
+				{
+					fallback(sender, std::move(response));
+				}
+			}
+		}
+
+		fillAddresses[(fillProducer + i) & (RING_SIZE - 1)] = descriptor.addr - descriptor.addr % FRAME_SIZE;
+	}
+
+	__atomic_store_n(receiveRing.consumer, consumer + available, __ATOMIC_RELEASE);
+	__atomic_store_n(fillRing.producer, fillProducer + available, __ATOMIC_RELEASE);
+
+	if (0 < transmitted) {
+		// Copy mode only transmits once the socket is kicked
+		sendto(xdpFd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+	}
+
+	FspStats::xdpReceivedPackets += available;
+	FspStats::xdpSentPackets += transmitted;
+}
+
+void XdpSocket::mapRing(Ring& ring, const xdp_ring_offset& offsets, size_t descriptorSize, off_t pageOffset)
+{
+	ring.mappingSize = offsets.desc + RING_SIZE * descriptorSize;
+	void* mapping = mmap(nullptr, ring.mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xdpFd, pageOffset);
+	if (mapping == MAP_FAILED) {
+		ring.mappingSize = 0;
+		throw systemError("Could not map AF_XDP ring");
+	}
+
+	uint8_t* base = static_cast<uint8_t*>(mapping);
+	ring.mapping = mapping;
+	ring.producer = reinterpret_cast<uint32_t*>(base + offsets.producer);
+	ring.consumer = reinterpret_cast<uint32_t*>(base + offsets.consumer);
+	ring.descriptors = base + offsets.desc;
+}
+
+void XdpSocket::loadProgram(int interfaceIndex, uint32_t ipAddress, uint16_t port)
+{
+	bpf_attr attributes = {};
+	attributes.map_type = BPF_MAP_TYPE_XSKMAP;
+	attributes.key_size = sizeof(uint32_t);
+	attributes.value_size = sizeof(uint32_t);
+	attributes.max_entries = 64;
+	mapFd = bpf(BPF_MAP_CREATE, attributes);
+	if (mapFd < 0) {
+		throw systemError("Could not create XSKMAP");
+	}
+
+	uint32_t queue = 0;
+	uint32_t socketFd = static_cast<uint32_t>(xdpFd);
+	attributes = {};
+	attributes.map_fd = mapFd;
+	attributes.key = reinterpret_cast<uint64_t>(&queue);
+	attributes.value = reinterpret_cast<uint64_t>(&socketFd);
+	if (bpf(BPF_MAP_UPDATE_ELEM, attributes) != 0) {
+		throw systemError("Could not add the AF_XDP socket to the XSKMAP");
+	}
+
+	// Packet fields are loaded in network order, so they are compared against byte swapped constants.
+	// r2 points at the Ethernet header, r3 at the end of the packet, r6 holds the xdp_md context.
+	std::vector<bpf_insn> program;
+	std::vector<size_t> passJumps;
+	auto jumpToPass = [&](uint8_t code, uint8_t destination, uint8_t source, int32_t immediate) {
+		passJumps.push_back(program.size());
+		program.push_back(instruction(BPF_JMP | code, destination, source, 0, immediate));
+	};
+
+	program.push_back(instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0));
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(xdp_md, data), 0));
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(xdp_md, data_end), 0));
+
+	// Headers plus the FSP command byte must be present
+	program.push_back(instruction(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0));
+	program.push_back(instruction(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, HEADERS_LENGTH + 1));
+	jumpToPass(BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0);
+
+	// IPv4 without options, not fragmented, UDP
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0));
+	jumpToPass(BPF_JNE | BPF_K, BPF_REG_5, 0, htons(0x0800));
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 14, 0));
+	jumpToPass(BPF_JNE | BPF_K, BPF_REG_5, 0, 0x45);
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 20, 0));
+	program.push_back(instruction(BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3FFF)));
+	jumpToPass(BPF_JNE | BPF_K, BPF_REG_5, 0, 0);
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, 23, 0));
+	jumpToPass(BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP);
+
+	// Destination address, unless the server is bound to all addresses, and port
+	if (ipAddress != INADDR_ANY) {
+		program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, 30, 0));
+		program.push_back(instruction(BPF_ALU | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, static_cast<int32_t>(htonl(ipAddress))));
+		jumpToPass(BPF_JNE | BPF_X, BPF_REG_5, BPF_REG_4, 0);
+	}
+
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 36, 0));
+	jumpToPass(BPF_JNE | BPF_K, BPF_REG_5, 0, htons(port));
+
+	// CC_GET_FILE or CC_STAT
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, HEADERS_LENGTH, 0));
+	program.push_back(instruction(BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_5, 0, 1, 0x42));
+	jumpToPass(BPF_JNE | BPF_K, BPF_REG_5, 0, 0x4D);
+
+	// Redirect to the socket of the receive queue, queues without a socket pass the packet on
+	program.push_back(instruction(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, offsetof(xdp_md, rx_queue_index), 0));
+	program.push_back(instruction(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, mapFd));
+	program.push_back(instruction(0, 0, 0, 0, 0));
+	program.push_back(instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS));
+	program.push_back(instruction(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map));
+	program.push_back(instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	size_t pass = program.size();
+	program.push_back(instruction(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS));
+	program.push_back(instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+
+	for (size_t jump : passJumps) {
+		program[jump].off = static_cast<int16_t>(pass - jump - 1);
+	}
+
+	static const char license[] = "GPL";
+	std::vector<char> log(16384);
+	attributes = {};
+	attributes.prog_type = BPF_PROG_TYPE_XDP;
+	attributes.insn_cnt = static_cast<uint32_t>(program.size());
+	attributes.insns = reinterpret_cast<uint64_t>(program.data());
+	attributes.license = reinterpret_cast<uint64_t>(license);
+	attributes.log_level = 1;
+	attributes.log_size = static_cast<uint32_t>(log.size());
+	attributes.log_buf = reinterpret_cast<uint64_t>(log.data());
+	programFd = bpf(BPF_PROG_LOAD, attributes);
+	if (programFd < 0) {
+		throw systemError("Could not load XDP program " + std::string(log.data()));
+	}
+
+	// The link detaches the program again once it is closed
+	attributes = {};
+	attributes.link_create.prog_fd = programFd;
+	attributes.link_create.target_ifindex = interfaceIndex;
+	attributes.link_create.attach_type = BPF_XDP;
+	attributes.link_create.flags = XDP_FLAGS_SKB_MODE;
+	linkFd = bpf(BPF_LINK_CREATE, attributes);
+	if (linkFd < 0) {
+		throw systemError("Could not attach XDP program");
+	}
+}
+
+void XdpSocket::reclaimFrames()
+{
+	uint32_t consumer = *completionRing.consumer;
+	uint32_t available = __atomic_load_n(completionRing.producer, __ATOMIC_ACQUIRE) - consumer;
+	auto* addresses = static_cast<uint64_t*>(completionRing.descriptors);
+	for (uint32_t i = 0; i < available; i++) {
+		freeFrames.push_back(addresses[(consumer + i) & (RING_SIZE - 1)]);
+	}
+
+	__atomic_store_n(completionRing.consumer, consumer + available, __ATOMIC_RELEASE);
+}
+
+bool XdpSocket::transmit(const uint8_t* request, const std::vector<char>& response)
+{
+	size_t length = HEADERS_LENGTH + response.size();
+	if (maxFrameLength < length) {
+		return false;
+	}
+
+	if (freeFrames.empty()) {
+		reclaimFrames();
+	}
+
+	uint32_t producer = *transmitRing.producer;
+	if (freeFrames.empty() || RING_SIZE <= producer - __atomic_load_n(transmitRing.consumer, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	uint64_t address = freeFrames.back();
+	freeFrames.pop_back();
+	uint8_t* frame = umem + address;
+
+	// Answer with swapped Ethernet, IP and UDP addresses
+	std::memcpy(frame, request + 6, 6);
+	std::memcpy(frame + 6, request, 6);
+	writeUInt16(frame + 12, 0x0800);
+
+	uint8_t* ip = frame + 14;
+	ip[0] = 0x45;
+	ip[1] = 0;
+	writeUInt16(ip + 2, static_cast<uint16_t>(length - 14));
+	writeUInt16(ip + 4, 0);
+	writeUInt16(ip + 6, 0x4000);
+	ip[8] = 64;
+	ip[9] = IPPROTO_UDP;
+	writeUInt16(ip + 10, 0);
+	std::memcpy(ip + 12, request + 30, 4);
+	std::memcpy(ip + 16, request + 26, 4);
+	writeUInt16(ip + 10, getInternetChecksum(ip, 20, 0));
+
+	uint8_t* udp = ip + 20;
+	uint16_t udpLength = static_cast<uint16_t>(length - 14 - 20);
+	std::memcpy(udp, request + 36, 2);
+	std::memcpy(udp + 2, request + 34, 2);
+	writeUInt16(udp + 4, udpLength);
+	writeUInt16(udp + 6, 0);
+	std::memcpy(udp + 8, response.data(), response.size());
+
+	uint32_t pseudoHeader = ((ip[12] << 8) | ip[13]) + ((ip[14] << 8) | ip[15]) + ((ip[16] << 8) | ip[17]) + ((ip[18] << 8) | ip[19]) + IPPROTO_UDP + udpLength;
+	uint16_t udpChecksum = getInternetChecksum(udp, udpLength, pseudoHeader);
+	writeUInt16(udp + 6, udpChecksum == 0 ? 0xFFFF : udpChecksum);
+
+	auto* descriptors = static_cast<xdp_desc*>(transmitRing.descriptors);
+	xdp_desc& descriptor = descriptors[producer & (RING_SIZE - 1)];
+	descriptor.addr = address;
+	descriptor.len = static_cast<uint32_t>(length);
+	descriptor.options = 0;
+	__atomic_store_n(transmitRing.producer, producer + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+void XdpSocket::release()
+{
+	for (int* fd : { &linkFd, &programFd, &mapFd }) {
+		if (0 <= *fd) {
+			close(*fd);
+			*fd = -1;
+		}
+	}
+
+	for (Ring* ring : { &receiveRing, &transmitRing, &fillRing, &completionRing }) {
+		if (0 < ring->mappingSize) {
+			munmap(ring->mapping, ring->mappingSize);
+			*ring = {};
+		}
+	}
+
+	if (0 <= xdpFd) {
+		close(xdpFd);
+		xdpFd = -1;
+	}
+
+	if (umem != nullptr) {
+		munmap(umem, static_cast<size_t>(FRAME_COUNT) * FRAME_SIZE);
+		umem = nullptr;
+	}
+}
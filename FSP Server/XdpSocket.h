@@ -0,0 +1,72 @@
+#pragma once
+#include <linux/if_xdp.h>
+#include <netinet/in.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// AF_XDP fast path. A small XDP program steers CC_GET_FILE and CC_STAT
+// requests for the server port into the UMEM of an XDP socket, where they are
+// answered straight from the rings without passing the socket layer. All other
+// traffic is passed on to the regular UdpSocket. The program is attached in
+// generic (SKB) mode so any interface works, including veth.
+class XdpSocket
+{
+public:
+	// Turns a request into its raw response, an empty response is not sent
+	using Handler = std::function<std::vector<char>(std::vector<char>, const sockaddr_in&)>;
+
+	// Sends responses that do not fit into a single frame through the regular socket
+	using Fallback = std::function<void(const sockaddr_in&, std::vector<char>)>;
+
+	XdpSocket(const std::string& interfaceName, uint32_t ipAddress, uint16_t port, Handler setHandler, Fallback setFallback);
+	~XdpSocket();
+	XdpSocket(const XdpSocket&) = delete;
+	XdpSocket& operator=(const XdpSocket&) = delete;
+
+	// Readable whenever the receive ring holds requests
+	int getFd();
+	void receive();
+
+private:
+	struct Ring
+	{
+		uint32_t* producer = nullptr;
+		uint32_t* consumer = nullptr;
+		void* descriptors = nullptr;
+		void* mapping = nullptr;
+		size_t mappingSize = 0;
+	};
+
+	// Frames are split evenly between receiving (fill ring) and sending
+	static const uint32_t FRAME_SIZE = 2048;
+	static const uint32_t FRAME_COUNT = 4096;
+	static const uint32_t RING_SIZE = 2048;
+
+	// Ethernet, IPv4 without options and UDP header
+	static const size_t HEADERS_LENGTH = 14 + 20 + 8;
+
+	Handler handler;
+	Fallback fallback;
+
+	int xdpFd = -1;
+	int mapFd = -1;
+	int programFd = -1;
+	int linkFd = -1;
+	uint8_t* umem = nullptr;
+	size_t maxFrameLength = FRAME_SIZE;
+
+	Ring receiveRing;
+	Ring transmitRing;
+	Ring fillRing;
+	Ring completionRing;
+	std::vector<uint64_t> freeFrames;
+
+	void mapRing(Ring& ring, const xdp_ring_offset& offsets, size_t descriptorSize, off_t pageOffset);
+	void loadProgram(int interfaceIndex, uint32_t ipAddress, uint16_t port);
+	void reclaimFrames();
+	bool transmit(const uint8_t* request, const std::vector<char>& response);
+	void release();
+};
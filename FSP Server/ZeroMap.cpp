@@ -0,0 +1,146 @@
+#include "ZeroMap.h"
+#include "FileHandleCache.h"
+#include "FspHelper.h"
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+bool ZeroMap::scan = false;
+const char ZeroMap::zeroPage[ZeroMap::ZERO_PAGE_SIZE] = {};
+std::mutex ZeroMap::scanMutex;
+std::set<std::string> ZeroMap::scanning;
+
+void ZeroMap::add(uint64_t start, uint64_t end)
+{
+	if (start < end) {
+		ranges.emplace_back(start, end);
+	}
+}
+
+void ZeroMap::finish()
+{
+	std::sort(ranges.begin(), ranges.end());
+
+	std::vector<std::pair<uint64_t, uint64_t>> merged;
+	for (const auto& range : ranges) {
+		if (!merged.empty() && range.first <= merged.back().second) {
+			merged.back().second = std::max(merged.back().second, range.second);
+		}
+		else
+		{
+			merged.push_back(range);
+		}
+	}
+
+	ranges = std::move(merged);
+	ranges.shrink_to_fit();
+}
+
+bool ZeroMap::contains(uint64_t position, size_t length) const
+{
+	if (ranges.empty() || length == 0) {
+		return false;
+	}
+
+	// Last range starting at or before position
+	auto range = std::upper_bound(ranges.begin(), ranges.end(), std::make_pair(position, UINT64_MAX));
+	if (range == ranges.begin()) {
+		return false;
+	}
+
+	--range;
+	return position + length <= range->second;
+}
+
+bool ZeroMap::load(const FileHandle& file)
+{
+	std::ifstream stream(FspHelper::getSidecarPath(file.path, ".fspzero"));
+	std::string magic;
+	uint64_t size = 0;
+	std::string version;
+	if (!std::getline(stream, magic) || magic != "FSP zero map 2" || !(stream >> size >> version) || size != file.size || version != file.getVersion()) {
+		return false;
+	}
+
+	uint64_t start;
+	uint64_t end;
+	while (stream >> start >> end) {
+		add(start, end);
+	}
+
+	return true;
+}
+
+void ZeroMap::scanAsync(const std::shared_ptr<FileHandle>& file)
+{
+	std::lock_guard<std::mutex> lock(scanMutex);
+	if (!scanning.insert(file->path.string()).second) {
+		return;
+	}
+
+	std::thread(scanFile, file).detach();
+}
+
+void ZeroMap::scanFile(std::shared_ptr<FileHandle> file)
+{
+	std::vector<char> buffer(64 * SCAN_BLOCK_SIZE);
+	std::vector<std::pair<uint64_t, uint64_t>> zeros;
+	bool complete = true;
+
+	for (uint64_t position = 0; position < file->size; position += buffer.size()) {
+		size_t length = static_cast<size_t>(std::min<uint64_t>(buffer.size(), file->size - position));
+		if (file->zeros.contains(position, length)) {
+			// Holes are already known
+			continue;
+		}
+
+		if (file->read(buffer.data(), length, position) != static_cast<int64_t>(length) || !file->isValid()) {
+			complete = false;
+			break;
+		}
+
+		for (size_t offset = 0; offset < length; offset += SCAN_BLOCK_SIZE) {
+			size_t blockLength = std::min<size_t>(SCAN_BLOCK_SIZE, length - offset);
+			const char* block = buffer.data() + offset;
+			if (std::all_of(block, block + blockLength, [](char value) { return value == 0; })) {
+				uint64_t start = position + offset;
+				if (!zeros.empty() && zeros.back().second == start) {
+					zeros.back().second = start + blockLength;
+				}
+				else
+				{
+					zeros.emplace_back(start, start + blockLength);
+				}
+			}
+		}
+	}
+
+	if (complete) {
+		std::filesystem::path path = FspHelper::getSidecarPath(file->path, ".fspzero");
+		std::filesystem::path temporaryPath = path;
+		temporaryPath += ".tmp";
+
+		std::error_code error;
+		std::filesystem::create_directories(path.parent_path(), error);
+		std::ofstream stream(temporaryPath, std::ios::trunc);
+		stream << "FSP zero map 2\n" << file->size << " " << file->getVersion() << "\n";
+		for (const auto& range : zeros) {
+			stream << range.first << " " << range.second << "\n";
+		}
+
+		stream.close();
+		if (stream.fail()) {
+			std::filesystem::remove(temporaryPath, error);
+		}
+		else
+		{
+			std::filesystem::rename(temporaryPath, path, error);
+
+			// Handles opened from now on load the new map
+			FileHandleCache::invalidate(file->path);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(scanMutex);
+	scanning.erase(file->path.string());
+}
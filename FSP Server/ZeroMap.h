@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+class FileHandle;
+
+// Ranges of a file that read as zeros: holes of sparse files and, after a zero scan, blocks that are
+// stored but only contain zeros. Requests inside them are answered from a shared zero page.
+class ZeroMap
+{
+public:
+	// Scan files without a zero map for blocks of zeros in the background
+	static bool scan;
+
+	static const uint32_t SCAN_BLOCK_SIZE = 32 * 1024;
+	static const uint64_t MIN_SCAN_SIZE = 16 * 1024 * 1024;
+
+	// Covers the largest block size a client can request
+	static const size_t ZERO_PAGE_SIZE = 65536;
+	static const char zeroPage[ZERO_PAGE_SIZE];
+
+	// Ranges can be added in any order, finish() has to be called before the map is used
+	void add(uint64_t start, uint64_t end);
+	void finish();
+
+	bool contains(uint64_t position, size_t length) const;
+
+	// Adds the ranges stored by an earlier scan, false if there are none for this version of the file
+	bool load(const FileHandle& file);
+
+	// Scans the file on a detached thread, stores the result and reopens the file to pick it up
+	static void scanAsync(const std::shared_ptr<FileHandle>& file);
+
+private:
+	// Sorted and merged after finish()
+	std::vector<std::pair<uint64_t, uint64_t>> ranges;
+
+	static std::mutex scanMutex;
+	static std::set<std::string> scanning;
+
+	static void scanFile(std::shared_ptr<FileHandle> file);
+};